@@ -0,0 +1,544 @@
+// microbenchmarks of the parser and encoder kernels, see "make bench"
+// the parser is compiled into this file, so the static kernels can be measured too
+#include "parser.c"
+
+#define bench_samples 5
+#define bench_sample_ms 50 // default of --time
+#define bench_tolerance 10.0 // %, default of --tolerance
+#define bench_max_results 64
+
+typedef void (*BenchFn)(void*ctx);
+
+typedef struct T_BenchResult {
+	char name[64];
+	double mbps; // 0: not reported
+	double fps;
+	double ns;   // per iteration
+} BenchResult;
+
+typedef struct T_BenchConfig {
+	const char*filter;   // substring of the names to run, NULL: all
+	const char*baseline; // earlier output to compare with
+	double tolerance;
+	unsigned long long sample_ns;
+} BenchConfig;
+
+static BenchConfig g_bench = { NULL, NULL, bench_tolerance, bench_sample_ms*1000000ull };
+static BenchResult g_results[bench_max_results];
+static int g_resultcnt = 0;
+static volatile unsigned long long g_sink; // keeps the results of the kernels alive
+
+static unsigned long long benchNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec*1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+static int benchCompare(const void*a, const void*b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// median ns per iteration of bench_samples samples, each at least sample_ns long
+static double benchMeasure(BenchFn fn, void*ctx) {
+	unsigned long long iters = 1, dt = 0;
+	for(;;) { // calibration, also the warm-up
+		unsigned long long t0 = benchNow();
+		for(unsigned long long i=0; i<iters; ++i) fn(ctx);
+		dt = benchNow() - t0;
+		if((dt >= g_bench.sample_ns / 4) || (iters >= (1ull << 40))) break;
+		iters *= 2;
+	}
+	if(dt < g_bench.sample_ns) iters = iters * g_bench.sample_ns / (dt ? dt : 1) + 1;
+	double samples[bench_samples];
+	for(int s=0; s<bench_samples; ++s) {
+		unsigned long long t0 = benchNow();
+		for(unsigned long long i=0; i<iters; ++i) fn(ctx);
+		samples[s] = (double)(benchNow() - t0) / (double)iters;
+	}
+	qsort(samples, bench_samples, sizeof(double), benchCompare);
+	return samples[bench_samples / 2];
+}
+
+// bytes and frames: per iteration, 0 if the rate makes no sense for the case
+static void benchRun(const char*name, BenchFn fn, void*ctx, double bytes, double frames) {
+	if(g_bench.filter && !strstr(name, g_bench.filter)) return;
+	if(g_resultcnt >= bench_max_results) return;
+	BenchResult*r = &g_results[g_resultcnt++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->ns = benchMeasure(fn, ctx);
+	r->mbps = bytes ? bytes / r->ns * 1e9 / 1e6 : 0;
+	r->fps = frames ? frames / r->ns * 1e9 : 0;
+	printf("%s\t%.2f\t%.2f\t%.1f\n", r->name, r->mbps, r->fps, r->ns);
+	fflush(stdout);
+}
+
+// deterministic inputs: xorshift with a fixed seed
+static unsigned long long benchRand(unsigned long long*state) {
+	unsigned long long x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return (*state = x);
+}
+
+// caption "bench\n", ntags tags of 1..taglen letters, pixels from the seed
+static char* benchMakeCIFF(unsigned long long w, unsigned long long h, unsigned long long ntags, unsigned long long taglen, unsigned long long seed, size_t*len) {
+	unsigned long long st = seed;
+	unsigned long long*lens = (unsigned long long*)malloc((ntags ? ntags : 1) * sizeof(unsigned long long));
+	unsigned long long hs = ciff_offset_caption + 6;
+	for(unsigned long long i=0; i<ntags; ++i) {
+		lens[i] = 1 + benchRand(&st) % taglen;
+		hs += lens[i] + 1;
+	}
+	*len = hs + w*h*3;
+	char*buf = (char*)malloc(*len);
+	memcpy(buf, MagicCIFF, MagicCIFFlen);
+	storeUInt64(buf + ciff_offset_header_size, hs);
+	storeUInt64(buf + ciff_offset_content_size, w*h*3);
+	storeUInt64(buf + ciff_offset_width, w);
+	storeUInt64(buf + ciff_offset_height, h);
+	char*p = buf + ciff_offset_caption;
+	memcpy(p, "bench\n", 6);
+	p += 6;
+	for(unsigned long long i=0; i<ntags; ++i) {
+		for(unsigned long long k=0; k<lens[i]; ++k) *p++ = 'a' + benchRand(&st) % 26;
+		*p++ = '\0';
+	}
+	// smooth gradients with some noise, closer to photos than pure noise
+	unsigned char*px = (unsigned char*)p;
+	for(unsigned long long y=0; y<h; ++y)
+		for(unsigned long long x=0; x<w; ++x) {
+			unsigned char n = (unsigned char)(benchRand(&st) & 15);
+			*px++ = (unsigned char)(x * 255 / (w ? w : 1)) ^ n;
+			*px++ = (unsigned char)(y * 255 / (h ? h : 1)) ^ n;
+			*px++ = (unsigned char)((x + y) & 0xff);
+		}
+	free(lens);
+	return buf;
+}
+
+// header, credits and nframes copies of the given CIFF, 40 ms each
+static char* benchMakeCAFF(const char*ciff, size_t ciffLen, unsigned long long nframes, size_t*len) {
+	const char creator[] = "bench";
+	const size_t credits = caff_credirs_offset_creator + sizeof(creator) - 1;
+	*len = (1+8+caff_header_len) + (1+8+credits) + nframes*(1+8+8+ciffLen);
+	char*buf = (char*)calloc(1, *len);
+	char*p = buf;
+	*p = CAFF_BLOCK_HEADER;
+	storeUInt64(p+1, caff_header_len);
+	memcpy(p+9, MagicCAFF, MagicCAFFlen);
+	storeUInt64(p+9+caff_header_offset_header_size, caff_header_len);
+	storeUInt64(p+9+caff_header_offset_num_anim, nframes);
+	p += 1+8+caff_header_len;
+	*p = CAFF_BLOCK_CREDITS;
+	storeUInt64(p+1, credits);
+	p[9+caff_credirs_offset_year] = (char)(2020 & 0xff);
+	p[9+caff_credirs_offset_year+1] = (char)(2020 >> 8);
+	p[9+caff_credirs_offset_month] = 1;
+	p[9+caff_credirs_offset_day] = 1;
+	storeUInt64(p+9+caff_credirs_offset_creator_len, sizeof(creator) - 1);
+	memcpy(p+9+caff_credirs_offset_creator, creator, sizeof(creator) - 1);
+	p += 1+8+credits;
+	for(unsigned long long k=0; k<nframes; ++k) {
+		*p = CAFF_BLOCK_ANIMATION;
+		storeUInt64(p+1, 8+ciffLen);
+		storeUInt64(p+9, 40);
+		memcpy(p+17, ciff, ciffLen);
+		p += 1+8+8+ciffLen;
+	}
+	return buf;
+}
+
+// ---- cases
+
+typedef struct T_BufCtx {
+	const char*data;
+	size_t len;
+	HeaderScanFn scan;
+	Arena arena;
+	const EncodeOptions*enc;
+	const CIFF*ciff;
+	CAFF*caff;
+	OutBuffer out;
+} BufCtx;
+
+static void benchLoadUInt64(void*arg) {
+	BufCtx*c = (BufCtx*)arg;
+	unsigned long long sum = 0;
+	for(size_t i=0; i+8<=c->len; i+=8) sum += loadUInt64(c->data + i);
+	g_sink = sum;
+}
+
+static void benchHeaderScan(void*arg) {
+	BufCtx*c = (BufCtx*)arg;
+	HeaderScan hs;
+	c->scan(c->data, c->len, &hs);
+	g_sink = hs.nul;
+}
+
+static void benchXXH64(void*arg) {
+	BufCtx*c = (BufCtx*)arg;
+	g_sink = xxh64(c->data, c->len, 0);
+}
+
+static void benchCIFFParse(void*arg) {
+	BufCtx*c = (BufCtx*)arg;
+	CIFF*ciff = NULL;
+	if(ciffParse(c->data, c->len, &ciff, &c->arena) != RET_OK) abort();
+	g_sink = ciff->tagcnt;
+	arena_reset(&c->arena);
+}
+
+// the structure and every frame's caption and tags, what a preview of all frames needs
+static void benchCAFFParse(void*arg) {
+	BufCtx*c = (BufCtx*)arg;
+	CAFF*caff = NULL;
+	if(caffParse(c->data, c->len, &caff, &c->arena) != RET_OK) abort();
+	for(unsigned long long k=0; k<caff->header.num_anim; ++k) {
+		CIFF*f = NULL;
+		if(caff_frame(caff, k, &f) != RET_OK) abort();
+		g_sink = f->tagcnt;
+	}
+	arena_reset(&c->arena);
+}
+
+// every frame hashed and, as they are all the same, compared with the first one: the cost that saves the encodes
+static void benchDedup(void*arg) {
+	BufCtx*c = (BufCtx*)arg;
+	c->caff->unique_frames = 0;
+	if(caffDedup(c->caff) != RET_OK) abort();
+	g_sink = c->caff->unique_frames;
+}
+
+static void benchEncode(void*arg) {
+	BufCtx*c = (BufCtx*)arg;
+	c->out.len = 0;
+	if(encodeJPG(c->ciff, c->enc, &c->out) != RET_OK) abort();
+	g_sink = c->out.len;
+}
+
+static void bufctx_init(BufCtx*c, const char*data, size_t len) {
+	memset(c, 0, sizeof(*c));
+	c->data = data;
+	c->len = len;
+	arena_init(&c->arena);
+	outbuffer_init(&c->out);
+}
+
+static void bufctx_clear(BufCtx*c) {
+	arena_clear(&c->arena);
+	outbuffer_clear(&c->out);
+}
+
+static void benchKernels(void) {
+	const size_t len = 1ul*1024*1024;
+	size_t cifflen;
+	// a tag area of ~1 MiB: short tags, one '\n' at the start as in a real header
+	char*ciff = benchMakeCIFF(1, 1, 150000, 12, 1, &cifflen);
+	char*area = ciff + ciff_offset_caption;
+	size_t arealen = loadUInt64(ciff + ciff_offset_header_size) - ciff_offset_caption;
+	BufCtx c;
+	bufctx_init(&c, area, arealen);
+	benchRun("load_uint64_1m", benchLoadUInt64, &c, (double)(arealen & ~(size_t)7), 0);
+	c.scan = headerScanScalar;
+	benchRun("header_scan_scalar_1m", benchHeaderScan, &c, (double)arealen, 0);
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) {
+		c.scan = headerScanSSE2;
+		benchRun("header_scan_sse2_1m", benchHeaderScan, &c, (double)arealen, 0);
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		c.scan = headerScanAVX2;
+		benchRun("header_scan_avx2_1m", benchHeaderScan, &c, (double)arealen, 0);
+	}
+#endif
+	bufctx_clear(&c);
+	free(ciff);
+
+	char*noise = (char*)malloc(len);
+	unsigned long long st = 7;
+	for(size_t i=0; i<len; i+=8) {
+		unsigned long long v = benchRand(&st);
+		memcpy(noise + i, &v, 8);
+	}
+	bufctx_init(&c, noise, len);
+	benchRun("xxh64_1m", benchXXH64, &c, (double)len, 0);
+	bufctx_clear(&c);
+	free(noise);
+}
+
+static void benchParse(void) {
+	static const unsigned long long tagcounts[] = { 10, 1000, 100000 };
+	char name[64];
+	BufCtx c;
+	InputBuffer in;
+	if(inputbuffer_open("test_files/1.2.ciff", &in, 0) == RET_OK) {
+		bufctx_init(&c, in.data, in.len);
+		benchRun("ciff_parse_sample", benchCIFFParse, &c, (double)in.len, 1);
+		bufctx_clear(&c);
+		inputbuffer_clear(&in);
+	}
+	else printf("# skip ciff_parse_sample: test_files/1.2.ciff\n");
+	for(size_t i=0; i<sizeof(tagcounts)/sizeof(tagcounts[0]); ++i) {
+		size_t len;
+		char*ciff = benchMakeCIFF(1, 1, tagcounts[i], 16, 2, &len);
+		bufctx_init(&c, ciff, len);
+		snprintf(name, sizeof(name), "ciff_parse_tags_%llu", tagcounts[i]);
+		benchRun(name, benchCIFFParse, &c, (double)len, 1);
+		bufctx_clear(&c);
+		free(ciff);
+	}
+
+	static const char*const samples[] = { "test_files/1.caff", "test_files/3.caff" };
+	for(size_t i=0; i<sizeof(samples)/sizeof(samples[0]); ++i) {
+		if(inputbuffer_open(samples[i], &in, 0) != RET_OK) {
+			printf("# skip caff_parse: %s\n", samples[i]);
+			continue;
+		}
+		bufctx_init(&c, in.data, in.len);
+		CAFF*caff = NULL;
+		double frames = (caffParse(in.data, in.len, &caff, &c.arena) == RET_OK) ? (double)caff->header.num_anim : 0;
+		arena_reset(&c.arena);
+		snprintf(name, sizeof(name), "caff_parse_sample_%s", strrchr(samples[i], '/') + 1);
+		*strrchr(name, '.') = '\0';
+		benchRun(name, benchCAFFParse, &c, (double)in.len, frames);
+		bufctx_clear(&c);
+		inputbuffer_clear(&in);
+	}
+	static const unsigned long long framecounts[] = { 10, 1000 };
+	for(size_t i=0; i<sizeof(framecounts)/sizeof(framecounts[0]); ++i) {
+		size_t cifflen, len;
+		char*ciff = benchMakeCIFF(16, 16, 8, 8, 3, &cifflen);
+		char*caff = benchMakeCAFF(ciff, cifflen, framecounts[i], &len);
+		bufctx_init(&c, caff, len);
+		snprintf(name, sizeof(name), "caff_parse_frames_%llu", framecounts[i]);
+		benchRun(name, benchCAFFParse, &c, (double)len, (double)framecounts[i]);
+		bufctx_clear(&c);
+		free(caff);
+		free(ciff);
+	}
+	// a static hold of 256x256 frames, next to encode_jpg_balanced_256
+	size_t cifflen, len;
+	char*ciff = benchMakeCIFF(256, 256, 4, 8, 4, &cifflen);
+	char*caff = benchMakeCAFF(ciff, cifflen, 100, &len);
+	bufctx_init(&c, caff, len);
+	if(caffParse(caff, len, &c.caff, &c.arena) != RET_OK) abort();
+	benchRun("caff_dedup_256_x100", benchDedup, &c, 100.0 * 256 * 256 * 3, 100);
+	caff_clear(c.caff);
+	bufctx_clear(&c);
+	free(caff);
+	free(ciff);
+}
+
+// single threaded (no strips): every profile on the sample, the default profile on synthetic sizes
+static void benchEncodeJPG(void) {
+	static const JPGProfile profiles[] = { JPG_PROFILE_FAST, JPG_PROFILE_BALANCED, JPG_PROFILE_SMALL };
+	static const unsigned long long sizes[] = { 256, 2048 };
+	char name[64];
+	EncodeOptions enc;
+	encodeoptions_init(&enc);
+	BufCtx c;
+	InputBuffer in;
+	Arena arena;
+	arena_init(&arena);
+	CIFF*ciff = NULL;
+	if((inputbuffer_open("test_files/1.2.ciff", &in, 0) == RET_OK) && (ciffParse(in.data, in.len, &ciff, &arena) == RET_OK)) {
+		for(size_t i=0; i<sizeof(profiles)/sizeof(profiles[0]); ++i) {
+			enc.profile = profiles[i];
+			bufctx_init(&c, NULL, 0);
+			c.ciff = ciff;
+			c.enc = &enc;
+			snprintf(name, sizeof(name), "encode_jpg_%s_sample", jpgProfileName(profiles[i]));
+			benchRun(name, benchEncode, &c, (double)ciff->content_size, 1);
+			bufctx_clear(&c);
+		}
+		enc.profile = JPG_PROFILE_BALANCED;
+		enc.scale = 4;
+		bufctx_init(&c, NULL, 0);
+		c.ciff = ciff;
+		c.enc = &enc;
+		benchRun("encode_jpg_scale4_sample", benchEncode, &c, (double)ciff->content_size, 1);
+		bufctx_clear(&c);
+		enc.scale = 1;
+	}
+	else printf("# skip encode_jpg_*_sample: test_files/1.2.ciff\n");
+	inputbuffer_clear(&in);
+	for(size_t i=0; i<sizeof(sizes)/sizeof(sizes[0]); ++i) {
+		size_t len;
+		char*buf = benchMakeCIFF(sizes[i], sizes[i], 4, 8, 4, &len);
+		arena_reset(&arena);
+		if(ciffParse(buf, len, &ciff, &arena) != RET_OK) abort();
+		bufctx_init(&c, NULL, 0);
+		c.ciff = ciff;
+		c.enc = &enc;
+		snprintf(name, sizeof(name), "encode_jpg_balanced_%llu", sizes[i]);
+		benchRun(name, benchEncode, &c, (double)ciff->content_size, 1);
+		bufctx_clear(&c);
+		free(buf);
+	}
+	arena_clear(&arena);
+}
+
+// ---- RGB -> YCbCr for the raw-data JPEG input
+
+typedef struct T_YCCKernel {
+	const char*name;
+	YCCRowsFn fn;
+} YCCKernel;
+
+// the kernels this CPU runs, scalar first
+static int benchYCCKernels(YCCKernel*k) {
+	int n = 0;
+	k[n].name = "scalar";
+	k[n++].fn = yccRowsScalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("ssse3")) {
+		k[n].name = "ssse3";
+		k[n++].fn = yccRowsSSSE3;
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		k[n].name = "avx2";
+		k[n++].fn = yccRowsAVX2;
+	}
+#endif
+	return n;
+}
+
+// one frame, single threaded, RGB scanlines converted by libjpeg
+static void benchEncodeRGBRows(const CIFF*ciff, OutBuffer*out) {
+	struct jpeg_compress_struct*cinfo = jpgAcquire();
+	if(!cinfo) abort();
+	if(jpgCatch(cinfo)) abort();
+	jpgMemDest(cinfo, out, jpgExpectedSize(ciff->width, ciff->height));
+	jpgSetup(cinfo, ciff->width, ciff->height, NULL);
+	jpeg_start_compress(cinfo, TRUE);
+	jpgWriteRows(cinfo, ciff->imgbuf, ciff->width * 3, ciff->height);
+	jpeg_finish_compress(cinfo);
+	jpgRelease(cinfo);
+}
+
+typedef struct T_YCCCtx {
+	const CIFF*ciff;
+	YCCRowsFn fn;
+	YCCPlanes planes;
+	OutBuffer out;
+} YCCCtx;
+
+// the whole frame into one iMCU row worth of planes, the conversion alone
+static void benchYCCRows(void*arg) {
+	YCCCtx*c = (YCCCtx*)arg;
+	const size_t stride = c->ciff->width * 3;
+	const unsigned char*px = (const unsigned char*)c->ciff->imgbuf;
+	for(unsigned long long y=0; y<c->ciff->height; y+=2) {
+		const unsigned char*r0 = px + y * stride;
+		const unsigned char*r1 = (y+1 < c->ciff->height) ? r0 + stride : r0;
+		c->fn(r0, r1, c->ciff->width, c->planes.cw, c->planes.y[0], c->planes.y[1], c->planes.cb[0], c->planes.cr[0]);
+	}
+	g_sink = c->planes.cb[0][0];
+}
+
+static void benchEncodeRGBInput(void*arg) {
+	YCCCtx*c = (YCCCtx*)arg;
+	c->out.len = 0;
+	benchEncodeRGBRows(c->ciff, &c->out);
+	g_sink = c->out.len;
+}
+
+// every kernel on a 1080p frame, and the 2048 encode with libjpeg's own conversion for encode_jpg_balanced_2048
+static void benchYCC(void) {
+	YCCKernel kernels[3];
+	const int nk = benchYCCKernels(kernels);
+	char name[64];
+	Arena arena;
+	arena_init(&arena);
+	size_t len;
+	char*buf = benchMakeCIFF(1920, 1080, 4, 8, 6, &len);
+	YCCCtx c;
+	memset(&c, 0, sizeof(c));
+	CIFF*ciff = NULL;
+	if((ciffParse(buf, len, &ciff, &arena) != RET_OK) || (yccplanes_init(&c.planes, ciff->width) != RET_OK)) abort();
+	c.ciff = ciff;
+	for(int k=0; k<nk; ++k) {
+		c.fn = kernels[k].fn;
+		snprintf(name, sizeof(name), "ycc_rows_%s_1080p", kernels[k].name);
+		benchRun(name, benchYCCRows, &c, (double)ciff->content_size, 1);
+	}
+	yccplanes_clear(&c.planes);
+	arena_reset(&arena);
+	free(buf);
+
+	buf = benchMakeCIFF(2048, 2048, 4, 8, 4, &len);
+	if(ciffParse(buf, len, &ciff, &arena) != RET_OK) abort();
+	c.ciff = ciff;
+	outbuffer_init(&c.out);
+	benchRun("encode_jpg_rgb_input_2048", benchEncodeRGBInput, &c, (double)ciff->content_size, 1);
+	outbuffer_clear(&c.out);
+	arena_clear(&arena);
+	free(buf);
+}
+
+// the rate that matters per case: MB/s, frames/s if there is no byte rate
+static double benchRate(double mbps, double fps) {
+	return (mbps > 0) ? mbps : fps;
+}
+
+// 1 if a case got slower than the tolerance allows
+static int benchBaseline(const char*fn) {
+	FILE*f = fopen(fn, "r");
+	if(!f) {
+		fprintf(stderr, "can't read the baseline %s\n", fn);
+		return 1;
+	}
+	int regressions = 0;
+	char line[256];
+	fprintf(stderr, "# %-28s %12s %12s %8s\n", "case", "baseline", "now", "change");
+	while(fgets(line, sizeof(line), f)) {
+		char name[64];
+		double mbps, fps;
+		if((line[0] == '#') || (sscanf(line, "%63s %lf %lf", name, &mbps, &fps) != 3)) continue;
+		for(int i=0; i<g_resultcnt; ++i) {
+			if(strcmp(g_results[i].name, name)) continue;
+			double base = benchRate(mbps, fps), now = benchRate(g_results[i].mbps, g_results[i].fps);
+			double change = base > 0 ? (now / base - 1.0) * 100.0 : 0;
+			int slow = (change < -g_bench.tolerance);
+			regressions += slow;
+			fprintf(stderr, "%s %-28s %12.2f %12.2f %+7.1f%%\n", slow ? "!" : " ", name, base, now, change);
+		}
+	}
+	fclose(f);
+	if(regressions) fprintf(stderr, "%d case(s) slower than the baseline by more than %.1f%%\n", regressions, g_bench.tolerance);
+	return regressions ? 1 : 0;
+}
+
+static void benchHelp(const char*pn) {
+	printf("Usage: %s [options]\n"
+	"\t--filter S\tonly the cases with S in their name\n"
+	"\t--time MS\tlength of one sample (default: %d), every case takes %d samples, the median is reported\n"
+	"\t--baseline F\tcompare with an earlier output, exit 1 on regressions\n"
+	"\t--tolerance P\tallowed slowdown in %% (default: %.0f)\n"
+	"output: name, MB/s, frames/s, ns per iteration (tab separated, 0: not applicable)\n", pn, bench_sample_ms, bench_samples, bench_tolerance);
+}
+
+int main(int argc, char** argv) {
+	for(int i=1; i<argc; ++i) {
+		if((strcmp(argv[i], "--filter") == 0) && (i+1 < argc)) g_bench.filter = argv[++i];
+		else if((strcmp(argv[i], "--baseline") == 0) && (i+1 < argc)) g_bench.baseline = argv[++i];
+		else if((strcmp(argv[i], "--tolerance") == 0) && (i+1 < argc)) g_bench.tolerance = atof(argv[++i]);
+		else if((strcmp(argv[i], "--time") == 0) && (i+1 < argc)) g_bench.sample_ns = strtoull(argv[++i], NULL, 10) * 1000000ull;
+		else {
+			benchHelp(argv[0]);
+			return (strcmp(argv[i], "-h") && strcmp(argv[i], "--help")) ? 1 : 0;
+		}
+	}
+	g_log = stderr;
+	g_log_level = log_error;
+	printf("# name\tMB/s\tframes/s\tns/iter\n");
+	benchKernels();
+	benchParse();
+	benchEncodeJPG();
+	benchYCC();
+	return g_bench.baseline ? benchBaseline(g_bench.baseline) : 0;
+}
@@ -0,0 +1,244 @@
+// generator of valid CIFF/CAFF files for load tests, see "make corpus"
+// the parser is compiled into this file for the format constants and --verify
+#include "parser.c"
+
+#define gen_write_buffer (1ul*1024*1024)
+
+typedef struct T_GenConfig {
+	FileType type;
+	const char*output;           // "-": stdout
+	unsigned long long width;
+	unsigned long long height;
+	unsigned long long frames;   // CAFF
+	unsigned long long duration; // ms per frame
+	unsigned long long tags;     // per CIFF
+	unsigned long long tagLen;   // the longest tag, the lengths are 1..tagLen
+	unsigned long long captionLen;
+	double dup;                  // 0..1: share of frames repeating an earlier one
+	unsigned long long seed;
+	int verify;                  // parse the written file
+} GenConfig;
+
+void genconfig_init(GenConfig*g) {
+	g->type = FTYPE_CAFF;
+	g->output = NULL;
+	g->width = 64;
+	g->height = 64;
+	g->frames = 1;
+	g->duration = 40;
+	g->tags = 4;
+	g->tagLen = 8;
+	g->captionLen = 16;
+	g->dup = 0;
+	g->seed = 1;
+	g->verify = 0;
+}
+
+static unsigned long long genRand(unsigned long long*state) {
+	unsigned long long x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return (*state = x);
+}
+
+// the header of a frame is kept in memory, the pixels are written row by row
+static unsigned long long genHeaderSize(const GenConfig*g, unsigned long long seed) {
+	unsigned long long st = seed, hs = ciff_offset_caption + g->captionLen + 1;
+	for(unsigned long long i=0; i<g->tags; ++i) hs += 1 + genRand(&st) % g->tagLen + 1;
+	return hs;
+}
+
+unsigned long long genCIFFSize(const GenConfig*g, unsigned long long seed) {
+	return genHeaderSize(g, seed) + g->width*g->height*3;
+}
+
+// one frame, everything derived from seed: equal seeds give equal frames
+ReturnCode genCIFF(const GenConfig*g, unsigned long long seed, FILE*f) {
+	const unsigned long long hs = genHeaderSize(g, seed);
+	char*h = (char*)malloc(hs);
+	unsigned char*row = (unsigned char*)malloc(g->width*3 + 1);
+	if(!h || !row) {
+		free(h);
+		free(row);
+		return RET_ERR_MEM;
+	}
+	memcpy(h, MagicCIFF, MagicCIFFlen);
+	storeUInt64(h + ciff_offset_header_size, hs);
+	storeUInt64(h + ciff_offset_content_size, g->width*g->height*3);
+	storeUInt64(h + ciff_offset_width, g->width);
+	storeUInt64(h + ciff_offset_height, g->height);
+	char*p = h + ciff_offset_caption;
+	unsigned long long st = seed;
+	for(unsigned long long i=0; i<g->tags; ++i) genRand(&st); // the tag lengths, see genHeaderSize
+	for(unsigned long long i=0; i<g->captionLen; ++i) *p++ = (i % 6 == 5) ? ' ' : 'a' + genRand(&st) % 26;
+	*p++ = '\n';
+	unsigned long long lst = seed;
+	for(unsigned long long i=0; i<g->tags; ++i) {
+		unsigned long long len = 1 + genRand(&lst) % g->tagLen;
+		for(unsigned long long k=0; k<len; ++k) *p++ = 'a' + genRand(&st) % 26;
+		*p++ = '\0';
+	}
+	ReturnCode ret = (fwrite(h, 1, hs, f) == hs) ? RET_OK : RET_ERR_IO;
+	// gradients moving with the seed and some noise, roughly photo-like for the encoder
+	const unsigned long long shift = seed & 0xff;
+	for(unsigned long long y=0; (ret == RET_OK) && (y<g->height); ++y) {
+		unsigned char*q = row;
+		for(unsigned long long x=0; x<g->width; ++x) {
+			unsigned char n = (unsigned char)(genRand(&st) & 15);
+			*q++ = (unsigned char)(x * 255 / g->width + shift) ^ n;
+			*q++ = (unsigned char)(y * 255 / g->height) ^ n;
+			*q++ = (unsigned char)((x + y + shift) & 0xff);
+		}
+		if(fwrite(row, 3, g->width, f) != g->width) ret = RET_ERR_IO;
+	}
+	free(row);
+	free(h);
+	return ret;
+}
+
+static ReturnCode genBlock(FILE*f, CAFFBlockType type, unsigned long long len) {
+	char b[9];
+	b[0] = (char)type;
+	storeUInt64(b + 1, len);
+	return (fwrite(b, 1, 9, f) == 9) ? RET_OK : RET_ERR_IO;
+}
+
+ReturnCode genCAFF(const GenConfig*g, FILE*f) {
+	char h[caff_header_len];
+	memcpy(h, MagicCAFF, MagicCAFFlen);
+	storeUInt64(h + caff_header_offset_header_size, caff_header_len);
+	storeUInt64(h + caff_header_offset_num_anim, g->frames);
+	ReturnCode ret = genBlock(f, CAFF_BLOCK_HEADER, caff_header_len);
+	if((ret == RET_OK) && (fwrite(h, 1, caff_header_len, f) != caff_header_len)) ret = RET_ERR_IO;
+
+	const char creator[] = "caffgen";
+	char c[caff_credirs_offset_creator + sizeof(creator) - 1];
+	c[caff_credirs_offset_year] = (char)(2020 & 0xff);
+	c[caff_credirs_offset_year + 1] = (char)(2020 >> 8);
+	c[caff_credirs_offset_month] = 1;
+	c[caff_credirs_offset_day] = 1;
+	c[caff_credirs_offset_hour] = 12;
+	c[caff_credirs_offset_minute] = 0;
+	storeUInt64(c + caff_credirs_offset_creator_len, sizeof(creator) - 1);
+	memcpy(c + caff_credirs_offset_creator, creator, sizeof(creator) - 1);
+	if(ret == RET_OK) ret = genBlock(f, CAFF_BLOCK_CREDITS, sizeof(c));
+	if((ret == RET_OK) && (fwrite(c, 1, sizeof(c), f) != sizeof(c))) ret = RET_ERR_IO;
+
+	// a duplicate takes the seed of an earlier frame, half of the time the previous one
+	unsigned long long st = g->seed | 1, distinct = 0;
+	const unsigned long long threshold = (unsigned long long)(g->dup * 1e6);
+	for(unsigned long long k=0; (ret == RET_OK) && (k<g->frames); ++k) {
+		unsigned long long seed;
+		if(distinct && (genRand(&st) % 1000000 < threshold)) {
+			unsigned long long back = (genRand(&st) & 1) ? 0 : genRand(&st) % distinct;
+			seed = g->seed + (distinct - 1 - back);
+		}
+		else seed = g->seed + distinct++;
+		char d[8];
+		storeUInt64(d, g->duration);
+		ret = genBlock(f, CAFF_BLOCK_ANIMATION, 8 + genCIFFSize(g, seed));
+		if((ret == RET_OK) && (fwrite(d, 1, 8, f) != 8)) ret = RET_ERR_IO;
+		if(ret == RET_OK) ret = genCIFF(g, seed, f);
+	}
+	return ret;
+}
+
+// the parser's own validation of the generated file
+ReturnCode genVerify(const GenConfig*g) {
+	InputBuffer in;
+	ReturnCode ret = inputbuffer_open(g->output, &in, 1);
+	if(ret != RET_OK) return ret;
+	Arena arena;
+	arena_init(&arena);
+	if(g->type == FTYPE_CIFF) {
+		CIFF*ciff = NULL;
+		ret = ciffParse(in.data, in.len, &ciff, &arena);
+		if((ret == RET_OK) && !ciff) ret = RET_ERR_CHK;
+	}
+	else {
+		CAFF*caff = NULL;
+		ret = caffParse(in.data, in.len, &caff, &arena);
+		if((ret == RET_OK) && !caff) ret = RET_ERR_CHK;
+		for(unsigned long long k=0; (ret == RET_OK) && (k<caff->header.num_anim); ++k) {
+			CIFF*frame = NULL;
+			ret = caff_frame(caff, k, &frame);
+		}
+		caff_clear(caff);
+	}
+	arena_clear(&arena);
+	inputbuffer_clear(&in);
+	return ret;
+}
+
+static int genNumber(const char*s, unsigned long long*v) {
+	char*end;
+	errno = 0;
+	*v = strtoull(s, &end, 10);
+	return (errno || (end == s) || *end) ? 1 : 0;
+}
+
+void genHelp(const char*pn) {
+	printf("Usage: %s [options] -o [file|-]\n"
+	"\t--ciff / --caff\t\tfile type (default: caff)\n"
+	"\t-W N, -H N\t\twidth and height of the frames (default: 64)\n"
+	"\t--frames N\t\tnumber of CAFF frames (default: 1)\n"
+	"\t--duration MS\t\tduration of one frame (default: 40)\n"
+	"\t--tags N\t\ttags per CIFF (default: 4)\n"
+	"\t--tag-len N\t\tthe longest tag (default: 8)\n"
+	"\t--caption-len N\t\t(default: 16)\n"
+	"\t--dup R\t\t\t0..1, share of frames repeating an earlier frame (default: 0)\n"
+	"\t--seed N\t\tthe same seed and options give the same file (default: 1)\n"
+	"\t--verify\t\tparse the written file\n"
+	"the file is written frame by frame and row by row, it can be larger than the memory\n", pn);
+}
+
+int main(int argc, char** argv) {
+	GenConfig g;
+	genconfig_init(&g);
+	int bad = (argc < 2);
+	for(int i=1; !bad && (i<argc); ++i) {
+		const int next = (i+1 < argc);
+		if(strcmp(argv[i], "--ciff") == 0) g.type = FTYPE_CIFF;
+		else if(strcmp(argv[i], "--caff") == 0) g.type = FTYPE_CAFF;
+		else if((strcmp(argv[i], "-o") == 0) && next) g.output = argv[++i];
+		else if((strcmp(argv[i], "-W") == 0) && next) bad = genNumber(argv[++i], &g.width);
+		else if((strcmp(argv[i], "-H") == 0) && next) bad = genNumber(argv[++i], &g.height);
+		else if((strcmp(argv[i], "--frames") == 0) && next) bad = genNumber(argv[++i], &g.frames);
+		else if((strcmp(argv[i], "--duration") == 0) && next) bad = genNumber(argv[++i], &g.duration);
+		else if((strcmp(argv[i], "--tags") == 0) && next) bad = genNumber(argv[++i], &g.tags);
+		else if((strcmp(argv[i], "--tag-len") == 0) && next) bad = genNumber(argv[++i], &g.tagLen);
+		else if((strcmp(argv[i], "--caption-len") == 0) && next) bad = genNumber(argv[++i], &g.captionLen);
+		else if((strcmp(argv[i], "--seed") == 0) && next) bad = genNumber(argv[++i], &g.seed);
+		else if((strcmp(argv[i], "--dup") == 0) && next) {
+			g.dup = atof(argv[++i]);
+			bad = (g.dup < 0) || (g.dup > 1);
+		}
+		else if(strcmp(argv[i], "--verify") == 0) g.verify = 1;
+		else bad = 1;
+	}
+	if(bad || !g.output || !g.width || !g.height || !g.tagLen || (g.type == FTYPE_CAFF && !g.frames)) {
+		genHelp(argv[0]);
+		return 1;
+	}
+	if(g.verify && (strcmp(g.output, "-") == 0)) {
+		fprintf(stderr, "--verify needs a file\n");
+		return 1;
+	}
+	const int tostdout = (strcmp(g.output, "-") == 0);
+	FILE*f = tostdout ? stdout : fopen(g.output, "wb");
+	if(!f) {
+		fprintf(stderr, "can't create %s\n", g.output);
+		return 1;
+	}
+	setvbuf(f, NULL, _IOFBF, gen_write_buffer);
+	ReturnCode ret = (g.type == FTYPE_CIFF) ? genCIFF(&g, g.seed, f) : genCAFF(&g, f);
+	if((fflush(f) != 0) && (ret == RET_OK)) ret = RET_ERR_IO;
+	if(!tostdout) fclose(f);
+	if((ret == RET_OK) && g.verify) ret = genVerify(&g);
+	if(ret != RET_OK) {
+		fprintf(stderr, "%s: %s\n", g.output, rt2s(ret));
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,329 @@
+// the C++ API of libcaff over the parser core, see libcaff.hpp
+#include <new>
+#include <cstddef>
+#include "parser.h"
+#include "libcaff.hpp"
+
+namespace caff {
+
+// the public enums are the parser's ones under other names, CIFFSlice arrays are handed out as they are
+static_assert((CAFF_OK == (int)RET_OK) && (CAFF_ERR_RES_CONSTRAINT == (int)RET_ERR_RES_CONSTRAINT), "ReturnCode");
+static_assert((CAFF_FTYPE_CIFF == (int)FTYPE_CIFF) && (CAFF_FTYPE_CAFF == (int)FTYPE_CAFF), "FileType");
+static_assert((CAFF_FORMAT_JPG == (int)FORMAT_JPG) && (CAFF_FORMAT_WEBP == (int)FORMAT_WEBP), "OutputFormat");
+static_assert((CAFF_JPG_BALANCED == (int)JPG_PROFILE_BALANCED) && (CAFF_JPG_FAST == (int)JPG_PROFILE_FAST) &&
+	(CAFF_JPG_SMALL == (int)JPG_PROFILE_SMALL), "JPGProfile");
+static_assert((CAFF_LOG_ERROR == log_error) && (CAFF_LOG_INFO == log_info) && (CAFF_LOG_DEBUG == log_debug), "LogLevel");
+static_assert((sizeof(CIFFSlice) == sizeof(::CIFFSlice)) && (offsetof(CIFFSlice, ptr) == offsetof(::CIFFSlice, ptr)) &&
+	(offsetof(CIFFSlice, len) == offsetof(::CIFFSlice, len)), "CIFFSlice");
+
+// the name of the previews in the parser's log lines
+static const char*const label = "buffer";
+
+static ::EncodeOptions encodeOptions(const EncodeOptions&enc) {
+	::EncodeOptions e;
+	encodeoptions_init(&e);
+	e.format = (::OutputFormat)enc.format;
+	e.scale = enc.scale;
+	e.maxDim = enc.maxDim;
+	e.profile = (::JPGProfile)enc.profile;
+	e.quality = enc.quality;
+	e.lossless = enc.lossless;
+	e.effort = enc.effort;
+	e.animate = enc.animate;
+	return e;
+}
+
+static const CIFF* frameOf(const void*ciff) {
+	return (const CIFF*)ciff;
+}
+
+// the buffer's memory as an OutBuffer for the encoders and back; a failed encode leaves it empty
+struct Encoder {
+	static OutBuffer begin(Buffer&b) {
+		OutBuffer o;
+		o.data = b.buf;
+		o.len = 0;
+		o.cap = b.cap;
+		b.buf = NULL;
+		b.len = b.cap = 0;
+		return o;
+	}
+	static ReturnCode end(Buffer&b, const OutBuffer&o, ::ReturnCode ret) {
+		b.buf = o.data;
+		b.cap = o.cap;
+		b.len = (ret == RET_OK) ? o.len : 0;
+		return (ReturnCode)ret;
+	}
+};
+
+Buffer::~Buffer() {
+	free(buf);
+}
+
+Buffer& Buffer::operator=(Buffer&&other) noexcept {
+	if(this != &other) {
+		free(buf);
+		buf = other.buf;
+		len = other.len;
+		cap = other.cap;
+		other.buf = NULL;
+		other.len = other.cap = 0;
+	}
+	return *this;
+}
+
+unsigned char* Buffer::release(size_t*size) {
+	unsigned char*p = buf;
+	if(size) *size = len;
+	buf = NULL;
+	len = cap = 0;
+	return p;
+}
+
+// an invalid view (default, moved from, failed parse) is an empty image
+unsigned long long CiffView::width() const {
+	return ciff ? frameOf(ciff)->width : 0;
+}
+
+unsigned long long CiffView::height() const {
+	return ciff ? frameOf(ciff)->height : 0;
+}
+
+std::string_view CiffView::caption() const {
+	if(!ciff) return std::string_view();
+	return std::string_view(frameOf(ciff)->caption.ptr, frameOf(ciff)->caption.len);
+}
+
+Span<const CIFFSlice> CiffView::tags() const {
+	if(!ciff) return Span<const CIFFSlice>();
+	return Span<const CIFFSlice>((const CIFFSlice*)frameOf(ciff)->tags, frameOf(ciff)->tagcnt);
+}
+
+std::string_view CiffView::tag(size_t i) const {
+	if(!ciff || (i >= frameOf(ciff)->tagcnt)) return std::string_view();
+	return std::string_view(frameOf(ciff)->tags[i].ptr, frameOf(ciff)->tags[i].len);
+}
+
+Span<const unsigned char> CiffView::pixels() const {
+	if(!ciff) return Span<const unsigned char>();
+	return Span<const unsigned char>((const unsigned char*)frameOf(ciff)->imgbuf, frameOf(ciff)->content_size);
+}
+
+ReturnCode CiffView::encode(const EncodeOptions&enc, Buffer&out) const {
+	::EncodeOptions e = encodeOptions(enc);
+	OutBuffer o = Encoder::begin(out);
+	return Encoder::end(out, o, ciff ? encodePreview(frameOf(ciff), &e, label, &o) : RET_ERR_CHK);
+}
+
+// the input (if the object opened it) and the arena of the parse results
+struct Ciff::State {
+	InputBuffer in;
+	Arena arena;
+	State() {
+		inputbuffer_init(&in);
+		arena_init(&arena);
+	}
+	~State() {
+		arena_clear(&arena);
+		inputbuffer_clear(&in);
+	}
+};
+
+Ciff::Ciff() {}
+
+Ciff::~Ciff() {}
+
+Ciff::Ciff(Ciff&&other) noexcept : CiffView(other.ciff), st(std::move(other.st)) {
+	other.ciff = NULL;
+}
+
+Ciff& Ciff::operator=(Ciff&&other) noexcept {
+	if(this != &other) {
+		ciff = other.ciff;
+		st = std::move(other.st);
+		other.ciff = NULL;
+	}
+	return *this;
+}
+
+ReturnCode Ciff::load(const char*data, size_t len) {
+	CIFF*c = NULL;
+	::ReturnCode ret = ciffParse(data, len, &c, &st->arena);
+	if((ret == RET_OK) && !c) ret = RET_ERR_CHK;
+	if(ret != RET_OK) {
+		st.reset();
+		return (ReturnCode)ret;
+	}
+	ciff = c;
+	return CAFF_OK;
+}
+
+ReturnCode Ciff::parse(const char*data, size_t len, Ciff&out) {
+	out = Ciff();
+	out.st.reset(new (std::nothrow) State());
+	if(!out.st) return CAFF_ERR_MEM;
+	return out.load(data, len);
+}
+
+ReturnCode Ciff::open(const char*path, Ciff&out) {
+	out = Ciff();
+	out.st.reset(new (std::nothrow) State());
+	if(!out.st) return CAFF_ERR_MEM;
+	::ReturnCode ret = inputbuffer_open(path, &out.st->in, 0);
+	if(ret != RET_OK) {
+		out.st.reset();
+		return (ReturnCode)ret;
+	}
+	return out.load(out.st->in.data, out.st->in.len);
+}
+
+ReturnCode Ciff::own() {
+	if(!st) return CAFF_ERR_CHK;
+	return (ReturnCode)ciff_materialize((CIFF*)frameOf(ciff), &st->arena);
+}
+
+struct Caff::State {
+	InputBuffer in;
+	Arena arena;
+	CAFF*caff;
+	CAFFCredits credits; // the parser's ones in the public struct
+	State() : caff(NULL) {
+		inputbuffer_init(&in);
+		arena_init(&arena);
+	}
+	~State() {
+		caff_clear(caff);
+		arena_clear(&arena);
+		inputbuffer_clear(&in);
+	}
+};
+
+Caff::Caff() {}
+
+Caff::~Caff() {}
+
+Caff::Caff(Caff&&other) noexcept : st(std::move(other.st)) {}
+
+Caff& Caff::operator=(Caff&&other) noexcept {
+	st = std::move(other.st);
+	return *this;
+}
+
+ReturnCode Caff::load(const char*data, size_t len) {
+	::ReturnCode ret = caffParse(data, len, &st->caff, &st->arena);
+	if((ret == RET_OK) && !st->caff) ret = RET_ERR_CHK;
+	if(ret != RET_OK) {
+		st.reset();
+		return (ReturnCode)ret;
+	}
+	const ::CAFFCredits&c = st->caff->credits;
+	st->credits.year = c.year;
+	st->credits.month = c.month;
+	st->credits.day = c.day;
+	st->credits.hour = c.hour;
+	st->credits.minute = c.minute;
+	st->credits.creator_len = c.creator_len;
+	st->credits.creator = c.creator;
+	return CAFF_OK;
+}
+
+ReturnCode Caff::parse(const char*data, size_t len, Caff&out) {
+	out.st.reset(new (std::nothrow) State());
+	if(!out.st) return CAFF_ERR_MEM;
+	return out.load(data, len);
+}
+
+ReturnCode Caff::open(const char*path, Caff&out) {
+	out.st.reset(new (std::nothrow) State());
+	if(!out.st) return CAFF_ERR_MEM;
+	::ReturnCode ret = inputbuffer_open(path, &out.st->in, 0);
+	if(ret != RET_OK) {
+		out.st.reset();
+		return (ReturnCode)ret;
+	}
+	return out.load(out.st->in.data, out.st->in.len);
+}
+
+bool Caff::valid() const {
+	return st && st->caff;
+}
+
+unsigned long long Caff::frameCount() const {
+	return valid() ? st->caff->header.num_anim : 0;
+}
+
+unsigned long long Caff::duration(unsigned long long k) const {
+	return (k < frameCount()) ? st->caff->animations[k].duration : 0;
+}
+
+ReturnCode Caff::frame(unsigned long long k, CiffView&out) {
+	out = CiffView();
+	if(!valid()) return CAFF_ERR_CHK;
+	CIFF*c = NULL;
+	::ReturnCode ret = caff_frame(st->caff, k, &c);
+	if(ret == RET_OK) out = CiffView(c);
+	return (ReturnCode)ret;
+}
+
+const CAFFCredits& Caff::credits() const {
+	static const CAFFCredits none = { 0, 0, 0, 0, 0, 0, NULL };
+	return valid() ? st->credits : none;
+}
+
+std::string_view Caff::creator() const {
+	if(!valid() || !st->caff->credits.creator) return std::string_view();
+	return std::string_view(st->caff->credits.creator, st->caff->credits.creator_len);
+}
+
+// renderPreview's CAFF branch on the already parsed file
+ReturnCode Caff::encode(const EncodeOptions&enc, Buffer&out) {
+	::EncodeOptions e = encodeOptions(enc);
+	OutBuffer o = Encoder::begin(out);
+	::ReturnCode ret = RET_OK;
+	if(!valid() || (st->caff->header.num_anim == 0)) ret = RET_ERR_CHK;
+	else if(e.animate) {
+		if(!st->caff->unique_frames) ret = caffDedup(st->caff);
+		if(ret == RET_OK) ret = encodeAnimation(st->caff, &e, label, &o);
+	}
+	else {
+		CIFF*first = NULL;
+		ret = caff_frame(st->caff, 0, &first);
+		if(ret == RET_OK) ret = encodePreview(first, &e, label, &o);
+	}
+	return Encoder::end(out, o, ret);
+}
+
+EncodeOptions options() {
+	::EncodeOptions e;
+	encodeoptions_init(&e);
+	EncodeOptions enc;
+	enc.format = (OutputFormat)e.format;
+	enc.scale = e.scale;
+	enc.maxDim = e.maxDim;
+	enc.profile = (JPGProfile)e.profile;
+	enc.quality = e.quality;
+	enc.lossless = e.lossless;
+	enc.effort = e.effort;
+	enc.animate = e.animate;
+	return enc;
+}
+
+ReturnCode render(const char*data, size_t len, FileType ft, const EncodeOptions&enc, Buffer&out) {
+	::EncodeOptions e = encodeOptions(enc);
+	OutBuffer o = Encoder::begin(out);
+	Arena arena;
+	arena_init(&arena);
+	::ReturnCode ret = renderPreview(data, len, (::FileType)ft, &e, label, &arena, &o);
+	arena_clear(&arena);
+	return Encoder::end(out, o, ret);
+}
+
+void setLog(FILE*out, int level) {
+	logConfigure(out, level);
+}
+
+const char* errorName(ReturnCode ret) {
+	return rt2s((::ReturnCode)ret);
+}
+
+}
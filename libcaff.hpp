@@ -0,0 +1,190 @@
+// libcaff: the parser and the preview encoders for in-process use, see "make lib"
+// errors are ReturnCode values like everywhere in the parser, objects owning memory are move-only.
+// Different objects can be used from different threads, one object from one thread at a time.
+// This is the only header a user needs: parser.h is private, the types below mirror the parser's own ones.
+#ifndef LIBCAFF_HPP
+#define LIBCAFF_HPP
+
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <string_view>
+
+namespace caff {
+
+enum ReturnCode {
+	CAFF_OK = 0,
+	CAFF_ERR_MEM,
+	CAFF_ERR_IO,
+	CAFF_ERR_CHK,
+	CAFF_ERR_FORMAT,
+	CAFF_ERR_RES_CONSTRAINT
+};
+
+enum FileType {
+	CAFF_FTYPE_CIFF = 1,
+	CAFF_FTYPE_CAFF
+};
+
+enum OutputFormat {
+	CAFF_FORMAT_JPG = 0,
+	CAFF_FORMAT_WEBP // if the library was built with WEBP=1, CAFF_ERR_CHK otherwise
+};
+
+// libjpeg settings presets
+enum JPGProfile {
+	CAFF_JPG_BALANCED = 0, // libjpeg defaults
+	CAFF_JPG_FAST,         // fast integer DCT
+	CAFF_JPG_SMALL         // optimized Huffman tables, progressive
+};
+
+enum LogLevel {
+	CAFF_LOG_ERROR = 0,
+	CAFF_LOG_INFO,
+	CAFF_LOG_DEBUG
+};
+
+// how previews are rendered, options() gives the defaults of the command line tool
+struct EncodeOptions {
+	OutputFormat format;
+	unsigned int scale;          // box filter factor (0, 1: full resolution)
+	unsigned long long maxDim;   // scale down until width and height fit (0: no limit)
+	JPGProfile profile;
+	int quality;                 // 1..100
+	int lossless;                // webp only
+	int effort;                  // webp only, 0 (fast) .. 6 (small)
+	int animate;                 // Caff::encode: every frame with its duration instead of the first one
+};
+
+// pointer + length view, NOT '\0' terminated
+struct CIFFSlice {
+	const char*ptr;
+	unsigned long long len;
+};
+
+// all 0 (creator NULL) on an object that holds no CAFF
+struct CAFFCredits {
+	unsigned short year;
+	unsigned char month;
+	unsigned char day;
+	unsigned char hour;
+	unsigned char minute;
+	unsigned long long creator_len;
+	const char*creator;
+};
+
+// pointer + length over memory owned by someone else (std::span is C++20)
+template<typename T> class Span {
+public:
+	Span() : ptr(NULL), len(0) {}
+	Span(T*data, size_t size) : ptr(data), len(size) {}
+	T* data() const { return ptr; }
+	size_t size() const { return len; }
+	bool empty() const { return len == 0; }
+	T& operator[](size_t i) const { return ptr[i]; }
+	T* begin() const { return ptr; }
+	T* end() const { return ptr + len; }
+private:
+	T*ptr;
+	size_t len;
+};
+
+// an encoded preview; encoding into it again reuses the allocation
+class Buffer {
+public:
+	Buffer() : buf(NULL), len(0), cap(0) {}
+	~Buffer();
+	Buffer(Buffer&&other) noexcept : buf(other.buf), len(other.len), cap(other.cap) {
+		other.buf = NULL;
+		other.len = other.cap = 0;
+	}
+	Buffer& operator=(Buffer&&other) noexcept;
+	Buffer(const Buffer&) = delete;
+	Buffer& operator=(const Buffer&) = delete;
+	const unsigned char* data() const { return buf; }
+	size_t size() const { return len; }
+	Span<const unsigned char> bytes() const { return Span<const unsigned char>(buf, len); }
+	unsigned char* release(size_t*size); // the bytes go to the caller, free() them
+private:
+	unsigned char*buf;
+	size_t len;
+	size_t cap;
+	friend struct Encoder; // libcaff.cpp, hands the memory to the encoders
+};
+
+// one image, borrowed from a Ciff or a Caff frame: valid while that object is alive (and not moved from)
+class CiffView {
+public:
+	CiffView() : ciff(NULL) {}
+	bool valid() const { return ciff != NULL; }
+	unsigned long long width() const;
+	unsigned long long height() const;
+	std::string_view caption() const;
+	Span<const CIFFSlice> tags() const;
+	std::string_view tag(size_t i) const;
+	// RGB, width*3 bytes per row, no padding
+	Span<const unsigned char> pixels() const;
+	ReturnCode encode(const EncodeOptions&enc, Buffer&out) const;
+protected:
+	explicit CiffView(const void*c) : ciff(c) {}
+	const void*ciff; // the parser's CIFF
+	friend class Caff;
+};
+
+class Ciff : public CiffView {
+public:
+	Ciff();
+	~Ciff();
+	Ciff(Ciff&&other) noexcept;
+	Ciff& operator=(Ciff&&other) noexcept;
+	Ciff(const Ciff&) = delete;
+	Ciff& operator=(const Ciff&) = delete;
+	// data is borrowed until own() is called
+	static ReturnCode parse(const char*data, size_t len, Ciff&out);
+	// mapped (read if it can't be mapped), "-" is stdin
+	static ReturnCode open(const char*path, Ciff&out);
+	// copy the borrowed caption, tags and pixels into the object
+	ReturnCode own();
+private:
+	struct State;
+	std::unique_ptr<State> st;
+	ReturnCode load(const char*data, size_t len);
+};
+
+class Caff {
+public:
+	Caff();
+	~Caff();
+	Caff(Caff&&other) noexcept;
+	Caff& operator=(Caff&&other) noexcept;
+	Caff(const Caff&) = delete;
+	Caff& operator=(const Caff&) = delete;
+	// data is borrowed for the lifetime of the object
+	static ReturnCode parse(const char*data, size_t len, Caff&out);
+	static ReturnCode open(const char*path, Caff&out);
+	bool valid() const;
+	unsigned long long frameCount() const;
+	unsigned long long duration(unsigned long long k) const; // ms
+	// the frame's tags are validated on the first request
+	ReturnCode frame(unsigned long long k, CiffView&out);
+	const CAFFCredits& credits() const;
+	std::string_view creator() const;
+	// the first frame, or with enc.animate every frame (identical frames are encoded once)
+	ReturnCode encode(const EncodeOptions&enc, Buffer&out);
+private:
+	struct State;
+	std::unique_ptr<State> st;
+	ReturnCode load(const char*data, size_t len);
+};
+
+// the defaults of the command line tool
+EncodeOptions options();
+// parse and encode in one step, nothing is kept
+ReturnCode render(const char*data, size_t len, FileType ft, const EncodeOptions&enc, Buffer&out);
+// the parser logs the errors only by default (CAFF_LOG_ERROR), to stdout (out NULL)
+void setLog(FILE*out, int level);
+const char* errorName(ReturnCode ret);
+
+}
+
+#endif
@@ -0,0 +1,182 @@
+// checks of the libcaff API through the public header only, see "make test"; run from the repository root
+// (the files of test_files/ are used), exit 1 if anything failed
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include "libcaff.hpp"
+
+static int g_checks = 0;
+static int g_failed = 0;
+
+static void check(bool ok, const char*what) {
+	++g_checks;
+	if(ok) return;
+	fprintf(stderr, "libcaff_test: %s\n", what);
+	++g_failed;
+}
+
+static std::string readFile(const char*path) {
+	std::string s;
+	FILE*f = fopen(path, "rb");
+	if(!f) return s;
+	char buf[65536];
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0) s.append(buf, n);
+	fclose(f);
+	return s;
+}
+
+static bool isJPG(const caff::Buffer&b) {
+	return (b.size() > 4) && (b.data()[0] == 0xFF) && (b.data()[1] == 0xD8) && (b.data()[b.size()-2] == 0xFF) && (b.data()[b.size()-1] == 0xD9);
+}
+
+static bool sameBytes(const caff::Buffer&a, const caff::Buffer&b) {
+	return (a.size() == b.size()) && (memcmp(a.data(), b.data(), a.size()) == 0);
+}
+
+// everything an invalid view (default, moved from, failed) answers
+static void checkEmptyView(const caff::CiffView&v, const char*what) {
+	std::string w(what);
+	check(!v.valid(), (w + ": valid").c_str());
+	check((v.width() == 0) && (v.height() == 0), (w + ": size").c_str());
+	check(v.caption().empty() && v.tags().empty() && v.tag(0).empty() && v.pixels().empty(), (w + ": contents").c_str());
+	caff::Buffer out;
+	check((v.encode(caff::options(), out) == caff::CAFF_ERR_CHK) && (out.size() == 0), (w + ": encode").c_str());
+}
+
+static void checkEmptyCaff(caff::Caff&c, const char*what) {
+	std::string w(what);
+	check(!c.valid() && (c.frameCount() == 0) && (c.duration(0) == 0), (w + ": frames").c_str());
+	const caff::CAFFCredits&cr = c.credits();
+	check((cr.year == 0) && (cr.creator_len == 0) && !cr.creator && c.creator().empty(), (w + ": credits").c_str());
+	caff::CiffView v;
+	check(c.frame(0, v) == caff::CAFF_ERR_CHK, (w + ": frame").c_str());
+	checkEmptyView(v, (w + " frame").c_str());
+	caff::Buffer out;
+	check((c.encode(caff::options(), out) == caff::CAFF_ERR_CHK) && (out.size() == 0), (w + ": encode").c_str());
+}
+
+static void testCiff(void) {
+	caff::Ciff c;
+	checkEmptyView(c, "default Ciff");
+	check(c.own() == caff::CAFF_ERR_CHK, "default Ciff: own");
+
+	check(caff::Ciff::open("test_files/1.2.ciff", c) == caff::CAFF_OK, "open 1.2.ciff");
+	check(c.valid() && (c.width() == 1000) && (c.height() == 667), "1.2.ciff: size");
+	check(c.pixels().size() == c.width() * c.height() * 3, "1.2.ciff: pixels");
+	check(!c.caption().empty() && (c.tags().size() > 0), "1.2.ciff: caption and tags");
+	check(c.tag(0) == std::string_view(c.tags()[0].ptr, c.tags()[0].len), "1.2.ciff: tag");
+	check(c.tag(c.tags().size()).empty(), "1.2.ciff: tag past the end");
+	caff::Buffer a, b;
+	caff::EncodeOptions enc = caff::options();
+	check((c.encode(enc, a) == caff::CAFF_OK) && isJPG(a), "1.2.ciff: encode");
+
+	// parse from memory, own() the contents, then the memory goes away
+	std::string data = readFile("test_files/1.2.ciff");
+	caff::Ciff m;
+	check(caff::Ciff::parse(data.data(), data.size(), m) == caff::CAFF_OK, "parse 1.2.ciff");
+	std::string caption(m.caption());
+	check(m.own() == caff::CAFF_OK, "1.2.ciff: own");
+	data.assign(data.size(), 'x');
+	check(m.caption() == caption, "1.2.ciff: owned caption");
+	check((m.encode(enc, b) == caff::CAFF_OK) && sameBytes(a, b), "1.2.ciff: owned encode");
+
+	// the same bytes through render
+	data = readFile("test_files/1.2.ciff");
+	check((caff::render(data.data(), data.size(), caff::CAFF_FTYPE_CIFF, enc, b) == caff::CAFF_OK) && sameBytes(a, b), "render 1.2.ciff");
+	check((caff::render(data.data(), 10, caff::CAFF_FTYPE_CIFF, enc, b) != caff::CAFF_OK) && (b.size() == 0), "render a truncated CIFF");
+
+	// moves
+	caff::Ciff moved(std::move(c));
+	check(moved.valid() && (moved.width() == 1000), "moved Ciff");
+	checkEmptyView(c, "moved-from Ciff");
+	c = std::move(moved);
+	check(c.valid() && (c.height() == 667), "Ciff moved back");
+	checkEmptyView(moved, "moved-from Ciff (assignment)");
+
+	check(caff::Ciff::open("test_files/1.1.ciff", c) == caff::CAFF_ERR_CHK, "open 1.1.ciff");
+	checkEmptyView(c, "failed Ciff");
+	check(caff::Ciff::open("test_files/missing.ciff", c) == caff::CAFF_ERR_IO, "open a missing file");
+	checkEmptyView(c, "missing Ciff");
+}
+
+static void testCaff(void) {
+	caff::Caff c;
+	checkEmptyCaff(c, "default Caff");
+
+	check(caff::Caff::open("test_files/1.caff", c) == caff::CAFF_OK, "open 1.caff");
+	check(c.valid() && (c.frameCount() > 0), "1.caff: frames");
+	check((c.duration(0) > 0) && (c.duration(c.frameCount()) == 0), "1.caff: duration");
+	check((c.credits().year > 0) && (c.creator().size() == c.credits().creator_len) && !c.creator().empty(), "1.caff: credits");
+	caff::CiffView v;
+	check((c.frame(0, v) == caff::CAFF_OK) && v.valid() && (v.width() > 0) && (v.pixels().size() == v.width() * v.height() * 3), "1.caff: frame 0");
+	caff::CiffView past;
+	check(c.frame(c.frameCount(), past) != caff::CAFF_OK, "1.caff: frame past the end");
+	checkEmptyView(past, "frame past the end");
+
+	caff::EncodeOptions enc = caff::options();
+	caff::Buffer a, b;
+	check((c.encode(enc, a) == caff::CAFF_OK) && isJPG(a), "1.caff: encode");
+	check((v.encode(enc, b) == caff::CAFF_OK) && sameBytes(a, b), "1.caff: the preview is the first frame");
+	std::string data = readFile("test_files/1.caff");
+	check((caff::render(data.data(), data.size(), caff::CAFF_FTYPE_CAFF, enc, b) == caff::CAFF_OK) && sameBytes(a, b), "render 1.caff");
+	enc.animate = 1;
+	check((c.encode(enc, b) == caff::CAFF_OK) && (b.size() > 12) && (memcmp(b.data(), "RIFF", 4) == 0), "1.caff: animated encode");
+	enc = caff::options();
+	enc.maxDim = 64;
+	check((c.encode(enc, b) == caff::CAFF_OK) && isJPG(b) && (b.size() < a.size()), "1.caff: scaled encode");
+
+	// from memory, the data is borrowed
+	caff::Caff m;
+	check((caff::Caff::parse(data.data(), data.size(), m) == caff::CAFF_OK) && (m.frameCount() == c.frameCount()), "parse 1.caff");
+
+	caff::Caff moved(std::move(c));
+	check(moved.valid() && (moved.frameCount() == m.frameCount()), "moved Caff");
+	checkEmptyCaff(c, "moved-from Caff");
+	c = std::move(moved);
+	check(c.valid(), "Caff moved back");
+	checkEmptyCaff(moved, "moved-from Caff (assignment)");
+
+	static const char*const invalid[] = {
+		"test_files/invalid/incorrect_size_with_incorrect_width_height.caff",
+		"test_files/invalid/incorrect_width_height.caff",
+		"test_files/invalid/width_height_overflow.caff"
+	};
+	for(size_t i=0; i<sizeof(invalid)/sizeof(invalid[0]); ++i) {
+		caff::Caff bad;
+		check(caff::Caff::open(invalid[i], bad) != caff::CAFF_OK, invalid[i]);
+		checkEmptyCaff(bad, invalid[i]);
+		caff::Buffer out;
+		data = readFile(invalid[i]);
+		check((caff::render(data.data(), data.size(), caff::CAFF_FTYPE_CAFF, caff::options(), out) != caff::CAFF_OK) && (out.size() == 0), invalid[i]);
+	}
+}
+
+static void testBuffer(void) {
+	caff::Ciff c;
+	caff::Buffer a;
+	check(!a.data() && (a.size() == 0) && a.bytes().empty(), "empty Buffer");
+	check(caff::Ciff::open("test_files/1.2.ciff", c) == caff::CAFF_OK, "open 1.2.ciff");
+	check(c.encode(caff::options(), a) == caff::CAFF_OK, "encode into a Buffer");
+	const size_t len = a.size();
+	const unsigned char*p = a.data();
+	check((c.encode(caff::options(), a) == caff::CAFF_OK) && (a.data() == p) && (a.size() == len), "Buffer reuse");
+	caff::Buffer b(std::move(a));
+	check(!a.data() && (a.size() == 0) && (b.data() == p) && (b.size() == len), "moved Buffer");
+	size_t n = 0;
+	unsigned char*r = b.release(&n);
+	check((r == p) && (n == len) && !b.data() && (b.size() == 0), "Buffer release");
+	free(r);
+	check(strcmp(caff::errorName(caff::CAFF_ERR_CHK), "RET_ERR_CHK") == 0, "errorName");
+}
+
+int main(void) {
+	caff::setLog(stderr, caff::CAFF_LOG_ERROR - 1); // the failures are expected
+	testCiff();
+	testCaff();
+	testBuffer();
+	printf("# libcaff: %s (%d checks)\n", g_failed ? "FAILED" : "ok", g_checks);
+	return g_failed ? 1 : 0;
+}
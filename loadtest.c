@@ -0,0 +1,287 @@
+// end-to-end load driver: runs the parser binary over a corpus, see "make load"
+// the parser is compiled into this file only for the format constants
+#include "parser.c"
+#include <sys/wait.h>
+#include <math.h>
+
+#define load_max_args 64
+#define load_slow_exponent 1.2 // scaling exponents above this are reported
+
+typedef struct T_LoadInput {
+	char*path;
+	FileType type;
+	unsigned long long bytes;
+	unsigned long long frames;
+	unsigned long long*ns; // wall time of every run
+	unsigned long long maxrss; // KiB, the largest of the runs
+	int runs;
+	int failed;
+} LoadInput;
+
+typedef struct T_LoadConfig {
+	const char*parser;
+	const char*args[load_max_args]; // before the input, e.g. --metadata or --animate
+	int argcnt;
+	int concurrency;
+	int runs;
+	int verbose; // keep the parser's output
+} LoadConfig;
+
+typedef struct T_LoadRun {
+	pid_t pid;
+	LoadInput*input;
+	unsigned long long start;
+} LoadRun;
+
+static unsigned long long loadNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec*1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+// type from the magic, the frame count from the CAFF header
+static int loadProbe(LoadInput*in) {
+	int fd = open(in->path, O_RDONLY);
+	if(fd < 0) return 1;
+	struct stat st;
+	char h[1+8+caff_header_len];
+	ssize_t n = (fstat(fd, &st) == 0) ? read(fd, h, sizeof(h)) : -1;
+	close(fd);
+	if(n < 0) return 1;
+	in->bytes = (unsigned long long)st.st_size;
+	if(((size_t)n >= MagicCIFFlen) && (strncmp(h, MagicCIFF, MagicCIFFlen) == 0)) {
+		in->type = FTYPE_CIFF;
+		in->frames = 1;
+	}
+	else if(((size_t)n == sizeof(h)) && (h[0] == CAFF_BLOCK_HEADER) && (strncmp(h+9, MagicCAFF, MagicCAFFlen) == 0)) {
+		in->type = FTYPE_CAFF;
+		in->frames = loadUInt64(h+9+caff_header_offset_num_anim);
+	}
+	else return 1;
+	return 0;
+}
+
+static int loadCompareNs(const void*a, const void*b) {
+	unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+	return (x > y) - (x < y);
+}
+
+// nearest rank of a sorted array, ms
+static double loadPercentile(const unsigned long long*ns, int n, double p) {
+	if(n == 0) return 0;
+	int k = (int)ceil(p * n) - 1;
+	if(k < 0) k = 0;
+	return ns[k] / 1e6;
+}
+
+static pid_t loadSpawn(const LoadConfig*cfg, const LoadInput*in) {
+	const char*argv[load_max_args + 8];
+	int c = 0;
+	argv[c++] = cfg->parser;
+	for(int i=0; i<cfg->argcnt; ++i) argv[c++] = cfg->args[i];
+	argv[c++] = "-o";
+	argv[c++] = "/dev/null";
+	argv[c++] = (in->type == FTYPE_CIFF) ? "--ciff" : "--caff";
+	argv[c++] = in->path;
+	argv[c] = NULL;
+	pid_t pid = fork();
+	if(pid == 0) {
+		if(!cfg->verbose) {
+			int null = open("/dev/null", O_WRONLY);
+			dup2(null, STDOUT_FILENO);
+			dup2(null, STDERR_FILENO);
+			close(null);
+		}
+		execv(cfg->parser, (char*const*)argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+// runs the inputs cfg->runs times, at most cfg->concurrency at once
+static int loadRun(const LoadConfig*cfg, LoadInput*inputs, int n, unsigned long long*wall) {
+	LoadRun*active = (LoadRun*)calloc(cfg->concurrency, sizeof(LoadRun));
+	int next = 0, running = 0;
+	const int total = n * cfg->runs;
+	const unsigned long long t0 = loadNow();
+	while((next < total) || running) {
+		while((next < total) && (running < cfg->concurrency)) {
+			LoadInput*in = &inputs[next++ % n];
+			int slot = 0;
+			while(active[slot].pid) ++slot;
+			active[slot].input = in;
+			active[slot].start = loadNow();
+			active[slot].pid = loadSpawn(cfg, in);
+			if(active[slot].pid < 0) {
+				perror("fork");
+				free(active);
+				return 1;
+			}
+			++running;
+		}
+		int status;
+		struct rusage ru;
+		pid_t pid = wait4(-1, &status, 0, &ru);
+		if(pid < 0) {
+			if(errno == EINTR) continue;
+			perror("wait4");
+			break;
+		}
+		const unsigned long long now = loadNow();
+		for(int slot=0; slot<cfg->concurrency; ++slot) {
+			if(active[slot].pid != pid) continue;
+			LoadInput*in = active[slot].input;
+			in->ns[in->runs++] = now - active[slot].start;
+			if(!WIFEXITED(status) || WEXITSTATUS(status)) ++in->failed;
+			if((unsigned long long)ru.ru_maxrss > in->maxrss) in->maxrss = (unsigned long long)ru.ru_maxrss;
+			active[slot].pid = 0;
+			--running;
+			break;
+		}
+	}
+	*wall = loadNow() - t0;
+	free(active);
+	return 0;
+}
+
+// least squares slope of log(p50) over log(x): about 1 is linear, 2 quadratic
+static double loadExponent(const LoadInput*inputs, int n, int byFrames, int*points) {
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	int k = 0;
+	for(int i=0; i<n; ++i) {
+		const LoadInput*in = &inputs[i];
+		const double x = byFrames ? (double)in->frames : (double)in->bytes;
+		if((in->runs == 0) || in->failed || (x <= 0) || (byFrames && (in->type != FTYPE_CAFF))) continue;
+		const double lx = log(x), ly = log(loadPercentile(in->ns, in->runs, 0.5));
+		sx += lx;
+		sy += ly;
+		sxx += lx*lx;
+		sxy += lx*ly;
+		++k;
+	}
+	*points = k;
+	const double d = k*sxx - sx*sx;
+	return ((k < 3) || (d <= 0)) ? 0 : (k*sxy - sx*sy) / d;
+}
+
+static void loadReport(const LoadInput*inputs, int n, unsigned long long wall) {
+	printf("# input\tbytes\tframes\truns\tfailed\tp50_ms\tp90_ms\tp99_ms\tmax_ms\tMB/s\tframes/s\tmaxrss_kib\n");
+	unsigned long long bytes = 0, frames = 0, maxrss = 0;
+	int runs = 0, failed = 0;
+	for(int i=0; i<n; ++i) runs += inputs[i].runs;
+	unsigned long long*all = (unsigned long long*)malloc((runs ? runs : 1) * sizeof(unsigned long long));
+	runs = 0;
+	for(int i=0; i<n; ++i) {
+		const LoadInput*in = &inputs[i];
+		qsort(in->ns, in->runs, sizeof(unsigned long long), loadCompareNs);
+		const double p50 = loadPercentile(in->ns, in->runs, 0.5);
+		printf("%s\t%llu\t%llu\t%d\t%d\t%.3f\t%.3f\t%.3f\t%.3f\t%.2f\t%.2f\t%llu\n", in->path, in->bytes, in->frames,
+			in->runs, in->failed, p50, loadPercentile(in->ns, in->runs, 0.9), loadPercentile(in->ns, in->runs, 0.99),
+			loadPercentile(in->ns, in->runs, 1.0), p50 > 0 ? in->bytes / p50 / 1e3 : 0, p50 > 0 ? in->frames / p50 * 1e3 : 0, in->maxrss);
+		memcpy(all + runs, in->ns, in->runs * sizeof(unsigned long long));
+		runs += in->runs;
+		failed += in->failed;
+		bytes += in->bytes * in->runs;
+		frames += in->frames * in->runs;
+		if(in->maxrss > maxrss) maxrss = in->maxrss;
+	}
+	qsort(all, runs, sizeof(unsigned long long), loadCompareNs);
+	const double secs = wall / 1e9;
+	printf("total\t%llu\t%llu\t%d\t%d\t%.3f\t%.3f\t%.3f\t%.3f\t%.2f\t%.2f\t%llu\n", bytes, frames, runs, failed,
+		loadPercentile(all, runs, 0.5), loadPercentile(all, runs, 0.9), loadPercentile(all, runs, 0.99), loadPercentile(all, runs, 1.0),
+		secs > 0 ? bytes / secs / 1e6 : 0, secs > 0 ? frames / secs : 0, maxrss);
+	free(all);
+	int points;
+	double e = loadExponent(inputs, n, 0, &points);
+	if(points >= 3) printf("# p50 ~ bytes^%.2f over %d inputs%s\n", e, points, e > load_slow_exponent ? ", superlinear" : "");
+	e = loadExponent(inputs, n, 1, &points);
+	if(points >= 3) printf("# p50 ~ frames^%.2f over %d CAFF inputs%s\n", e, points, e > load_slow_exponent ? ", superlinear" : "");
+}
+
+// files of a directory with a CIFF/CAFF magic, sorted by name
+static int loadAddDir(const char*dir, LoadInput**inputs, int*n, int*cap) {
+	struct dirent**names;
+	int cnt = scandir(dir, &names, NULL, alphasort);
+	if(cnt < 0) return 1;
+	for(int i=0; i<cnt; ++i) {
+		if(names[i]->d_name[0] != '.') {
+			if(*n == *cap) {
+				*cap = *cap ? *cap * 2 : 16;
+				*inputs = (LoadInput*)realloc(*inputs, *cap * sizeof(LoadInput));
+			}
+			LoadInput*in = &(*inputs)[*n];
+			memset(in, 0, sizeof(*in));
+			in->path = (char*)malloc(strlen(dir) + strlen(names[i]->d_name) + 2);
+			sprintf(in->path, "%s/%s", dir, names[i]->d_name);
+			if(loadProbe(in) == 0) ++*n;
+			else free(in->path);
+		}
+		free(names[i]);
+	}
+	free(names);
+	return 0;
+}
+
+static void loadHelp(const char*pn) {
+	printf("Usage: %s [options] [file|dir] ...\n"
+	"\t-p PATH\t\tthe parser binary (default: ./parser)\n"
+	"\t-c N\t\tparser processes at once (default: 1)\n"
+	"\t-n N\t\truns of every input (default: 3)\n"
+	"\t-a ARG\t\tpassed to the parser before the input, repeatable (e.g. -a --metadata)\n"
+	"\t-v\t\tkeep the parser's output\n"
+	"every run is a fresh process (-o /dev/null); the output is tab separated: per input the latency\n"
+	"percentiles, MB/s and frames/s at the median and the peak RSS of the runs, then the totals over the\n"
+	"wall time and the fitted scaling exponent of the median latency over bytes and frames\n", pn);
+}
+
+int main(int argc, char** argv) {
+	LoadConfig cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.parser = "./parser";
+	cfg.concurrency = 1;
+	cfg.runs = 3;
+	LoadInput*inputs = NULL;
+	int n = 0, cap = 0, bad = 0;
+	for(int i=1; !bad && (i<argc); ++i) {
+		const int next = (i+1 < argc);
+		if((strcmp(argv[i], "-p") == 0) && next) cfg.parser = argv[++i];
+		else if((strcmp(argv[i], "-c") == 0) && next) bad = ((cfg.concurrency = atoi(argv[++i])) < 1);
+		else if((strcmp(argv[i], "-n") == 0) && next) bad = ((cfg.runs = atoi(argv[++i])) < 1);
+		else if((strcmp(argv[i], "-a") == 0) && next && (cfg.argcnt < load_max_args)) cfg.args[cfg.argcnt++] = argv[++i];
+		else if(strcmp(argv[i], "-v") == 0) cfg.verbose = 1;
+		else if(argv[i][0] == '-') bad = 1;
+		else {
+			struct stat st;
+			if((stat(argv[i], &st) == 0) && S_ISDIR(st.st_mode)) bad = loadAddDir(argv[i], &inputs, &n, &cap);
+			else {
+				if(n == cap) {
+					cap = cap ? cap * 2 : 16;
+					inputs = (LoadInput*)realloc(inputs, cap * sizeof(LoadInput));
+				}
+				memset(&inputs[n], 0, sizeof(LoadInput));
+				inputs[n].path = strdup(argv[i]);
+				if(loadProbe(&inputs[n])) {
+					fprintf(stderr, "%s: not a CIFF or CAFF file\n", argv[i]);
+					free(inputs[n].path);
+					bad = 1;
+				}
+				else ++n;
+			}
+		}
+	}
+	if(bad || (n == 0)) {
+		loadHelp(argv[0]);
+		return 1;
+	}
+	for(int i=0; i<n; ++i) inputs[i].ns = (unsigned long long*)calloc(cfg.runs, sizeof(unsigned long long));
+	unsigned long long wall = 0;
+	int ret = loadRun(&cfg, inputs, n, &wall);
+	if(ret == 0) loadReport(inputs, n, wall);
+	for(int i=0; i<n; ++i) {
+		if(inputs[i].failed) ret = 1;
+		free(inputs[i].ns);
+		free(inputs[i].path);
+	}
+	free(inputs);
+	return ret;
+}
@@ -0,0 +1,208 @@
+// the command line tool: flag parsing only, the work is done by the parser core (parser.c, libcaff.a)
+#include "parser.h"
+
+void printHelp(int argc, char** argv);
+int parseOption(RuntimeConfig*cfg, FileType*mode, int argc, char** argv, int i);
+RuntimeConfig parseArgs(int argc, char** argv);
+
+// EntryPoint
+int main(int argc, char** argv) {
+	// flag parsing
+	RuntimeConfig cfg = parseArgs(argc, argv);
+	
+	if(cfg.encode.output && strcmp(cfg.encode.output, "-") && (cfg.ciffcnt + cfg.caffcnt > 1)) {
+		printHelp(argc, argv); // every preview would go to the same file
+		runtimeconfig_clear(&cfg);
+		return -1;
+	}
+	if(cfg.printHelp)
+		printHelp(argc, argv);
+	
+	int ret = parserRun(&cfg);
+	runtimeconfig_clear(&cfg);
+	return ret;
+}
+
+void printHelp(int argc, char** argv) {
+	const char*pn = "parser";
+	if(argc > 0) pn = argv[0];
+	printf("Usage: \n"
+	"%s [options] ([-[-]c(i|a)ff] filename)+\n"
+	"\t-j, --jobs [N]\tprocess files on N threads (default: number of CPUs); without -j a single input of 4 MiB or more\n"
+	"\t\t\tis still encoded in strips on every CPU, -j 1 keeps it on one\n"
+	"\t-k, --keep-going\tdon't stop at the first file that fails\n"
+	"\t-o, --output F\twrite the preview to F (single input), \"-\" streams every preview to stdout\n"
+	"\t--max-dim N\tscale the preview down until it fits into NxN\n"
+	"\t--scale N\tscale the preview down to 1/N (box filter)\n"
+	"\t--profile P\tJPEG encoder profile: fast, balanced (default), small\n"
+	"\t-q, --quality Q\tquality 1..100 (default: %d)\n"
+	"\t--format F\tpreview format: jpg (default), webp\n"
+	"\t--lossless\tlossless webp\n"
+	"\t--effort N\twebp effort 0 (fast) .. 6 (small), default: %d\n"
+	"\t--animate\tCAFF: every frame with its duration (jpg: MJPEG .avi, webp: animated webp)\n"
+	"\t--stats [text|json]\tper file and total time of read, parse, validate, encode, write, bytes, frames, tags, allocations, peak RSS; CAFF frames are deduplicated for the count\n"
+	"\t-v, --quiet\tlog the parser's details too / errors only\n"
+	"\t--metadata\tno preview: one JSON line per input on stdout (sizes, caption, tags, credits, durations)\n"
+	"\t--cache-dir D\treuse previews of unchanged inputs from D (same settings)\n"
+	"\t--cache-max N[K|M|G]\tsize cap of the cache, least recently used previews go first\n"
+	"\t--mem-budget N[K|M|G]\tmemory the files in flight may use together (default: the physical memory), a file waits for\n\t\t\tits projected share, one that can't fit fails with RET_ERR_RES_CONSTRAINT\n"
+	"\t--serve SOCK\trun as a daemon answering requests on the Unix socket SOCK (-j: workers)\n"
+	"\t--client SOCK\tsend the inputs to a daemon instead of processing them here\n"
+	"\t--inline\twith --client: send the file contents instead of the path\n", pn, jpg_quality, webp_effort);
+}
+
+// N[K|M|G]
+static unsigned long long parseSize(const char*arg) {
+	char*end = NULL;
+	unsigned long long v = strtoull(arg, &end, 10);
+	if(end && ((*end == 'k') || (*end == 'K'))) v <<= 10;
+	else if(end && ((*end == 'm') || (*end == 'M'))) v <<= 20;
+	else if(end && ((*end == 'g') || (*end == 'G'))) v <<= 30;
+	return v;
+}
+
+// number of arguments consumed, 0 if argv[i] is a filename
+int parseOption(RuntimeConfig*cfg, FileType*mode, int argc, char** argv, int i) {
+	if(strcmp(argv[i],"-h") == 0) cfg->printHelp = 1;
+	else if(strcmp(argv[i],"--help") == 0) cfg->printHelp = 1;
+	else if(strcmp(argv[i],"-ciff") == 0) *mode=FTYPE_CIFF;
+	else if(strcmp(argv[i],"--ciff") == 0) *mode=FTYPE_CIFF;
+	else if(strcmp(argv[i],"-caff") == 0) *mode=FTYPE_CAFF;
+	else if(strcmp(argv[i],"--caff") == 0) *mode=FTYPE_CAFF;
+	else if((strcmp(argv[i],"-k") == 0) || (strcmp(argv[i],"--keep-going") == 0)) cfg->keepGoing = 1;
+	else if(((strcmp(argv[i],"-o") == 0) || (strcmp(argv[i],"--output") == 0)) && (i+1 < argc)) {
+		cfg->encode.output = argv[i+1];
+		return 2;
+	}
+	else if((strcmp(argv[i],"--max-dim") == 0) && (i+1 < argc)) {
+		cfg->encode.maxDim = strtoull(argv[i+1], NULL, 10);
+		return 2;
+	}
+	else if((strcmp(argv[i],"--format") == 0) && (i+1 < argc)) {
+		if(strcmp(argv[i+1], "jpg") == 0) cfg->encode.format = FORMAT_JPG;
+		else if(strcmp(argv[i+1], "webp") == 0) cfg->encode.format = FORMAT_WEBP;
+		else cfg->printHelp = 1;
+		return 2;
+	}
+	else if(strcmp(argv[i],"--lossless") == 0) cfg->encode.lossless = 1;
+	else if(strcmp(argv[i],"--animate") == 0) cfg->encode.animate = 1;
+	else if(strcmp(argv[i],"--stats") == 0) {
+		cfg->stats = STATS_TEXT;
+		if((i+1 < argc) && (strcmp(argv[i+1], "json") == 0)) cfg->stats = STATS_JSON;
+		else if((i+1 >= argc) || (strcmp(argv[i+1], "text") != 0)) return 1; // the format is optional
+		return 2;
+	}
+	else if(strcmp(argv[i],"-v") == 0) cfg->logLevel = log_debug;
+	else if(strcmp(argv[i],"--quiet") == 0) cfg->logLevel = log_error;
+	else if(strcmp(argv[i],"--metadata") == 0) cfg->metadata = 1;
+	else if((strcmp(argv[i],"--serve") == 0) && (i+1 < argc)) {
+		cfg->servePath = argv[i+1];
+		return 2;
+	}
+	else if((strcmp(argv[i],"--client") == 0) && (i+1 < argc)) {
+		cfg->clientPath = argv[i+1];
+		return 2;
+	}
+	else if(strcmp(argv[i],"--inline") == 0) cfg->clientInline = 1;
+	else if((strcmp(argv[i],"--cache-dir") == 0) && (i+1 < argc)) {
+		cfg->cacheDir = argv[i+1];
+		return 2;
+	}
+	else if((strcmp(argv[i],"--cache-max") == 0) && (i+1 < argc)) {
+		cfg->cacheMax = parseSize(argv[i+1]);
+		return 2;
+	}
+	else if((strcmp(argv[i],"--mem-budget") == 0) && (i+1 < argc)) {
+		cfg->memBudget = parseSize(argv[i+1]);
+		if(cfg->memBudget == 0) cfg->printHelp = 1;
+		return 2;
+	}
+	else if((strcmp(argv[i],"--effort") == 0) && (i+1 < argc)) {
+		int e = atoi(argv[i+1]);
+		if((e < 0) || (e > 6)) cfg->printHelp = 1;
+		else cfg->encode.effort = e;
+		return 2;
+	}
+	else if((strcmp(argv[i],"--profile") == 0) && (i+1 < argc)) {
+		if(!jpgProfileParse(argv[i+1], &cfg->encode.profile)) cfg->printHelp = 1;
+		return 2;
+	}
+	else if(((strcmp(argv[i],"-q") == 0) || (strcmp(argv[i],"--quality") == 0)) && (i+1 < argc)) {
+		int q = atoi(argv[i+1]);
+		if((q < 1) || (q > 100)) cfg->printHelp = 1;
+		else cfg->encode.quality = q;
+		return 2;
+	}
+	else if((strcmp(argv[i],"--scale") == 0) && (i+1 < argc)) {
+		cfg->encode.scale = (unsigned int)strtoul(argv[i+1], NULL, 10);
+		return 2;
+	}
+	else if((strcmp(argv[i],"-j") == 0) || (strcmp(argv[i],"--jobs") == 0)) {
+		cfg->jobs = hardwareConcurrency();
+		if((i+1 < argc) && (argv[i+1][0] != '\0') && (strspn(argv[i+1], "0123456789") == strlen(argv[i+1]))) {
+			int n = atoi(argv[i+1]);
+			if(n > 0) cfg->jobs = n;
+			return 2;
+		}
+	}
+	else return 0;
+	return 1;
+}
+
+RuntimeConfig parseArgs(int argc, char** argv) {
+	RuntimeConfig cfg;
+	runtimeconfig_init(&cfg);
+	FileType mode=FTYPE_CIFF;
+	for(int i=1; i<argc; ++i) {
+		int used = parseOption(&cfg, &mode, argc, argv, i);
+		if(used > 0) i += used-1;
+		else { //filename
+			if(mode==FTYPE_CIFF) cfg.ciffcnt += 1;
+			else if(mode==FTYPE_CAFF) cfg.caffcnt += 1;
+		}
+	}
+	if(cfg.ciffcnt > 0) {
+		cfg.ciffFiles = (char**)calloc(cfg.ciffcnt , sizeof(char*));
+		if(!cfg.ciffFiles) {
+			runtimeconfig_clear(&cfg);
+			return cfg;
+		}
+	}
+	if(cfg.caffcnt > 0) {
+		cfg.caffFiles = (char**)calloc(cfg.caffcnt , sizeof(char*));
+		if(!cfg.caffFiles) {
+			runtimeconfig_clear(&cfg);
+			return cfg;
+		}
+	}
+	
+	mode=FTYPE_CIFF;
+	int ciff_i=0, caff_i=0;
+	for(int i=1; i<argc; ++i) {
+		int used = parseOption(&cfg, &mode, argc, argv, i);
+		if(used > 0) i += used-1;
+		else { //filename
+			if(mode==FTYPE_CIFF) {
+				size_t s=strlen(argv[i])+1;
+				cfg.ciffFiles[ciff_i] = (char*)malloc(s);
+				if(!cfg.ciffFiles[ciff_i]){
+					runtimeconfig_clear(&cfg);
+					return cfg;
+				}
+				strcpy(cfg.ciffFiles[ciff_i], argv[i]);
+				ciff_i += 1;
+			}
+			else if(mode==FTYPE_CAFF) {
+				size_t s=strlen(argv[i])+1;
+				cfg.caffFiles[caff_i] = (char*)malloc(s);
+				if(!cfg.caffFiles[caff_i]){
+					runtimeconfig_clear(&cfg);
+					return cfg;
+				}
+				strcpy(cfg.caffFiles[caff_i], argv[i]);
+				caff_i += 1;
+			}
+		}
+	}
+	return cfg;
+}
@@ -1,733 +1,3961 @@
-// libraries
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <jpeglib.h>
-#include <limits.h>
-
-// common structs
-typedef enum T_ReturnCode {
-	RET_OK = 0,
-	RET_ERR_MEM,
-	RET_ERR_IO,
-	RET_ERR_CHK,
-	RET_ERR_FORMAT,
-	RET_ERR_RES_CONSTRAINT
-} ReturnCode;
-
-typedef enum T_FileType {
-	FTYPE_CIFF = 1,
-	FTYPE_CAFF
-} FileType;
-
-typedef struct T_CIFF {
-	unsigned long long header_size;
-	unsigned long long content_size;
-	unsigned long long width;
-	unsigned long long height;
-	char* caption;
-	char** tags;
-	unsigned long long tagcnt;
-	char*imgbuf;
-} CIFF;
-
-typedef struct T_CAFFHeader {
-	unsigned long long header_size;
-	unsigned long long num_anim;
-	int block_handled; // if we want to jump back and forth (Not used)
-} CAFFHeader;
-
-typedef struct T_CAFFCredits {
-	unsigned short year;
-	unsigned char month;
-	unsigned char day;
-	unsigned char hour;
-	unsigned char minute;
-	unsigned long long creator_len;
-	char*creator;
-	int block_handled;
-} CAFFCredits;
-
-typedef struct T_CAFFAnimation {
-	unsigned long long duration;
-	CIFF *ciff;
-	int block_handled;
-} CAFFAnimation;
-
-typedef struct T_CAFF {
-	CAFFHeader header;
-	CAFFCredits credits;
-	CAFFAnimation*animations;
-} CAFF;
-
-typedef struct T_RuntimeConfig {
-	int printHelp;
-	int ciffcnt;
-	char ** ciffFiles;
-	int caffcnt;
-	char ** caffFiles;
-} RuntimeConfig;
-
-// compile time configs
-#define maxFileSize (4ul*1024*1024*1024) // unsigned long
-#define ciff_minlen (4ul+8+8+8+8+1)
-#define ciff_offset_header_size 4
-#define ciff_offset_content_size (4+8)
-#define ciff_offset_width (4+8+8)
-#define ciff_offset_height (4+8+8+8)
-#define ciff_offset_caption (4+8+8+8+8)
-#define caff_blockheader_minSize (1+8)
-#define caff_header_len (MagicCAFFlen+8+8)
-#define caff_header_offset_header_size (MagicCAFFlen)
-#define caff_header_offset_num_anim (MagicCAFFlen+8)
-#define caff_credirs_offset_year (0)
-#define caff_credirs_offset_month (2)
-#define caff_credirs_offset_day (2+1)
-#define caff_credirs_offset_hour (2+1+1)
-#define caff_credirs_offset_minute (2+1+1+1)
-#define caff_credirs_offset_creator_len (2+1+1+1+1)
-#define caff_credirs_offset_creator (2+1+1+1+1+8)
-#define caff_credits_minlen (2+1+1+1+1+8)
-#define caff_animation_minlen (8+ciff_minlen)
-#define caff_animation_offset_duration (0)
-#define caff_animation_offset_ciff (8)
-
-// runtime configs
-const char*const MagicCIFF="CIFF";
-const size_t MagicCIFFlen=4;
-const char*const MagicCAFF="CAFF";
-const size_t MagicCAFFlen=4;
-
-// function headers (i was lazy to write header + ISO C ...)
-ReturnCode handleFile(const char* const fn, FileType ft);
-ReturnCode ciffParse(const char* const buf, size_t bufLen, CIFF** ciff_result);
-ReturnCode caffParse(const char* const buf, size_t bufLen, CAFF** caff_result);
-RuntimeConfig parseArgs(int argc, char** argv);
-unsigned char loadUInt8(const char*const buf);
-unsigned short loadUInt16(const char*const buf);
-unsigned long loadUInt32(const char*const buf);
-unsigned long long loadUInt64(const char*const buf);
-const char* rt2s(const ReturnCode rt);
-void printHelp(int argc, char** argv);
-ReturnCode toJPG(const CIFF* const ciff, const char* const fn);
-void ciff_clear(CIFF*ciff);
-void ciff_init(CIFF*ciff);
-void caff_clear(CAFF*caff);
-void caff_init(CAFF*caff);
-void runtimeconfig_clear(RuntimeConfig*rt);
-void runtimeconfig_init(RuntimeConfig*rt);
-
-// EntryPoint
-int main(int argc, char** argv) {
-	ReturnCode retCode = RET_OK;
-	// flag parsing
-	RuntimeConfig cfg = parseArgs(argc, argv);
-	
-	if(cfg.printHelp)
-		printHelp(argc, argv);
-	
-	for(int i=0; i<cfg.ciffcnt; ++i) {
-		printf("process %s as CIFF: %s\n",
-			cfg.ciffFiles[i],
-			rt2s(retCode=handleFile(cfg.ciffFiles[i], FTYPE_CIFF))
-		);
-		if(retCode != RET_OK) {
-			runtimeconfig_clear(&cfg);
-			return -1;
-		}
-	}
-	for(int i=0; i<cfg.caffcnt; ++i) {
-		printf("process %s as CAFF: %s\n",
-			cfg.caffFiles[i],
-			rt2s(retCode=handleFile(cfg.caffFiles[i], FTYPE_CAFF))
-		);
-		if(retCode != RET_OK) {
-			runtimeconfig_clear(&cfg);
-			return -1;
-		}
-	}
-	
-	runtimeconfig_clear(&cfg);
-	return 0;
-}
-
-ReturnCode handleFile(const char* const fn, FileType ft) {
-	printf("\n%s: %s\n", __func__, fn);
-	//if file readable and not too big, load
-	FILE*fp=fopen(fn, "rb");
-	if(!fp) return RET_ERR_IO;
-	fseek(fp, 0L, SEEK_END); // jump to the end of the file
-	size_t sz = ftell(fp);
-#if defined(maxFileSize) && (maxFileSize > 0) // nice to have
-	if(sz > maxFileSize) {
-		fclose(fp);
-		return RET_ERR_RES_CONSTRAINT;
-	}
-#endif
-	rewind(fp);
-
-	char*buf=(char *)malloc(sz);
-	if(!buf) return RET_ERR_MEM;
-	size_t r = fread(buf, 1, sz, fp); // target, block size, number of block, source
-	fclose(fp);
-	ReturnCode ret = RET_OK;
-	if(r!=sz) ret = RET_ERR_IO;
-	else {
-		size_t fnlen=strlen(fn);
-		char dstname[fnlen+4];
-		strcpy(dstname, fn);
-		if(ft == FTYPE_CIFF) {
-			if((fnlen >= 5) && strcasecmp(fn+fnlen-5, ".ciff")==0)
-				strcpy(dstname+fnlen-5, ".jpg"); // if filename have ".CIFF" than replace it
-			else
-				strcat(dstname, ".jpg"); // filename could be anything
-			CIFF*ciff = NULL;
-			ret = ciffParse(buf, sz, &ciff);
-			if(	(ret == RET_OK) && 
-				(ciff != NULL)
-			) 
-			ret=toJPG(ciff, dstname); // it saved it
-			else ret = ((ret==RET_OK)?RET_ERR_CHK:ret);
-			if(ciff) {
-				ciff_clear(ciff);
-				free(ciff);
-				ciff=NULL;
-			}
-		}
-		else if(ft == FTYPE_CAFF) {
-			if((fnlen >= 5) && strcasecmp(fn+fnlen-5, ".caff")==0)
-				strcpy(dstname+fnlen-5, ".jpg");
-			else
-				strcat(dstname, ".jpg");
-			CAFF*caff = NULL;
-			ret = caffParse(buf, sz, &caff);
-			if(	(ret == RET_OK) &&
-				(caff != NULL) &&
-				(caff->animations != NULL) &&
-				(caff->header.num_anim > 0) &&
-				(caff->animations[0].ciff != NULL)
-			) ret=toJPG(caff->animations[0].ciff, dstname); // ensure that it's valid
-			else ret = ((ret==RET_OK)?RET_ERR_CHK:ret);
-			if(caff) {
-				caff_clear(caff);
-				free(caff);
-				caff=NULL;
-			}
-		}
-		else ret = RET_ERR_CHK;
-	}
-	free(buf);
-	return ret;
-}
-
-// Little-Endian
-unsigned char loadUInt8(const char*const buf) {
-	return (unsigned char)buf[0];
-}
-unsigned short loadUInt16(const char*const buf) {
-	unsigned short ret = 0u;
-	for(unsigned long i=0; i<2; ++i) ret += ((unsigned short)(buf[i] & 0xff) << (i*8));
-	return ret;
-}
-unsigned long loadUInt32(const char*const buf) {
-	unsigned long ret = 0ul;
-	for(unsigned long i=0; i<4; ++i) ret += ((unsigned long)(buf[i] & 0xff) << (i*8));
-	return ret;
-}
-unsigned long long loadUInt64(const char*const buf) {
-	unsigned long long ret = 0ull;
-	for(unsigned long i=0; i<8; ++i) ret += ((unsigned long long)(buf[i] & 0xff) << (i*8));
-	return ret;
-}
-
-
-void ciff_clear(CIFF*ciff) {
-	if(!ciff)return;
-	if(ciff->caption) {
-		free(ciff->caption);
-		ciff->caption=NULL; // mark as invalid
-	}
-	if(ciff->tags) {
-		for(unsigned long long i=0; i<ciff->tagcnt; ++i) {
-			free(ciff->tags[i]);
-			ciff->tags[i]=NULL;
-		}
-		free(ciff->tags);
-		ciff->tags=NULL;
-		ciff->tagcnt = 0;
-	}
-	if(ciff->imgbuf) {
-		free(ciff->imgbuf);
-		ciff->imgbuf=NULL;
-	}
-	ciff->header_size = 0;
-	ciff->content_size = 0;
-	ciff->width = 0;
-	ciff->height = 0;
-}
-
-void ciff_init(CIFF*ciff) {
-	if(!ciff)return;
-	ciff->header_size = 0;
-	ciff->content_size = 0;
-	ciff->width = 0;
-	ciff->height = 0;
-	ciff->caption = NULL;
-	ciff->tags = NULL;
-	ciff->tagcnt = 0;
-	ciff->imgbuf = NULL;
-}
-
-void caff_clear(CAFF*caff) {
-	if(!caff)return;
-	if(caff->animations) {
-		for(unsigned long long i=0; i<caff->header.num_anim; ++i) {
-			if(caff->animations[i].ciff) {
-				ciff_clear(caff->animations[i].ciff);
-				free(caff->animations[i].ciff);
-				caff->animations[i].ciff=NULL;
-			}
-		}
-		free(caff->animations);
-		caff->animations=NULL;
-	}
-	caff->header.num_anim = 0;
-	
-	caff->header.header_size = 0;
-	caff->header.num_anim = 0;
-	caff->header.block_handled = 0;
-	caff->credits.year = 0;
-	caff->credits.month = 0;
-	caff->credits.day = 0;
-	caff->credits.hour = 0;
-	caff->credits.minute = 0;
-	caff->credits.creator_len = 0;
-	caff->credits.block_handled = 0;
-	if(caff->credits.creator) {
-		free(caff->credits.creator);
-		caff->credits.creator = NULL;
-	}
-}
-
-void caff_init(CAFF*caff) {
-	if(!caff)return;
-	caff->header.header_size = 0;
-	caff->header.num_anim = 0;
-	caff->header.block_handled = 0;
-	caff->credits.year = 0;
-	caff->credits.month = 0;
-	caff->credits.day = 0;
-	caff->credits.hour = 0;
-	caff->credits.minute = 0;
-	caff->credits.creator_len = 0;
-	caff->credits.creator = NULL;
-	caff->credits.block_handled = 0;
-	caff->animations = NULL;
-}
-
-void runtimeconfig_clear(RuntimeConfig*rt) {
-	if(!rt) return;
-	if(rt->ciffFiles) {
-		for(int i=0; i<rt->ciffcnt; ++i) {
-			free(rt->ciffFiles[i]);
-			rt->ciffFiles[i]=NULL;
-		}
-		free(rt->ciffFiles);
-		rt->ciffFiles=NULL;
-		rt->ciffcnt = 0;
-	}
-	if(rt->caffFiles) {
-		for(int i=0; i<rt->caffcnt; ++i) {
-			free(rt->caffFiles[i]);
-			rt->caffFiles[i]=NULL;
-		}
-		free(rt->caffFiles);
-		rt->caffFiles=NULL;
-		rt->caffcnt = 0;
-	}
-	rt->printHelp = 0;
-}
-
-void runtimeconfig_init(RuntimeConfig*rt) {
-	rt->printHelp = 0;
-	rt->ciffcnt = 0;
-	rt->ciffFiles = NULL;
-	rt->caffcnt = 0;
-	rt->caffFiles = NULL;
-}
-
-ReturnCode ciffParse(const char* const buf, size_t bufLen, CIFF** ciff_result) {
-	*ciff_result = NULL;
-	if(ciff_minlen > bufLen) return RET_ERR_FORMAT;
-	CIFF ciff;
-	ciff_init(&ciff);
-	if(strncmp(buf, MagicCIFF, MagicCIFFlen)) return RET_ERR_FORMAT; // it has MAGIC?
-	ciff.header_size  = loadUInt64(buf + ciff_offset_header_size);
-	ciff.content_size = loadUInt64(buf + ciff_offset_content_size);
-	ciff.width        = loadUInt64(buf + ciff_offset_width);
-	ciff.height       = loadUInt64(buf + ciff_offset_height);
-	printf("ciff.header_size=%llu\n", ciff.header_size);
-	printf("ciff.content_size=%llu\n", ciff.content_size);
-	printf("ciff.width=%llu\n", ciff.width);
-	printf("ciff.height=%llu\n", ciff.height);
-	if(((ciff.header_size + ciff.content_size) < ciff.header_size) || ((ciff.header_size + ciff.content_size) < ciff.content_size)) {
-		printf("overflow: %llu + %llu\n", ciff.header_size, ciff.content_size);
-		return RET_ERR_CHK;
-	}
-	printf("file size check: %llu =? %lu\n", (ciff.header_size+ciff.content_size), bufLen);
-	if((ciff.header_size + ciff.content_size) != bufLen)
-		return RET_ERR_CHK;
-	// --> overflow check
-	if(((ciff.width*ciff.height*3) < ciff.width) || ((ciff.width*ciff.height*3) < ciff.height)) {
-		printf("overflow: %llu * %llu * 3\n", ciff.width, ciff.height);
-		return RET_ERR_CHK;
-	}
-	printf("image size check: %llu =? %llu\n", (ciff.width*ciff.height)*3, ciff.content_size);
-	if(ciff.width*ciff.height*3 != ciff.content_size) 
-		return RET_ERR_CHK;
-
-
-	//caption
-	unsigned long long npos = ciff_offset_caption-1;
-	for(unsigned long long i=ciff_offset_caption; (i<ciff.header_size) && (npos < ciff_offset_caption); ++i)
-		if(buf[i]=='\n')	// search for the end
-			npos = i;
-	if(npos < ciff_offset_caption) return RET_ERR_FORMAT;
-
-	unsigned long long cap_len = npos - ciff_offset_caption;
-	ciff.caption=(char*)malloc(cap_len + 1);
-	if(!ciff.caption) return RET_ERR_MEM;
-	strncpy(ciff.caption, buf+ciff_offset_caption, cap_len); // '\n' in the end
-	ciff.caption[cap_len] = '\0';
-	for(unsigned long long i = 0; i<cap_len; ++i) // optional
-		if(ciff.caption[i] == '\0') { //non-ascii also 
-			ciff_clear(&ciff);
-			return RET_ERR_CHK; 
-		}
-	printf("ciff.caption=\"%s\"\n", ciff.caption);
-
-	// tags , npos -> end of the caption
-	//strings in range npos+1 .. header_size (caption+tags)
-	unsigned long long f=0;
-	for(unsigned long long i=npos+1; i<ciff.header_size; ++i) f += (buf[i] == 0); // number of null byte (number of tags)
-	// PROBLEM: unclean docs: can tags omitted (0 tag) ?
-	if(f < 1) return RET_ERR_CHK; // if tags not optional
-	printf("%llu tag candidate\n", f);
-	ciff.tags = (char**)calloc(f, sizeof(char*));
-	if(!ciff.tags) {
-		ciff_clear(&ciff);
-		return RET_ERR_MEM;
-	}
-	ciff.tagcnt = f;
-	const char*tagstart=buf+npos+1;
-	for(unsigned long long i = 0; i<ciff.tagcnt; ++i) {
-		printf("\tcandidate %llu=\"%s\"\n", i, tagstart);
-		size_t len = strlen(tagstart);
-		ciff.tags[i]=(char*)malloc(len+1);
-		if(!ciff.tags[i]) {
-			ciff_clear(&ciff);
-			return RET_ERR_MEM;
-		}
-		strcpy(ciff.tags[i], tagstart);
-		tagstart += len+1;
-		for(unsigned long long j=0; j<len; ++j) 
-			if(ciff.tags[i][j] == '\n') {
-				ciff_clear(&ciff);
-				return RET_ERR_CHK;
-			}
-	}
-
-	printf("offset=%ld\n", tagstart-buf);
-	if((tagstart-buf) != (long)ciff.header_size) {
-		ciff_clear(&ciff);
-		return RET_ERR_CHK;
-	}
-
-	ciff.imgbuf = (char*)malloc(ciff.content_size);
-	if(!ciff.imgbuf) {
-		ciff_clear(&ciff);
-		return RET_ERR_MEM;
-	}
-	// --> overflow check
-	if( buf > (buf+ciff.header_size+ciff.content_size)) {
-		printf("overflow detected: %p + %llu\n", buf, ciff.header_size);
-		return RET_ERR_CHK;
-	}
-	memcpy( ciff.imgbuf, buf+ciff.header_size, ciff.content_size );
-	// for convenience reasons
-	if(((*ciff_result) = (CIFF*)malloc(sizeof(CIFF))) == NULL) {
-		ciff_clear(&ciff);
-		return RET_ERR_MEM;
-	} else {
-		memcpy(*ciff_result, &ciff, sizeof(CIFF));
-		return RET_OK;
-	}
-}
-
-
-ReturnCode toJPG(const CIFF* const ciff, const char* const fn) {
-	if(!ciff) return RET_ERR_CHK;
-	printf("write to %s (%llux%llu)\n", fn, ciff->width, ciff->height);
-	if( (ciff->width <= 0) || (ciff->height <= 0)) return RET_ERR_CHK;
-	if( (ciff->width > 65500) || (ciff->height > 65500)) {
-		printf("jpeg library constraint violated: \n\tMaximum supported image dimension is 65500 pixels\n\t%llu x %llu\n", ciff->width, ciff->height);
-		return RET_ERR_CHK;
-	}
-	//https://github.com/LuaDist/libjpeg/blob/master/example.c
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-	FILE* fp;
-	if ((fp = fopen(fn, "wb")) == NULL)
-		return RET_ERR_IO;
- 	jpeg_stdio_dest(&cinfo, fp);
-	cinfo.image_width = ciff->width; 
-	cinfo.image_height = ciff->height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_RGB;
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, 90, TRUE);
-	jpeg_start_compress(&cinfo, TRUE);
-	int row_stride = ciff->width * 3;
-	JSAMPROW row_pointer[1];
-	while (cinfo.next_scanline < cinfo.image_height) {
-		row_pointer[0] = (JSAMPROW) & ciff->imgbuf[cinfo.next_scanline * row_stride];
-		(void) jpeg_write_scanlines(&cinfo, row_pointer, 1); // return value is dropped
-	}
-	jpeg_finish_compress(&cinfo);
-	fclose(fp);
-	jpeg_destroy_compress(&cinfo);
-
-	return  RET_OK;
-}
-
-ReturnCode caffParse(const char* const buf, size_t bufLen, CAFF** caff_result) {
-	*caff_result = NULL;
-	CAFF caff;
-	caff_init(&caff);
-	// read the whole file
-	const char* p = buf; //for jumping
-	const char*const p_over = p + bufLen;
-	unsigned long long cnt_block_type_1 = 0;
-	unsigned long long cnt_block_type_2 = 0;
-	unsigned long long cnt_block_type_3 = 0;
-	
-	while((p + caff_blockheader_minSize)<p_over) {
-		unsigned char block_type = loadUInt8(p); p+=1;
-		unsigned long long block_length = loadUInt64(p); p+=8;
-		if(block_type == 0x1) ++cnt_block_type_1;
-		else if(block_type == 0x2) ++cnt_block_type_2;
-		else if(block_type == 0x3) ++cnt_block_type_3;
-		else {
-			printf("invalid block_type:%d @%lu\n", block_type, p-buf-9);
-			return RET_ERR_CHK;
-		}
-		p+=block_length;
-	}
-	if(p != (buf+bufLen)) {
-		printf("invalid CAFF length %lu != %lu", p-buf, bufLen);
-		return RET_ERR_CHK;
-	}
-	printf("found blocks:\n\t1: %llu\n\t2: %llu\n\t3: %llu\n", cnt_block_type_1, cnt_block_type_2, cnt_block_type_3);
-	if((cnt_block_type_1 != 1) ||(cnt_block_type_2 > 1)) {
-		printf("exactly 1 header and at most 1 credit caff block expected\n");
-		return RET_ERR_CHK;
-	}
-	
-	p=buf;
-	while((p + caff_blockheader_minSize)<p_over) {
-		unsigned char block_type = loadUInt8(p); p+=1;
-		unsigned long long block_length = loadUInt64(p); p+=8;
-		// data is in p .. p+block_length range
-		if(block_type == 0x1) { //header
-			if(block_length != caff_header_len) return RET_ERR_FORMAT;
-			if(strncmp(p, MagicCAFF, MagicCAFFlen)) return RET_ERR_FORMAT;
-			caff.header.header_size = loadUInt64( p + caff_header_offset_header_size );
-			if(caff.header.header_size != caff_header_len) return RET_ERR_CHK;
-			caff.header.num_anim = loadUInt64( p + caff_header_offset_num_anim );
-			if(caff.header.num_anim != cnt_block_type_3) return RET_ERR_CHK;
-			caff.animations = (CAFFAnimation*)calloc(caff.header.num_anim, sizeof(CAFFAnimation));
-			if(!caff.animations) {
-				caff_clear(&caff);
-				return RET_ERR_MEM;
-			}
-			caff.header.block_handled = 1;
-		}
-		else if(block_type == 0x2) { //credits
-			if(block_length < caff_credits_minlen) {
-				caff_clear(&caff);
-				return RET_ERR_FORMAT;
-			}
-			caff.credits.year        = loadUInt16( p + caff_credirs_offset_year );
-			caff.credits.month       = loadUInt8(  p + caff_credirs_offset_month );
-			caff.credits.day         = loadUInt8(  p + caff_credirs_offset_day );
-			caff.credits.hour        = loadUInt8(  p + caff_credirs_offset_hour );
-			caff.credits.minute      = loadUInt8(  p + caff_credirs_offset_minute );
-			caff.credits.creator_len = loadUInt64( p + caff_credirs_offset_creator_len );
-			if( (caff.credits.month > 12) ||
-				(caff.credits.day > 31) ||
-				(caff.credits.hour > 24) ||
-				(caff.credits.minute > 60)
-			) {
-				caff_clear(&caff);
-				return RET_ERR_CHK;
-			}
-			if( block_length != ( caff_credirs_offset_creator + caff.credits.creator_len ) ) {
-				caff_clear(&caff);
-				return RET_ERR_FORMAT;
-			}
-			caff.credits.creator = (char*)malloc( caff.credits.creator_len + 1 );
-			if(!caff.credits.creator) {
-				caff_clear(&caff);
-				return RET_ERR_MEM;
-			}
-			strncpy(caff.credits.creator, p + caff_credirs_offset_creator, caff.credits.creator_len);
-			caff.credits.creator[caff.credits.creator_len] = '\0';
-			caff.credits.block_handled = 1;
-		}
-		p+=block_length;
-	}
-	// if we cant process the header or we cant allocate space for animation
-	if(!caff.header.block_handled || !caff.animations) {
-		caff_clear(&caff);
-		return RET_ERR_CHK;
-	}
-
-	p=buf;
-	size_t found_frames=0;
-	//CIFF after everything is right
-	while((p + caff_blockheader_minSize)<p_over) {
-		unsigned char block_type = loadUInt8(p); p+=1;
-		unsigned long long block_length = loadUInt64(p); p+=8;
-		if(block_type == 0x3) { //animation
-			if( block_length < caff_animation_minlen) {
-				caff_clear(&caff);
-				return RET_ERR_FORMAT;
-			}
-			// we overran
-			if( (found_frames + 1 > caff.header.num_anim) || (caff.animations[found_frames].ciff)) {
-				caff_clear(&caff);
-				return RET_ERR_CHK;
-			}
-			
-			caff.animations[found_frames].duration = loadUInt64(p+caff_animation_offset_duration);
-			CIFF*ciff = NULL;
-			ReturnCode r=ciffParse(p+caff_animation_offset_ciff, block_length-caff_animation_offset_ciff, &ciff);
-			if((r != RET_OK) || (!ciff)) {
-				if(ciff) {
-					ciff_clear(ciff);
-					free(ciff);
-					ciff=NULL;
-				}
-				caff_clear(&caff);
-				return (r != RET_OK)?r:RET_ERR_CHK;
-			}
-			caff.animations[found_frames].ciff=ciff;
-			caff.animations[found_frames].block_handled=1;
-			
-			++found_frames;
-		}
-		p+=block_length;
-	}
-
-	if(found_frames != caff.header.num_anim) {
-		caff_clear(&caff);
-		return RET_ERR_CHK;
-	}
-//	if(!caff.credits.block_handled) {
-//		caff.clear();
-//		return RET_ERR_CHK;
-//	}
-
-	if(((*caff_result) = (CAFF*)malloc(sizeof(CAFF))) == NULL) {
-		caff_clear(&caff);
-		return RET_ERR_MEM;
-	} else {
-		memcpy(*caff_result, &caff, sizeof(CAFF));
-		return RET_OK;
-	}
-}
-
-void printHelp(int argc, char** argv) {
-	const char*pn = "parser";
-	if(argc > 0) pn = argv[0];
-	printf("Usage: \n"
-	"%s ([-[-]c(i|a)ff] filename)+\n", pn);
-}
-
-RuntimeConfig parseArgs(int argc, char** argv) {
-	RuntimeConfig cfg;
-	runtimeconfig_init(&cfg);
-	FileType mode=FTYPE_CIFF;
-	for(int i=1; i<argc; ++i) {
-		if(strcmp(argv[i],"-h") == 0) cfg.printHelp = 1;
-		else if(strcmp(argv[i],"--help") == 0) cfg.printHelp = 1;
-		else if(strcmp(argv[i],"-ciff") == 0) mode=FTYPE_CIFF;
-		else if(strcmp(argv[i],"--ciff") == 0) mode=FTYPE_CIFF;
-		else if(strcmp(argv[i],"-caff") == 0) mode=FTYPE_CAFF;
-		else if(strcmp(argv[i],"--caff") == 0) mode=FTYPE_CAFF;
-		else { //filename
-			if(mode==FTYPE_CIFF) cfg.ciffcnt += 1;
-			else if(mode==FTYPE_CAFF) cfg.caffcnt += 1;
-		}
-	}
-	if(cfg.ciffcnt > 0) {
-		cfg.ciffFiles = (char**)calloc(cfg.ciffcnt , sizeof(char*));
-		if(!cfg.ciffFiles) {
-			runtimeconfig_clear(&cfg);
-			return cfg;
-		}
-	}
-	if(cfg.caffcnt > 0) {
-		cfg.caffFiles = (char**)calloc(cfg.caffcnt , sizeof(char*));
-		if(!cfg.caffFiles) {
-			runtimeconfig_clear(&cfg);
-			return cfg;
-		}
-	}
-	
-	mode=FTYPE_CIFF;
-	int ciff_i=0, caff_i=0;
-	for(int i=1; i<argc; ++i) {
-		if(strcmp(argv[i],"-h") == 0) cfg.printHelp = 1;
-		else if(strcmp(argv[i],"--help") == 0) cfg.printHelp = 1;
-		else if(strcmp(argv[i],"-ciff") == 0) mode=FTYPE_CIFF;
-		else if(strcmp(argv[i],"--ciff") == 0) mode=FTYPE_CIFF;
-		else if(strcmp(argv[i],"-caff") == 0) mode=FTYPE_CAFF;
-		else if(strcmp(argv[i],"--caff") == 0) mode=FTYPE_CAFF;
-		else { //filename
-			if(mode==FTYPE_CIFF) {
-				size_t s=strlen(argv[i])+1;
-				cfg.ciffFiles[ciff_i] = (char*)malloc(s);
-				if(!cfg.ciffFiles[ciff_i]){
-					runtimeconfig_clear(&cfg);
-					return cfg;
-				}
-				strcpy(cfg.ciffFiles[ciff_i], argv[i]);
-				ciff_i += 1;
-			}
-			else if(mode==FTYPE_CAFF) {
-				size_t s=strlen(argv[i])+1;
-				cfg.caffFiles[caff_i] = (char*)malloc(s);
-				if(!cfg.caffFiles[caff_i]){
-					runtimeconfig_clear(&cfg);
-					return cfg;
-				}
-				strcpy(cfg.caffFiles[caff_i], argv[i]);
-				caff_i += 1;
-			}
-		}
-	}
-	return cfg;
-}
-
-const char* rt2s(const ReturnCode rt) {
-	if(rt == RET_OK) return "RET_OK";
-	else if(rt == RET_ERR_MEM) return "RET_ERR_MEM";
-	else if(rt == RET_ERR_IO) return "RET_ERR_IO";
-	else if(rt == RET_ERR_CHK) return "RET_ERR_CHK";
-	else if(rt == RET_ERR_FORMAT) return "RET_ERR_FORMAT";
-	else if(rt == RET_ERR_RES_CONSTRAINT) return "RET_ERR_RES_CONSTRAINT";
-	else return "UNKNOWN_RETURNCODE";
+#include "parser.h"
+
+// runtime configs
+const char*const MagicCIFF="CIFF";
+const size_t MagicCIFFlen=4;
+const char*const MagicCAFF="CAFF";
+const size_t MagicCAFFlen=4;
+
+// stdout is shared by the workers, see logPrintf
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+// where logPrintf writes (NULL: stdout), stderr when stdout carries the previews
+static FILE*g_log = NULL;
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL log_debug // make LOG_MAX_LEVEL=1: the debug lines are not compiled in
+#endif
+static int g_log_level = log_error; // the CLI sets it from -v / --quiet, see logConfigure
+#define logEnabled(level) (((level) <= LOG_MAX_LEVEL) && ((level) <= g_log_level))
+#define logAt(level, ...) do { if(logEnabled(level)) logPrintf(__VA_ARGS__); } while(0)
+#define logError(...) logAt(log_error, __VA_ARGS__)
+#define logInfo(...) logAt(log_info, __VA_ARGS__)
+#define logDebug(...) logAt(log_debug, __VA_ARGS__)
+// previews written to stdout go out one at a time
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// pool of the current run (NULL: sequential)
+static ThreadPool*g_pool = NULL;
+static RunStats g_stats = { 0, 0, { { 0 }, { 0 } } };
+// the file the current thread works for (NULL: no --stats)
+static __thread FileStats*t_stats = NULL;
+
+static inline unsigned long long statsBegin(void) {
+	if(!t_stats) return 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec*1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+static inline void statsEnd(StatsStage stage, unsigned long long t0) {
+	if(t_stats) __atomic_add_fetch(&t_stats->ns[stage], statsBegin() - t0, __ATOMIC_RELAXED);
+}
+
+static inline void statsCount(StatsCounter c, unsigned long long n) {
+	if(t_stats) __atomic_add_fetch(&t_stats->counters[c], n, __ATOMIC_RELAXED);
+}
+static PreviewCache g_cache = { NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+// --mem-budget: what the running jobs may allocate together, see budget_reserve
+static MemBudget g_budget = { 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// the command line after parsing (main.c): global settings, then the batch, the daemon or the client
+int parserRun(const RuntimeConfig*cfg) {
+	FILE*log = NULL;
+	if(cfg->encode.output && (strcmp(cfg->encode.output, "-") == 0))
+		log = stderr; // stdout is for the image data
+	if(cfg->metadata) log = stderr; // stdout is for the records
+	logConfigure(log, cfg->logLevel);
+	g_budget.limit = cfg->memBudget ? cfg->memBudget : physicalMemory();
+	g_stats.enabled = (cfg->stats != STATS_OFF);
+	g_stats.json = (cfg->stats == STATS_JSON);
+	if(cfg->cacheDir) {
+		mkdir(cfg->cacheDir, 0777); // EEXIST is fine, other errors show up as cache misses
+		g_cache.dir = cfg->cacheDir;
+		g_cache.max = cfg->cacheMax;
+	}
+	if(cfg->servePath) return serveMain(cfg);
+	if(cfg->clientPath) return clientMain(cfg);
+	return runBatch(cfg);
+}
+
+// handleFile in three stages, so a batch can run them on different threads:
+// read (map the input, cache key), encode (cache lookup, parse and render into out), write
+typedef struct T_FileJob {
+	const char*fn;
+	FileType ft;
+	const EncodeOptions*enc;
+	char*dstname;
+	const char*outname;
+	InputBuffer in;
+	char*cachepath;
+	OutBuffer out;
+	unsigned long long reserved; // of the memory budget, see previewFootprint
+	int stream; // a pipe, read by the encode stage
+	int done;   // nothing left for the later stages (cache hit, stream)
+	ReturnCode ret;
+} FileJob;
+
+void filejob_init(FileJob*job, const char* const fn, FileType ft, const EncodeOptions*enc);
+void filejob_clear(FileJob*job);
+void filejob_release(FileJob*job);
+ReturnCode fileRead(FileJob*job, int prefetch);
+ReturnCode fileEncode(FileJob*job);
+ReturnCode fileWrite(FileJob*job);
+
+typedef struct T_BatchJob {
+	FileJob file;
+	int metadata;
+	OutBuffer record; // --metadata
+	FileStats stats;  // --stats
+	ReturnCode ret;
+	int done;    // guarded by Batch::lock
+	int skipped; // the batch was stopped before this job started
+} BatchJob;
+
+// the stages run on their own threads, connected by bounded queues: the reader faults the inputs in
+// while the pool (or the main thread) encodes, the writer writes the previews in the background.
+// A full queue stops the stage feeding it, so at most a few files per encoding thread are in memory.
+typedef struct T_Batch {
+	BatchJob*jobs;
+	int jobcnt;
+	int cancel; // __atomic
+	MPMCQueue read;    // reader -> encoders
+	MPMCQueue encoded; // encoders -> writer
+	TaskGroup group;   // the encode tasks, submitted by the reader
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} Batch;
+
+static void batchEncode(void*arg) {
+	Batch*batch = (Batch*)arg;
+	BatchJob*job = (BatchJob*)mpmc_pop(&batch->read);
+	FileStats*outer = t_stats;
+	t_stats = g_stats.enabled ? &job->stats : NULL;
+	if(job->skipped || __atomic_load_n(&batch->cancel, __ATOMIC_ACQUIRE)) job->skipped = 1;
+	else if(job->metadata) job->ret = handleMetadata(job->file.fn, job->file.ft, &job->record);
+	else job->ret = fileEncode(&job->file);
+	t_stats = outer;
+	mpmc_push(&batch->encoded, job);
+}
+
+// in input order, with a pool every file gets its encode task here
+static void batchRead(Batch*batch, int i) {
+	BatchJob*job = &batch->jobs[i];
+	if(__atomic_load_n(&batch->cancel, __ATOMIC_ACQUIRE)) job->skipped = 1;
+	else if(!job->metadata) { // --metadata reads only the headers, in the encode stage
+		FileStats*outer = t_stats;
+		t_stats = g_stats.enabled ? &job->stats : NULL;
+		job->ret = fileRead(&job->file, 1);
+		t_stats = outer;
+	}
+	mpmc_push(&batch->read, job);
+	if(g_pool && (pool_submit(g_pool, &batch->group, batchEncode, batch) != RET_OK))
+		batchEncode(batch);
+}
+
+static void* batchReader(void*arg) {
+	Batch*batch = (Batch*)arg;
+	for(int i=0; i<batch->jobcnt; ++i) batchRead(batch, i);
+	return NULL;
+}
+
+static void* batchWriter(void*arg) {
+	Batch*batch = (Batch*)arg;
+	for(int i=0; i<batch->jobcnt; ++i) {
+		BatchJob*job = (BatchJob*)mpmc_pop(&batch->encoded);
+		if(!job->skipped && !job->metadata) {
+			t_stats = g_stats.enabled ? &job->stats : NULL;
+			job->ret = fileWrite(&job->file);
+			t_stats = NULL;
+		}
+		filejob_release(&job->file); // the reader may be waiting for the budget
+		pthread_mutex_lock(&batch->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&batch->cond);
+		pthread_mutex_unlock(&batch->lock);
+	}
+	return NULL;
+}
+
+// the size of the pool: without -j a single large file still gets one, so its frame is encoded in strips
+static int batchThreads(const RuntimeConfig*cfg, const Batch*batch) {
+	if(cfg->jobs > 0) return cfg->jobs;
+	const EncodeOptions*enc = &cfg->encode;
+	if((batch->jobcnt != 1) || cfg->metadata || (enc->format != FORMAT_JPG) || (enc->profile == JPG_PROFILE_SMALL)) return 1;
+	struct stat st;
+	if((stat(batch->jobs[0].file.fn, &st) != 0) || !S_ISREG(st.st_mode) || ((unsigned long long)st.st_size < jpg_strip_min_bytes)) return 1;
+	return hardwareConcurrency();
+}
+
+// every CIFF then every CAFF, results are reported in this order whatever order they finish in
+int runBatch(const RuntimeConfig*cfg) {
+	Batch batch;
+	batch.jobcnt = cfg->ciffcnt + cfg->caffcnt;
+	batch.cancel = 0;
+	if(batch.jobcnt == 0) return 0;
+	batch.jobs = (BatchJob*)calloc(batch.jobcnt, sizeof(BatchJob));
+	if(!batch.jobs) return -1;
+	for(int i=0; i<cfg->ciffcnt; ++i) {
+		filejob_init(&batch.jobs[i].file, cfg->ciffFiles[i], FTYPE_CIFF, &cfg->encode);
+		batch.jobs[i].metadata = cfg->metadata;
+	}
+	for(int i=0; i<cfg->caffcnt; ++i) {
+		filejob_init(&batch.jobs[cfg->ciffcnt+i].file, cfg->caffFiles[i], FTYPE_CAFF, &cfg->encode);
+		batch.jobs[cfg->ciffcnt+i].metadata = cfg->metadata;
+	}
+	const int threads = batchThreads(cfg, &batch);
+	size_t depth = 1;
+	while(depth < (size_t)threads * pipeline_depth) depth *= 2;
+	if(mpmc_init(&batch.read, depth) != RET_OK) {
+		free(batch.jobs);
+		return -1;
+	}
+	if(mpmc_init(&batch.encoded, depth) != RET_OK) {
+		mpmc_clear(&batch.read);
+		free(batch.jobs);
+		return -1;
+	}
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+	taskgroup_init(&batch.group);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if(threads > 1) g_pool = pool_create(threads);
+
+	// without a writer thread the stages run back to back here, without a reader the reads do
+	pthread_t reader, writer;
+	const int threaded = (pthread_create(&writer, NULL, batchWriter, &batch) == 0);
+	const int reading = threaded && (pthread_create(&reader, NULL, batchReader, &batch) == 0);
+
+	int ret = 0, reported = 0, failed = 0, read = 0, encoded = 0;
+	for(int i=0; i<batch.jobcnt; ++i) {
+		BatchJob*job = &batch.jobs[i];
+		if(threaded && !reading) batchRead(&batch, read++);
+		if(!threaded) {
+			t_stats = g_stats.enabled ? &job->stats : NULL;
+			if(__atomic_load_n(&batch.cancel, __ATOMIC_ACQUIRE)) job->skipped = 1;
+			else if(job->metadata) job->ret = handleMetadata(job->file.fn, job->file.ft, &job->record);
+			else {
+				fileRead(&job->file, 0);
+				fileEncode(&job->file);
+				job->ret = fileWrite(&job->file);
+				filejob_release(&job->file);
+			}
+			t_stats = NULL;
+			job->done = 1;
+		}
+		else if(!g_pool) { // the reader pushes in order, so this is job i
+			batchEncode(&batch);
+			++encoded;
+		}
+		pthread_mutex_lock(&batch.lock);
+		while(!job->done) pthread_cond_wait(&batch.cond, &batch.lock);
+		pthread_mutex_unlock(&batch.lock);
+		if(job->skipped) continue;
+		logAt((job->ret == RET_OK) ? log_info : log_error, "process %s as %s: %s\n",
+			job->file.fn,
+			(job->file.ft == FTYPE_CIFF) ? "CIFF" : "CAFF",
+			rt2s(job->ret)
+		);
+		++reported;
+		if(job->ret != RET_OK) ++failed;
+		if(g_stats.enabled) statsReport(job->file.fn, job->ret, &job->stats);
+		if(job->metadata) { // in input order, like the log
+			fwrite(job->record.data, 1, job->record.len, stdout);
+			outbuffer_clear(&job->record);
+		}
+		if(job->ret != RET_OK) {
+			ret = -1;
+			if(!cfg->keepGoing) { // the rest is not reported, like in the sequential case
+				__atomic_store_n(&batch.cancel, 1, __ATOMIC_RELEASE);
+				break;
+			}
+		}
+	}
+
+	if(threaded) { // after a stop the rest goes through the stages as skipped
+		for(; !reading && (read < batch.jobcnt); ++read) {
+			batchRead(&batch, read);
+			if(!g_pool) {
+				batchEncode(&batch);
+				++encoded;
+			}
+		}
+		for(; !g_pool && (encoded < batch.jobcnt); ++encoded) batchEncode(&batch);
+		if(reading) pthread_join(reader, NULL); // every encode task is submitted
+		if(g_pool) pool_wait(g_pool, &batch.group);
+		pthread_join(writer, NULL);
+	}
+	if(g_pool) {
+		pool_destroy(g_pool);
+		g_pool = NULL;
+	}
+	if(g_stats.enabled) {
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		statsSummary(reported, failed, (unsigned long long)(end.tv_sec - start.tv_sec)*1000000000ull + (unsigned long long)end.tv_nsec - (unsigned long long)start.tv_nsec);
+	}
+	if(cfg->metadata) fflush(stdout);
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.lock);
+	for(int i=0; i<batch.jobcnt; ++i) {
+		outbuffer_clear(&batch.jobs[i].record); // not reported after a stop
+		filejob_clear(&batch.jobs[i].file);
+	}
+	mpmc_clear(&batch.encoded);
+	mpmc_clear(&batch.read);
+	free(batch.jobs);
+	return ret;
+}
+
+ReturnCode handleFile(const char* const fn, FileType ft, const EncodeOptions*enc) {
+	FileJob job;
+	filejob_init(&job, fn, ft, enc);
+	fileRead(&job, 0);
+	fileEncode(&job);
+	ReturnCode ret = fileWrite(&job);
+	filejob_clear(&job);
+	return ret;
+}
+
+void filejob_init(FileJob*job, const char* const fn, FileType ft, const EncodeOptions*enc) {
+	job->fn = fn;
+	job->ft = ft;
+	job->enc = enc;
+	job->dstname = NULL;
+	job->outname = NULL;
+	inputbuffer_init(&job->in);
+	job->cachepath = NULL;
+	outbuffer_init(&job->out);
+	job->reserved = 0;
+	job->stream = 0;
+	job->done = 0;
+	job->ret = ((ft == FTYPE_CIFF) || (ft == FTYPE_CAFF)) ? RET_OK : RET_ERR_CHK;
+}
+
+// the buffers and the budget, as soon as the job is finished
+void filejob_release(FileJob*job) {
+	inputbuffer_clear(&job->in);
+	outbuffer_clear(&job->out);
+	budget_release(job->reserved);
+	job->reserved = 0;
+}
+
+void filejob_clear(FileJob*job) {
+	filejob_release(job);
+	free(job->cachepath);
+	job->cachepath = NULL;
+	free(job->dstname);
+	job->dstname = NULL;
+}
+
+// prefetch: fault the whole input in now (the batch reader thread), not page by page in the parser
+ReturnCode fileRead(FileJob*job, int prefetch) {
+	logDebug("\n%s: %s\n", __func__, job->fn);
+	if((job->ret != RET_OK) || job->done) return job->ret;
+	const EncodeOptions*enc = job->enc;
+	const PreviewEncoder*pe = previewEncoder(enc ? enc->format : FORMAT_JPG);
+	const int animate = (job->ft == FTYPE_CAFF) && enc && enc->animate;
+	const char*ext = animate ? pe->animExt : pe->ext;
+	job->dstname = (char*)malloc(strlen(job->fn)+strlen(ext)+1);
+	if(!job->dstname) return (job->ret = RET_ERR_MEM);
+	previewName(job->fn, job->ft, enc, job->dstname);
+	job->outname = (enc && enc->output) ? enc->output : job->dstname;
+
+	if((job->ft == FTYPE_CAFF) && !animate && isStreamInput(job->fn)) { // pipes: preview as soon as the first frame arrived
+		job->stream = 1;
+		return RET_OK;
+	}
+	//if file readable and not too big, map (or load)
+	job->ret = inputbuffer_open(job->fn, &job->in, 0);
+	if(job->ret != RET_OK) return job->ret;
+	// the reader (or a sequential run) is the only thread of a batch waiting for the budget and the holders finish
+	// without waiting, so it may wait while its heap input is reserved, as long as both fit at all
+	const unsigned long long footprint = previewFootprint(job->in.data, job->in.len, job->ft, enc);
+	if(g_budget.limit && (footprint > g_budget.limit - job->in.reserved)) job->ret = RET_ERR_RES_CONSTRAINT;
+	else job->ret = budget_reserve(footprint, 1);
+	if(job->ret != RET_OK) {
+		logError("%s needs %llu bytes, the memory budget is %llu\n", job->fn, footprint, g_budget.limit);
+		inputbuffer_clear(&job->in);
+		return job->ret;
+	}
+	job->reserved = footprint;
+	if(prefetch) {
+		unsigned long long t = statsBegin();
+		inputbuffer_prefetch(&job->in);
+		statsEnd(STAGE_READ, t);
+	}
+	job->cachepath = cachePath(&job->in, job->ft, enc, ext);
+	return RET_OK;
+}
+
+// the input is released here, only the preview waits for the write stage
+ReturnCode fileEncode(FileJob*job) {
+	if((job->ret != RET_OK) || job->done) return job->ret;
+	if(job->cachepath && (cacheFetch(job->cachepath, job->outname) == RET_OK)) {
+		logInfo("cache hit %s -> %s\n", job->cachepath, job->outname);
+		inputbuffer_clear(&job->in);
+		job->done = 1;
+		return RET_OK;
+	}
+	if(job->stream) {
+		int fd = (strcmp(job->fn, "-") == 0) ? STDIN_FILENO : open(job->fn, O_RDONLY);
+		if(fd < 0) return (job->ret = RET_ERR_IO);
+		job->ret = handleCAFFStream(fd, job->outname, job->enc);
+		if(fd != STDIN_FILENO) close(fd);
+		job->done = 1;
+		return job->ret;
+	}
+	Arena arena;
+	arena_init(&arena);
+	job->ret = renderPreview(job->in.data, job->in.len, job->ft, job->enc, job->outname, &arena, &job->out);
+	arena_clear(&arena);
+	inputbuffer_clear(&job->in);
+	return job->ret;
+}
+
+ReturnCode fileWrite(FileJob*job) {
+	if((job->ret != RET_OK) || job->done) return job->ret;
+	job->ret = writeOutput(job->outname, job->out.data, job->out.len);
+	if(job->ret == RET_OK) cacheStore(job->cachepath, job->out.data, job->out.len);
+	outbuffer_clear(&job->out);
+	job->done = 1;
+	return job->ret;
+}
+
+// parse into arena and encode into out, nothing is written; label names the preview in the log
+// the parse results are left in the arena, the caller resets it
+ReturnCode renderPreview(const char* const buf, size_t sz, FileType ft, const EncodeOptions*enc, const char*label, Arena*arena, OutBuffer*out) {
+	const int animate = (ft == FTYPE_CAFF) && enc && enc->animate;
+	ReturnCode ret = RET_ERR_CHK;
+	if(ft == FTYPE_CIFF) {
+		CIFF*ciff = NULL;
+		ret = ciffParse(buf, sz, &ciff, arena);
+		if(	(ret == RET_OK) && 
+			(ciff != NULL)
+		) 
+		ret=encodePreview(ciff, enc, label, out);
+		else ret = ((ret==RET_OK)?RET_ERR_CHK:ret);
+	}
+	else {
+		CAFF*caff = NULL;
+		CIFF*first = NULL;
+		unsigned long long t = statsBegin();
+		ret = caffParse(buf, sz, &caff, arena);
+		statsEnd(STAGE_PARSE, t);
+		if(ret == RET_OK) statsCount(STAT_FRAMES, caff->header.num_anim);
+		if((ret == RET_OK) && caff && (animate || g_stats.enabled)) {
+			ret = caffDedup(caff);
+			if(ret == RET_OK) {
+				statsCount(STAT_UNIQUE_FRAMES, caff->unique_frames);
+				logDebug("%llu frames, %llu unique\n", caff->header.num_anim, caff->unique_frames);
+			}
+		}
+		if(	animate &&
+			(ret == RET_OK) &&
+			(caff != NULL)
+		) ret=encodeAnimation(caff, enc, label, out);
+		else if(	(ret == RET_OK) &&
+			(caff != NULL) &&
+			(caff->header.num_anim > 0) &&
+			((ret = caff_frame(caff, 0, &first)) == RET_OK)
+		) ret=encodePreview(first, enc, label, out); // only the rendered frame is parsed completely
+		else ret = ((ret==RET_OK)?RET_ERR_CHK:ret);
+	}
+	if(ret == RET_OK) statsCount(STAT_BYTES_OUT, out->len);
+	return ret;
+}
+
+// what renderPreview will allocate, from the block and CIFF headers only (they are not validated yet, every
+// length is clamped to the bytes that are there): the arena for the tags, and for every encoded frame its
+// width*height*3 (scaled) as the bound of the encoder's output, twice when the frames are muxed.
+// The input itself is not counted: a mapping is page cache, heap inputs reserve while they are read.
+static unsigned long long ciffFootprint(const char* const p, unsigned long long len, unsigned int factor) {
+	if(len < ciff_minlen) return 0;
+	unsigned long long hs = loadUInt64(p + ciff_offset_header_size);
+	const unsigned long long w = loadUInt64(p + ciff_offset_width);
+	const unsigned long long h = loadUInt64(p + ciff_offset_height);
+	if(hs > len) hs = len;
+	unsigned long long pixels = len - hs; // the content can't be larger
+	if(w && h && (w <= pixels / h / 3)) pixels = w*h*3;
+	if(factor > 1) pixels = pixels / factor / factor + 1;
+	return sizeof(CIFF) + hs * sizeof(CIFFSlice) + pixels;
+}
+
+unsigned long long previewFootprint(const char* const buf, size_t len, FileType ft, const EncodeOptions*enc) {
+	const unsigned int factor = (enc && (enc->scale > 1)) ? enc->scale : 1; // --max-dim needs the size, counted unscaled
+	if(ft == FTYPE_CIFF) return ciffFootprint(buf, len, factor);
+	const int animate = enc && enc->animate;
+	unsigned long long total = sizeof(CAFF), frames = 0;
+	for(size_t pos = 0; pos + caff_blockheader_minSize <= len; ) {
+		unsigned long long blen = loadUInt64(buf + pos + 1);
+		if(blen > len - pos - caff_blockheader_minSize) blen = len - pos - caff_blockheader_minSize;
+		total += sizeof(CAFFBlock);
+		if((loadUInt8(buf + pos) == CAFF_BLOCK_ANIMATION) && (blen >= caff_animation_minlen)) {
+			const char*ciff = buf + pos + caff_blockheader_minSize + caff_animation_offset_ciff;
+			const unsigned long long clen = blen - caff_animation_offset_ciff;
+			total += sizeof(CAFFAnimation);
+			if(animate || (frames == 0)) total += ciffFootprint(ciff, clen, factor) * (animate ? 2 : 1);
+			else total += sizeof(CIFF) + ((loadUInt64(ciff + ciff_offset_header_size) > clen) ? clen : loadUInt64(ciff + ciff_offset_header_size)) * sizeof(CIFFSlice);
+			++frames;
+		}
+		else if(loadUInt8(buf + pos) == CAFF_BLOCK_CREDITS) total += blen;
+		pos += caff_blockheader_minSize + blen;
+	}
+	return total;
+}
+
+// JSON string, bytes outside printable ASCII are escaped one by one (\u00XX)
+static void jsonString(OutBuffer*out, const char*p, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	outbuffer_append(out, "\"", 1);
+	size_t run = 0; // unescaped bytes not appended yet
+	for(size_t i=0; i<len; ++i) {
+		unsigned char c = (unsigned char)p[i];
+		if((c >= 0x20) && (c < 0x7f) && (c != '"') && (c != '\\')) {
+			++run;
+			continue;
+		}
+		outbuffer_append(out, p + i - run, run);
+		run = 0;
+		if((c == '"') || (c == '\\')) {
+			const char esc[2] = { '\\', (char)c };
+			outbuffer_append(out, esc, 2);
+		}
+		else {
+			const char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+			outbuffer_append(out, esc, 6);
+		}
+	}
+	outbuffer_append(out, p + len - run, run);
+	outbuffer_append(out, "\"", 1);
+}
+
+static void jsonPrintf(OutBuffer*out, const char*fmt, ...) {
+	char tmp[128]; // numbers and keys only, strings go through jsonString
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	if(n > 0) outbuffer_append(out, tmp, ((size_t)n < sizeof(tmp)) ? (size_t)n : sizeof(tmp) - 1);
+}
+
+// "width":..,"height":..,"caption":..,"tags":[..]
+static void jsonCIFF(OutBuffer*out, const CIFF* const ciff) {
+	jsonPrintf(out, "\"width\":%llu,\"height\":%llu,\"caption\":", ciff->width, ciff->height);
+	jsonString(out, ciff->caption.ptr, ciff->caption.len);
+	outbuffer_append(out, ",\"tags\":[", 9);
+	for(unsigned long long i=0; i<ciff->tagcnt; ++i) {
+		if(i) outbuffer_append(out, ",", 1);
+		jsonString(out, ciff->tags[i].ptr, ciff->tags[i].len);
+	}
+	outbuffer_append(out, "]", 1);
+}
+
+// --metadata: the structure is validated like for a preview, the pixels are never read
+// record: one line of JSON, also on failure ("error")
+ReturnCode handleMetadata(const char* const fn, FileType ft, OutBuffer*record) {
+	logDebug("\n%s: %s\n", __func__, fn);
+	if((ft != FTYPE_CIFF) && (ft != FTYPE_CAFF)) return RET_ERR_CHK;
+	InputBuffer in;
+	Arena arena;
+	arena_init(&arena);
+	OutBuffer*out = record;
+	out->len = 0;
+	outbuffer_append(out, "{\"file\":", 8);
+	jsonString(out, fn, strlen(fn));
+	jsonPrintf(out, ",\"type\":\"%s\",", (ft == FTYPE_CIFF) ? "ciff" : "caff");
+	const size_t head = out->len;
+	ReturnCode ret = inputbuffer_open(fn, &in, 1);
+	if((ret == RET_OK) && (ft == FTYPE_CIFF)) {
+		CIFF*ciff = NULL;
+		ret = ciffParse(in.data, in.len, &ciff, &arena);
+		if(ret == RET_OK) jsonCIFF(out, ciff);
+	}
+	else if(ret == RET_OK) {
+		CAFF*caff = NULL;
+		unsigned long long t = statsBegin();
+		ret = caffParse(in.data, in.len, &caff, &arena);
+		statsEnd(STAGE_PARSE, t);
+		if(ret == RET_OK) {
+			statsCount(STAT_FRAMES, caff->header.num_anim);
+			const CAFFCredits*cr = &caff->credits;
+			if(cr->block_handled) {
+				jsonPrintf(out, "\"credits\":{\"date\":\"%04u-%02u-%02uT%02u:%02u\",\"creator\":",
+					cr->year, cr->month, cr->day, cr->hour, cr->minute);
+				jsonString(out, cr->creator, cr->creator_len);
+				outbuffer_append(out, "},", 2);
+			}
+			else outbuffer_append(out, "\"credits\":null,", 15);
+			unsigned long long total = 0;
+			for(unsigned long long k=0; k<caff->header.num_anim; ++k) total += caff->animations[k].duration;
+			jsonPrintf(out, "\"duration\":%llu,\"frames\":[", total);
+			for(unsigned long long k=0; (ret == RET_OK) && (k<caff->header.num_anim); ++k) {
+				CIFF*frame = NULL;
+				if((ret = caff_frame(caff, k, &frame)) != RET_OK) break;
+				jsonPrintf(out, "%s{\"duration\":%llu,", k ? "," : "", caff->animations[k].duration);
+				jsonCIFF(out, frame);
+				outbuffer_append(out, "}", 1);
+			}
+			outbuffer_append(out, "]", 1);
+		}
+	}
+	if(ret != RET_OK) { // the partial record is dropped
+		out->len = head;
+		jsonPrintf(out, "\"error\":\"%s\"", rt2s(ret));
+	}
+	if(outbuffer_append(out, "}\n", 2) != RET_OK) ret = RET_ERR_MEM;
+	arena_clear(&arena);
+	inputbuffer_clear(&in);
+	return ret;
+}
+
+static const char*const statsStageNames[STAGE_COUNT] = { "read", "parse", "validate", "encode", "write" };
+static const char*const statsCounterNames[STAT_COUNT] = { "bytes_in", "bytes_out", "frames", "unique_frames", "tags", "arena_allocs", "heap_allocs" };
+
+static void statsFields(OutBuffer*out, const FileStats*fs) {
+	if(g_stats.json) {
+		outbuffer_append(out, ",\"ms\":{", 7);
+		for(int i=0; i<STAGE_COUNT; ++i) jsonPrintf(out, "%s\"%s\":%.3f", i ? "," : "", statsStageNames[i], fs->ns[i] / 1e6);
+		outbuffer_append(out, "}", 1);
+		for(int i=0; i<STAT_COUNT; ++i) jsonPrintf(out, ",\"%s\":%llu", statsCounterNames[i], fs->counters[i]);
+	}
+	else {
+		for(int i=0; i<STAGE_COUNT; ++i) jsonPrintf(out, "%s %s %.3fms", i ? "," : "", statsStageNames[i], fs->ns[i] / 1e6);
+		outbuffer_append(out, ";", 1);
+		for(int i=0; i<STAT_COUNT; ++i) jsonPrintf(out, "%s %s %llu", i ? "," : "", statsCounterNames[i], fs->counters[i]);
+	}
+}
+
+// one line per file (a JSON object with --stats json), added to the total
+void statsReport(const char*label, ReturnCode ret, const FileStats*fs) {
+	OutBuffer line;
+	outbuffer_init(&line);
+	if(g_stats.json) {
+		outbuffer_append(&line, "{\"file\":", 8);
+		jsonString(&line, label, strlen(label));
+		jsonPrintf(&line, ",\"ret\":\"%s\"", rt2s(ret));
+		statsFields(&line, fs);
+		outbuffer_append(&line, "}\n", 2);
+	}
+	else {
+		outbuffer_append(&line, "stats ", 6);
+		outbuffer_append(&line, label, strlen(label));
+		outbuffer_append(&line, ":", 1);
+		statsFields(&line, fs);
+		outbuffer_append(&line, "\n", 1);
+	}
+	if(line.data) logPrintf("%.*s", (int)line.len, line.data);
+	outbuffer_clear(&line);
+	for(int i=0; i<STAGE_COUNT; ++i) __atomic_add_fetch(&g_stats.total.ns[i], fs->ns[i], __ATOMIC_RELAXED);
+	for(int i=0; i<STAT_COUNT; ++i) __atomic_add_fetch(&g_stats.total.counters[i], fs->counters[i], __ATOMIC_RELAXED);
+}
+
+// the reported files together, wall time of the run and the peak RSS of the process
+void statsSummary(int files, int failed, unsigned long long wall_ns) {
+	struct rusage ru;
+	long rss = (getrusage(RUSAGE_SELF, &ru) == 0) ? ru.ru_maxrss : 0; // KiB
+	const FileStats*fs = &g_stats.total;
+	const unsigned long long frames = fs->counters[STAT_FRAMES], unique = fs->counters[STAT_UNIQUE_FRAMES];
+	OutBuffer line;
+	outbuffer_init(&line);
+	if(g_stats.json) {
+		jsonPrintf(&line, "{\"total\":{\"files\":%d,\"failed\":%d,\"wall_ms\":%.3f", files, failed, wall_ns / 1e6);
+		statsFields(&line, fs);
+		if(unique > 0) jsonPrintf(&line, ",\"dedup_ratio\":%.2f", (double)frames / (double)unique);
+		jsonPrintf(&line, ",\"peak_rss_kib\":%ld}}\n", rss);
+	}
+	else {
+		jsonPrintf(&line, "stats total: %d files (%d failed) in %.3fms;", files, failed, wall_ns / 1e6);
+		statsFields(&line, fs);
+		if(unique > 0) jsonPrintf(&line, "; dedup ratio %.2f", (double)frames / (double)unique);
+		jsonPrintf(&line, "; peak rss %ld KiB\n", rss);
+	}
+	if(line.data) logPrintf("%.*s", (int)line.len, line.data);
+	outbuffer_clear(&line);
+}
+
+// dst: room for strlen(fn) + the longest extension + 1
+void previewName(const char* const fn, FileType ft, const EncodeOptions*enc, char*dst) {
+	size_t fnlen=strlen(fn);
+	const PreviewEncoder*pe = previewEncoder(enc ? enc->format : FORMAT_JPG);
+	const char*ext = ((ft == FTYPE_CAFF) && enc && enc->animate) ? pe->animExt : pe->ext;
+	strcpy(dst, fn);
+	if((fnlen >= 5) && strcasecmp(fn+fnlen-5, (ft == FTYPE_CIFF) ? ".ciff" : ".caff")==0)
+		strcpy(dst+fnlen-5, ext); // if filename have ".CIFF" than replace it
+	else
+		strcat(dst, ext); // filename could be anything
+}
+
+// stdin ("-") and anything that is not a regular file (pipe, socket, char device)
+int isStreamInput(const char* const fn) {
+	if(strcmp(fn, "-") == 0) return 1;
+	struct stat st;
+	if(stat(fn, &st) != 0) return 0; // let the regular path report the error
+	return !S_ISREG(st.st_mode);
+}
+
+typedef struct T_StreamPreview {
+	const char*dstname;
+	const EncodeOptions*enc;
+} StreamPreview;
+
+static ReturnCode streamPreviewFrame(void*user, unsigned long long k, unsigned long long duration, const CIFF*ciff) {
+	(void)duration;
+	if(k != 0) return RET_OK; // only the first frame is rendered, the rest is validated
+	const StreamPreview*sp = (const StreamPreview*)user;
+	return toPreview(ciff, sp->dstname, sp->enc, NULL); // the input isn't known up front, no cache
+}
+
+ReturnCode handleCAFFStream(int fd, const char* const dstname, const EncodeOptions*enc) {
+	CAFFStreamCallbacks cb = { NULL, NULL, streamPreviewFrame };
+	StreamPreview sp = { dstname, enc };
+	CAFFStream st;
+	caffstream_init(&st, &cb, &sp);
+	char*chunk = (char*)malloc(readChunkSize);
+	if(!chunk) return RET_ERR_MEM;
+	ReturnCode ret = RET_OK;
+	for(;;) {
+		unsigned long long t = statsBegin();
+		ssize_t r = read(fd, chunk, readChunkSize);
+		statsEnd(STAGE_READ, t);
+		if(r < 0) {
+			ret = RET_ERR_IO;
+			break;
+		}
+		statsCount(STAT_BYTES_IN, (unsigned long long)r);
+		if(r == 0) {
+			ret = caffstream_finish(&st);
+			break;
+		}
+		if((ret = caffstream_feed(&st, chunk, (size_t)r)) != RET_OK) break;
+	}
+	statsCount(STAT_FRAMES, st.frames);
+	if((ret == RET_OK) && (st.frames == 0)) ret = RET_ERR_CHK; // nothing to preview
+	if((ret != RET_OK) && (st.frames > 0) && strcmp(dstname, "-")) remove(dstname); // the preview was written before the error turned up
+	free(chunk);
+	caffstream_clear(&st);
+	return ret;
+}
+
+// regular files are mapped read-only, everything else (pipes, stdin as "-") is read into the heap
+// headersOnly: the pixels won't be looked at, no readahead
+ReturnCode inputbuffer_open(const char* const fn, InputBuffer*in, int headersOnly) {
+	unsigned long long t = statsBegin();
+	ReturnCode ret = inputbuffer_load(fn, in, headersOnly);
+	statsEnd(STAGE_READ, t);
+	if(ret == RET_OK) statsCount(STAT_BYTES_IN, in->len);
+	return ret;
+}
+
+ReturnCode inputbuffer_load(const char* const fn, InputBuffer*in, int headersOnly) {
+	inputbuffer_init(in);
+	int fd = (strcmp(fn, "-") == 0) ? STDIN_FILENO : open(fn, O_RDONLY);
+	if(fd < 0) return RET_ERR_IO;
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		if(fd != STDIN_FILENO) close(fd);
+		return RET_ERR_IO;
+	}
+	if(S_ISREG(st.st_mode)) {
+		size_t sz = (size_t)st.st_size;
+		if(sz > 0) {
+			void*m = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(m != MAP_FAILED) {
+				if(headersOnly) madvise(m, sz, MADV_RANDOM); // only the pages holding headers are faulted in
+				else { // parsers walk the blocks front to back, let the kernel read ahead aggressively
+					madvise(m, sz, MADV_SEQUENTIAL);
+					madvise(m, sz, MADV_WILLNEED);
+				}
+				if(fd != STDIN_FILENO) close(fd); // the mapping keeps the file referenced
+				in->map = m;
+				in->maplen = sz;
+				in->data = (const char*)m;
+				in->len = sz;
+				return RET_OK;
+			}
+		}
+	}
+	// fallback: grow a heap buffer until EOF, the size is not known up front so the growth is reserved
+	// without waiting (this job may already hold a part of the budget)
+	size_t cap = 0, len = 0;
+	ReturnCode ret = RET_OK;
+	for(;;) {
+		if(len == cap) {
+			size_t ncap = (cap == 0) ? readChunkSize : cap*2;
+			if((ret = budget_reserve(ncap - cap, 0)) != RET_OK) break;
+			in->reserved += ncap - cap;
+			char*nb = (char*)realloc(in->heap, ncap);
+			if(!nb) {
+				ret = RET_ERR_MEM;
+				break;
+			}
+			in->heap = nb;
+			cap = ncap;
+		}
+		ssize_t r = read(fd, in->heap + len, cap - len);
+		if(r < 0) {
+			ret = RET_ERR_IO;
+			break;
+		}
+		if(r == 0) break; // EOF
+		len += (size_t)r;
+	}
+	if(fd != STDIN_FILENO) close(fd);
+	if(ret != RET_OK) {
+		inputbuffer_clear(in);
+		return ret;
+	}
+	in->data = in->heap ? in->heap : "";
+	in->len = len;
+	return RET_OK;
+}
+
+void inputbuffer_clear(InputBuffer*in) {
+	if(!in) return;
+	if(in->map) {
+		munmap(in->map, in->maplen);
+		in->map = NULL;
+		in->maplen = 0;
+	}
+	if(in->heap) {
+		free(in->heap);
+		in->heap = NULL;
+	}
+	budget_release(in->reserved);
+	in->reserved = 0;
+	in->data = NULL;
+	in->len = 0;
+}
+
+// touches every page of a mapping, so the reads happen on the calling thread; heap inputs are already in memory
+void inputbuffer_prefetch(const InputBuffer*in) {
+	if(!in || !in->map) return;
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	const volatile char*p = (const volatile char*)in->map;
+	char sink = 0;
+	for(size_t off=0; off<in->maplen; off+=page) sink ^= p[off];
+	(void)sink;
+}
+
+void inputbuffer_init(InputBuffer*in) {
+	if(!in) return;
+	in->data = NULL;
+	in->len = 0;
+	in->map = NULL;
+	in->maplen = 0;
+	in->heap = NULL;
+	in->reserved = 0;
+}
+
+// wait: block until the bytes fit; only for callers holding no reservation, otherwise two jobs could wait
+// for each other. What can't fit even into an empty budget is rejected right away.
+ReturnCode budget_reserve(unsigned long long bytes, int wait) {
+	if(!g_budget.limit || !bytes) return RET_OK;
+	if(bytes > g_budget.limit) return RET_ERR_RES_CONSTRAINT;
+	ReturnCode ret = RET_OK;
+	pthread_mutex_lock(&g_budget.lock);
+	if(wait && (g_budget.used + bytes > g_budget.limit))
+		logDebug("waiting for %llu bytes of the memory budget (%llu in use)\n", bytes, g_budget.used);
+	while(g_budget.used + bytes > g_budget.limit) {
+		if(!wait) {
+			ret = RET_ERR_RES_CONSTRAINT;
+			break;
+		}
+		pthread_cond_wait(&g_budget.cond, &g_budget.lock);
+	}
+	if(ret == RET_OK) g_budget.used += bytes;
+	pthread_mutex_unlock(&g_budget.lock);
+	return ret;
+}
+
+void budget_release(unsigned long long bytes) {
+	if(!g_budget.limit || !bytes) return;
+	pthread_mutex_lock(&g_budget.lock);
+	g_budget.used -= bytes;
+	pthread_cond_broadcast(&g_budget.cond);
+	pthread_mutex_unlock(&g_budget.lock);
+}
+
+unsigned long long physicalMemory(void) {
+	long pages = sysconf(_SC_PHYS_PAGES), page = sysconf(_SC_PAGESIZE);
+	return ((pages > 0) && (page > 0)) ? (unsigned long long)pages * (unsigned long long)page : 0;
+}
+
+// Little-Endian
+unsigned char loadUInt8(const char*const buf) {
+	return (unsigned char)buf[0];
+}
+unsigned short loadUInt16(const char*const buf) {
+	uint16_t v;
+	memcpy(&v, buf, sizeof(v)); // one unaligned load
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap16(v);
+#endif
+	return v;
+}
+unsigned long loadUInt32(const char*const buf) {
+	uint32_t v;
+	memcpy(&v, buf, sizeof(v)); // one unaligned load
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+unsigned long long loadUInt64(const char*const buf) {
+	uint64_t v;
+	memcpy(&v, buf, sizeof(v)); // one unaligned load
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+
+// the memory belongs to the arena it was parsed into, only the views are dropped
+void ciff_clear(CIFF*ciff) {
+	if(!ciff)return;
+	ciff->tags=NULL;
+	ciff->storage=NULL;
+	ciff->caption.ptr = NULL; // mark as invalid
+	ciff->caption.len = 0;
+	ciff->tagcnt = 0;
+	ciff->imgbuf = NULL;
+	ciff->header_size = 0;
+	ciff->content_size = 0;
+	ciff->width = 0;
+	ciff->height = 0;
+}
+
+void ciff_init(CIFF*ciff) {
+	if(!ciff)return;
+	ciff->header_size = 0;
+	ciff->content_size = 0;
+	ciff->width = 0;
+	ciff->height = 0;
+	ciff->caption.ptr = NULL;
+	ciff->caption.len = 0;
+	ciff->tags = NULL;
+	ciff->tagcnt = 0;
+	ciff->imgbuf = NULL;
+	ciff->storage = NULL;
+}
+
+// copy the borrowed caption, tags and pixels into one block of the arena
+// strings become '\0' terminated, the source buffer can be released afterwards
+ReturnCode ciff_materialize(CIFF*ciff, Arena*arena) {
+	if(!ciff) return RET_ERR_CHK;
+	if(ciff->storage) return RET_OK; // already owned
+	unsigned long long total = ciff->caption.len + 1 + ciff->content_size;
+	for(unsigned long long i=0; i<ciff->tagcnt; ++i) total += ciff->tags[i].len + 1;
+	char*st = (char*)arena_alloc(arena, total);
+	if(!st) return RET_ERR_MEM;
+	char*p = st;
+	memcpy(p, ciff->imgbuf, ciff->content_size); // pixels first, keep them at the start of the block
+	ciff->imgbuf = p;
+	p += ciff->content_size;
+	memcpy(p, ciff->caption.ptr, ciff->caption.len);
+	p[ciff->caption.len] = '\0';
+	ciff->caption.ptr = p;
+	p += ciff->caption.len + 1;
+	for(unsigned long long i=0; i<ciff->tagcnt; ++i) {
+		memcpy(p, ciff->tags[i].ptr, ciff->tags[i].len);
+		p[ciff->tags[i].len] = '\0';
+		ciff->tags[i].ptr = p;
+		p += ciff->tags[i].len + 1;
+	}
+	ciff->storage = st;
+	return RET_OK;
+}
+
+// like ciff_clear: the frames, the index and the struct itself go with caff->arena
+void caff_clear(CAFF*caff) {
+	if(!caff)return;
+	caff->animations=NULL;
+	
+	caff->header.header_size = 0;
+	caff->header.num_anim = 0;
+	caff->header.block_handled = 0;
+	caff->credits.year = 0;
+	caff->credits.month = 0;
+	caff->credits.day = 0;
+	caff->credits.hour = 0;
+	caff->credits.minute = 0;
+	caff->credits.creator_len = 0;
+	caff->credits.block_handled = 0;
+	caff->credits.creator = NULL;
+	caffindex_clear(&caff->index);
+	caff->unique_frames = 0;
+	caff->arena = NULL;
+}
+
+void caff_init(CAFF*caff) {
+	if(!caff)return;
+	caff->header.header_size = 0;
+	caff->header.num_anim = 0;
+	caff->header.block_handled = 0;
+	caff->credits.year = 0;
+	caff->credits.month = 0;
+	caff->credits.day = 0;
+	caff->credits.hour = 0;
+	caff->credits.minute = 0;
+	caff->credits.creator_len = 0;
+	caff->credits.creator = NULL;
+	caff->credits.block_handled = 0;
+	caff->animations = NULL;
+	caffindex_init(&caff->index);
+	caff->unique_frames = 0;
+	caff->arena = NULL;
+}
+
+void caffindex_clear(CAFFIndex*index) {
+	if(!index) return;
+	index->blocks = NULL;
+	index->frame_blocks = NULL;
+	index->blockcnt = 0;
+	index->header_block = 0;
+	index->credits_block = 0;
+	index->framecnt = 0;
+}
+
+void caffindex_init(CAFFIndex*index) {
+	if(!index) return;
+	index->blocks = NULL;
+	index->blockcnt = 0;
+	index->header_block = 0;
+	index->credits_block = 0;
+	index->frame_blocks = NULL;
+	index->framecnt = 0;
+}
+
+void runtimeconfig_clear(RuntimeConfig*rt) {
+	if(!rt) return;
+	if(rt->ciffFiles) {
+		for(int i=0; i<rt->ciffcnt; ++i) {
+			free(rt->ciffFiles[i]);
+			rt->ciffFiles[i]=NULL;
+		}
+		free(rt->ciffFiles);
+		rt->ciffFiles=NULL;
+		rt->ciffcnt = 0;
+	}
+	if(rt->caffFiles) {
+		for(int i=0; i<rt->caffcnt; ++i) {
+			free(rt->caffFiles[i]);
+			rt->caffFiles[i]=NULL;
+		}
+		free(rt->caffFiles);
+		rt->caffFiles=NULL;
+		rt->caffcnt = 0;
+	}
+	rt->printHelp = 0;
+	rt->jobs = 0;
+	rt->keepGoing = 0;
+	rt->stats = STATS_OFF;
+	rt->logLevel = log_info;
+	rt->metadata = 0;
+	rt->cacheDir = NULL;
+	rt->cacheMax = 0;
+	rt->memBudget = 0;
+	rt->servePath = NULL;
+	rt->clientPath = NULL;
+	rt->clientInline = 0;
+	encodeoptions_init(&rt->encode);
+}
+
+void encodeoptions_init(EncodeOptions*enc) {
+	enc->output = NULL;
+	enc->format = FORMAT_JPG;
+	enc->lossless = 0;
+	enc->effort = webp_effort;
+	enc->animate = 0;
+	enc->scale = 1;
+	enc->maxDim = 0;
+	enc->profile = JPG_PROFILE_BALANCED;
+	enc->quality = jpg_quality;
+}
+
+void runtimeconfig_init(RuntimeConfig*rt) {
+	rt->printHelp = 0;
+	rt->jobs = 0;
+	rt->keepGoing = 0;
+	rt->stats = STATS_OFF;
+	rt->logLevel = log_info;
+	rt->metadata = 0;
+	rt->cacheDir = NULL;
+	rt->cacheMax = 0;
+	rt->memBudget = 0;
+	rt->servePath = NULL;
+	rt->clientPath = NULL;
+	rt->clientInline = 0;
+	encodeoptions_init(&rt->encode);
+	rt->ciffcnt = 0;
+	rt->ciffFiles = NULL;
+	rt->caffcnt = 0;
+	rt->caffFiles = NULL;
+}
+
+// fixed size part only: magic, sizes and their consistency, no allocation
+ReturnCode ciffParseHeader(const char* const buf, size_t bufLen, CIFF*ciff) {
+	ciff_init(ciff);
+	if(ciff_minlen > bufLen) return RET_ERR_FORMAT;
+	if(strncmp(buf, MagicCIFF, MagicCIFFlen)) return RET_ERR_FORMAT; // it has MAGIC?
+	ciff->header_size  = loadUInt64(buf + ciff_offset_header_size);
+	ciff->content_size = loadUInt64(buf + ciff_offset_content_size);
+	ciff->width        = loadUInt64(buf + ciff_offset_width);
+	ciff->height       = loadUInt64(buf + ciff_offset_height);
+	logDebug("ciff.header_size=%llu\n", ciff->header_size);
+	logDebug("ciff.content_size=%llu\n", ciff->content_size);
+	logDebug("ciff.width=%llu\n", ciff->width);
+	logDebug("ciff.height=%llu\n", ciff->height);
+	if(ciff->header_size < ciff_minlen) return RET_ERR_FORMAT; // no room for the caption
+	if(((ciff->header_size + ciff->content_size) < ciff->header_size) || ((ciff->header_size + ciff->content_size) < ciff->content_size)) {
+		logError("overflow: %llu + %llu\n", ciff->header_size, ciff->content_size);
+		return RET_ERR_CHK;
+	}
+	logDebug("file size check: %llu =? %lu\n", (ciff->header_size+ciff->content_size), bufLen);
+	if((ciff->header_size + ciff->content_size) != bufLen)
+		return RET_ERR_CHK;
+	// --> overflow check
+	if((ciff->width != 0) && (ciff->height > ULLONG_MAX / 3 / ciff->width)) {
+		logError("overflow: %llu * %llu * 3\n", ciff->width, ciff->height);
+		return RET_ERR_CHK;
+	}
+	logDebug("image size check: %llu =? %llu\n", (ciff->width*ciff->height)*3, ciff->content_size);
+	if(ciff->width*ciff->height*3 != ciff->content_size) 
+		return RET_ERR_CHK;
+	return RET_OK;
+}
+
+// caption+tags in one pass: where the first '\n' and '\0' are and how many of them there are
+typedef struct T_HeaderScan {
+	size_t first_nl;  // == len if there is none
+	size_t first_nul;
+	size_t nl;
+	size_t nul;
+} HeaderScan;
+
+typedef void (*HeaderScanFn)(const char*p, size_t len, HeaderScan*hs);
+// tags from the '\0' separated area, len bytes ending with a '\0'
+typedef void (*HeaderSplitFn)(const char*p, size_t len, CIFFSlice*tags);
+
+static void headerScanScalar(const char*p, size_t len, HeaderScan*hs) {
+	hs->first_nl = hs->first_nul = len;
+	hs->nl = hs->nul = 0;
+	for(size_t i=0; i<len; ++i) {
+		if(p[i] == '\n') {
+			if(hs->nl++ == 0) hs->first_nl = i;
+		}
+		else if(p[i] == '\0') {
+			if(hs->nul++ == 0) hs->first_nul = i;
+		}
+	}
+}
+
+static void headerSplitScalar(const char*p, size_t len, CIFFSlice*tags) {
+	size_t start = 0;
+	for(size_t i=0; i<len; ++i)
+		if(p[i] == '\0') {
+			tags->ptr = p + start;
+			tags->len = i - start;
+			++tags;
+			start = i + 1;
+		}
+}
+
+// bit i of nl/nul is byte base+i
+static inline void headerScanMasks(HeaderScan*hs, size_t base, unsigned long long nl, unsigned long long nul) {
+	if(nl) {
+		if(hs->nl == 0) hs->first_nl = base + __builtin_ctzll(nl);
+		hs->nl += __builtin_popcountll(nl);
+	}
+	if(nul) {
+		if(hs->nul == 0) hs->first_nul = base + __builtin_ctzll(nul);
+		hs->nul += __builtin_popcountll(nul);
+	}
+}
+
+static inline CIFFSlice* headerSplitMask(const char*p, size_t base, unsigned long long nul, size_t*start, CIFFSlice*tags) {
+	while(nul) {
+		size_t e = base + __builtin_ctzll(nul);
+		tags->ptr = p + *start;
+		tags->len = e - *start;
+		++tags;
+		*start = e + 1;
+		nul &= nul - 1;
+	}
+	return tags;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void headerScanSSE2(const char*p, size_t len, HeaderScan*hs) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i zero = _mm_setzero_si128();
+	hs->first_nl = hs->first_nul = len;
+	hs->nl = hs->nul = 0;
+	size_t i = 0;
+	for(; i+16<=len; i+=16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p+i));
+		headerScanMasks(hs, i, (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)), (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+	}
+	for(; i<len; ++i) headerScanMasks(hs, i, p[i] == '\n', p[i] == '\0');
+}
+
+__attribute__((target("sse2")))
+static void headerSplitSSE2(const char*p, size_t len, CIFFSlice*tags) {
+	const __m128i zero = _mm_setzero_si128();
+	size_t start = 0, i = 0;
+	for(; i+16<=len; i+=16)
+		tags = headerSplitMask(p, i, (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+i)), zero)), &start, tags);
+	for(; i<len; ++i) tags = headerSplitMask(p, i, p[i] == '\0', &start, tags);
+}
+
+__attribute__((target("avx2,popcnt")))
+static void headerScanAVX2(const char*p, size_t len, HeaderScan*hs) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	const __m256i zero = _mm256_setzero_si256();
+	hs->first_nl = hs->first_nul = len;
+	hs->nl = hs->nul = 0;
+	size_t i = 0;
+	for(; i+64<=len; i+=64) { // two vectors per step, one 64 bit mask each
+		__m256i a = _mm256_loadu_si256((const __m256i*)(p+i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(p+i+32));
+		unsigned long long mnl = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl)) |
+			((unsigned long long)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl)) << 32);
+		unsigned long long mnul = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero)) |
+			((unsigned long long)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, zero)) << 32);
+		headerScanMasks(hs, i, mnl, mnul);
+	}
+	for(; i<len; ++i) headerScanMasks(hs, i, p[i] == '\n', p[i] == '\0');
+}
+
+__attribute__((target("avx2,popcnt")))
+static void headerSplitAVX2(const char*p, size_t len, CIFFSlice*tags) {
+	const __m256i zero = _mm256_setzero_si256();
+	size_t start = 0, i = 0;
+	for(; i+32<=len; i+=32)
+		tags = headerSplitMask(p, i, (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+i)), zero)), &start, tags);
+	for(; i<len; ++i) tags = headerSplitMask(p, i, p[i] == '\0', &start, tags);
+}
+#endif
+
+static HeaderScanFn headerScanImpl(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return headerScanAVX2;
+	if(__builtin_cpu_supports("sse2")) return headerScanSSE2;
+#endif
+	return headerScanScalar;
+}
+
+static HeaderSplitFn headerSplitImpl(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return headerSplitAVX2;
+	if(__builtin_cpu_supports("sse2")) return headerSplitSSE2;
+#endif
+	return headerSplitScalar;
+}
+
+ReturnCode ciffParse(const char* const buf, size_t bufLen, CIFF** ciff_result, Arena*arena) {
+	*ciff_result = NULL;
+	CIFF ciff;
+	unsigned long long t = statsBegin();
+	ReturnCode r = ciffParseHeader(buf, bufLen, &ciff);
+	statsEnd(STAGE_PARSE, t);
+	if(r != RET_OK) return r;
+	t = statsBegin();
+	r = ciffParseTags(buf, ciff, ciff_result, arena);
+	statsEnd(STAGE_VALIDATE, t);
+	return r;
+}
+
+// caption and tags after a successful ciffParseHeader, *ciff_result is allocated at the end
+ReturnCode ciffParseTags(const char* const buf, CIFF ciff, CIFF** ciff_result, Arena*arena) {
+
+	// caption and tags: one scan finds the end of the caption, the tag terminators and the forbidden characters
+	const char*area = buf+ciff_offset_caption;
+	const size_t arealen = ciff.header_size - ciff_offset_caption;
+	HeaderScan hs;
+	headerScanImpl()(area, arealen, &hs);
+	if(hs.nl == 0) return RET_ERR_FORMAT; // the caption ends with '\n'
+	const unsigned long long npos = ciff_offset_caption + hs.first_nl;
+
+	ciff.caption.ptr = area; // '\n' in the end
+	ciff.caption.len = hs.first_nl;
+	if(hs.first_nul < hs.first_nl) //non-ascii also
+		return RET_ERR_CHK;
+	logDebug("ciff.caption=\"%.*s\"\n", (int)ciff.caption.len, ciff.caption.ptr);
+
+	// tags , npos -> end of the caption
+	//strings in range npos+1 .. header_size (caption+tags), every '\0' closes one
+	unsigned long long f = hs.nul;
+	// PROBLEM: unclean docs: can tags omitted (0 tag) ?
+	if(f < 1) return RET_ERR_CHK; // if tags not optional
+	logDebug("%llu tag candidate\n", f);
+	statsCount(STAT_TAGS, f);
+	if(hs.nl > 1) return RET_ERR_CHK; // '\n' inside a tag
+	if(buf[ciff.header_size-1] != '\0') { // bytes after the last tag
+		logError("the header doesn't end with a tag\n");
+		return RET_ERR_CHK;
+	}
+	if(f > (SIZE_MAX - sizeof(CIFF)) / sizeof(CIFFSlice) - 2) return RET_ERR_MEM;
+	(void)arena_reserve(arena, f*sizeof(CIFFSlice) + sizeof(CIFF) + 2*arena_align); // the tags and the struct side by side
+	ciff.tags = (CIFFSlice*)arena_alloc(arena, f*sizeof(CIFFSlice));
+	if(!ciff.tags) {
+		ciff_clear(&ciff);
+		return RET_ERR_MEM;
+	}
+	ciff.tagcnt = f;
+	headerSplitImpl()(buf+npos+1, ciff.header_size-npos-1, ciff.tags);
+	if(logEnabled(log_debug))
+		for(unsigned long long i = 0; i<ciff.tagcnt; ++i)
+			logDebug("\tcandidate %llu=\"%.*s\"\n", i, (int)ciff.tags[i].len, ciff.tags[i].ptr);
+
+	// --> overflow check
+	if( buf > (buf+ciff.header_size+ciff.content_size)) {
+		logError("overflow detected: %p + %llu\n", buf, ciff.header_size);
+		ciff_clear(&ciff);
+		return RET_ERR_CHK;
+	}
+	ciff.imgbuf = buf+ciff.header_size; // no copy, see ciff_materialize
+	// for convenience reasons
+	if(((*ciff_result) = (CIFF*)arena_alloc(arena, sizeof(CIFF))) == NULL) {
+		ciff_clear(&ciff);
+		return RET_ERR_MEM;
+	} else {
+		memcpy(*ciff_result, &ciff, sizeof(CIFF));
+		return RET_OK;
+	}
+}
+
+
+const char* jpgProfileName(JPGProfile profile) {
+	if(profile == JPG_PROFILE_FAST) return "fast";
+	else if(profile == JPG_PROFILE_SMALL) return "small";
+	else return "balanced";
+}
+
+int jpgProfileParse(const char*name, JPGProfile*profile) {
+	if(strcmp(name, "balanced") == 0) *profile = JPG_PROFILE_BALANCED;
+	else if(strcmp(name, "fast") == 0) *profile = JPG_PROFILE_FAST;
+	else if(strcmp(name, "small") == 0) *profile = JPG_PROFILE_SMALL;
+	else return 0;
+	return 1;
+}
+
+// everything but the destination, the same for every encode path
+void jpgSetup(struct jpeg_compress_struct*cinfo, unsigned long long width, unsigned long long height, const EncodeOptions*enc) {
+	cinfo->image_width = width;
+	cinfo->image_height = height;
+	cinfo->input_components = 3;
+	cinfo->in_color_space = JCS_RGB;
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, (enc && (enc->quality > 0)) ? enc->quality : jpg_quality, TRUE);
+	JPGProfile profile = enc ? enc->profile : JPG_PROFILE_BALANCED;
+	if(profile == JPG_PROFILE_FAST) {
+		cinfo->dct_method = JDCT_IFAST;
+		cinfo->optimize_coding = FALSE;
+	}
+	else if(profile == JPG_PROFILE_SMALL) {
+		cinfo->optimize_coding = TRUE;
+		jpeg_simple_progression(cinfo);
+	}
+}
+
+// count consecutive RGB rows (the first one is the next scanline), in batches of jpg_row_batch
+void jpgWriteRows(struct jpeg_compress_struct*cinfo, const char*rows, size_t stride, unsigned long long count) {
+	JSAMPROW batch[jpg_row_batch];
+	unsigned long long done = 0;
+	while ((done < count) && (cinfo->next_scanline < cinfo->image_height)) {
+		unsigned long long n = count - done;
+		if(n > jpg_row_batch) n = jpg_row_batch;
+		for(unsigned long long i=0; i<n; ++i)
+			batch[i] = (JSAMPROW)(rows + (done + i) * stride); // encoded straight from the view
+		JDIMENSION w = jpeg_write_scanlines(cinfo, batch, (JDIMENSION)n);
+		if(w == 0) break; // only a suspending destination would do this
+		done += w;
+	}
+}
+
+// RGB -> YCbCr 4:2:0 ahead of libjpeg, the planes go in with jpeg_write_raw_data (raw_data_in).
+// The arithmetic is that of rgb_ycc_convert (jccolor.c) and h2v2_downsample (jcsample.c), the edges are
+// repeated like jcprepct.c does: the output is bit-exact with the JCS_RGB scanline path.
+#define ycc_fix(x) ((int)((x) * 65536 + 0.5))
+#define ycc_one_half (1 << 15)
+#define ycc_cbcr_offset (128 << 16)
+
+// one pair of source rows (r1 == r0 on the last row of an odd height) into two luma rows and one row of
+// each chroma plane; the pixels past width repeat the last one up to 2*cw columns (cw: chroma width)
+typedef void (*YCCRowsFn)(const unsigned char*r0, const unsigned char*r1, size_t width, size_t cw,
+	unsigned char*y0, unsigned char*y1, unsigned char*cb, unsigned char*cr);
+
+// one iMCU row of planes: 2*DCTSIZE luma rows (2*cw wide) and DCTSIZE rows of both chroma planes
+typedef struct T_YCCPlanes {
+	unsigned char*buf;
+	size_t cw;
+	YCCRowsFn convert;
+	JSAMPROW y[2*DCTSIZE];
+	JSAMPROW cb[DCTSIZE];
+	JSAMPROW cr[DCTSIZE];
+} YCCPlanes;
+
+static inline int yccY(int r, int g, int b) {
+	return (ycc_fix(0.29900)*r + ycc_fix(0.58700)*g + ycc_fix(0.11400)*b + ycc_one_half) >> 16;
+}
+
+static inline int yccCb(int r, int g, int b) {
+	return (-ycc_fix(0.16874)*r - ycc_fix(0.33126)*g + ycc_fix(0.50000)*b + ycc_cbcr_offset + ycc_one_half - 1) >> 16;
+}
+
+static inline int yccCr(int r, int g, int b) {
+	return (ycc_fix(0.50000)*r - ycc_fix(0.41869)*g - ycc_fix(0.08131)*b + ycc_cbcr_offset + ycc_one_half - 1) >> 16;
+}
+
+// pixel pairs from x (even) on; the rounding bias of the 2x2 average alternates 1, 2 along the row
+static void yccRowsFrom(const unsigned char*r0, const unsigned char*r1, size_t width, size_t cw,
+	unsigned char*y0, unsigned char*y1, unsigned char*cb, unsigned char*cr, size_t x) {
+	for(; x<2*cw; x+=2) {
+		int sb = 0, sr = 0;
+		for(int k=0; k<4; ++k) {
+			size_t c = x + (k & 1);
+			if(c >= width) c = width - 1;
+			const unsigned char*p = ((k < 2) ? r0 : r1) + c*3;
+			((k < 2) ? y0 : y1)[x + (k & 1)] = (unsigned char)yccY(p[0], p[1], p[2]);
+			sb += yccCb(p[0], p[1], p[2]);
+			sr += yccCr(p[0], p[1], p[2]);
+		}
+		const int bias = 1 + ((x >> 1) & 1);
+		cb[x >> 1] = (unsigned char)((sb + bias) >> 2);
+		cr[x >> 1] = (unsigned char)((sr + bias) >> 2);
+	}
+}
+
+static void yccRowsScalar(const unsigned char*r0, const unsigned char*r1, size_t width, size_t cw,
+	unsigned char*y0, unsigned char*y1, unsigned char*cb, unsigned char*cr) {
+	yccRowsFrom(r0, r1, width, cw, y0, y1, cb, cr, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// pshufb masks taking the R, G and B bytes of 16 pixels out of the three 16 byte loads that hold them
+static const signed char ycc_deinterleave[3][3][16] = {
+	{ { 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+	  { -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1 },
+	  { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13 } },
+	{ { 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+	  { -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1 },
+	  { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14 } },
+	{ { 2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+	  { -1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1 },
+	  { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15 } }
+};
+
+// pmaddwd coefficient pairs: the first one multiplies the low word. FIX(0.587) and FIX(0.5) don't fit
+// a signed word, they are split into two halves over a repeated input
+#define ycc_pair(a, b) ((int)(((unsigned int)(b) << 16) | ((unsigned int)(a) & 0xffff)))
+#define ycc_y_rg ycc_pair(ycc_fix(0.29900), ycc_fix(0.58700)/2)
+#define ycc_y_bg ycc_pair(ycc_fix(0.11400), ycc_fix(0.58700) - ycc_fix(0.58700)/2)
+#define ycc_cb_rg ycc_pair(-ycc_fix(0.16874), -ycc_fix(0.33126))
+#define ycc_cb_bb ycc_pair(ycc_fix(0.50000)/2, ycc_fix(0.50000) - ycc_fix(0.50000)/2)
+#define ycc_cr_rr ycc_pair(ycc_fix(0.50000)/2, ycc_fix(0.50000) - ycc_fix(0.50000)/2)
+#define ycc_cr_gb ycc_pair(-ycc_fix(0.41869), -ycc_fix(0.08131))
+
+// 8 pixels of one component as words: ((p,q).cpq + (s,t).cst + add) >> 16
+__attribute__((target("sse2")))
+static inline __m128i yccTermSSE2(__m128i p, __m128i q, __m128i s, __m128i t, __m128i cpq, __m128i cst, __m128i add) {
+	__m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(p, q), cpq), _mm_madd_epi16(_mm_unpacklo_epi16(s, t), cst));
+	__m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(p, q), cpq), _mm_madd_epi16(_mm_unpackhi_epi16(s, t), cst));
+	return _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(lo, add), 16), _mm_srai_epi32(_mm_add_epi32(hi, add), 16));
+}
+
+// 2x2 sums of 8 + 8 chroma words (two rows), the bias and the average as 4 + 4 dwords packed to words
+__attribute__((target("sse2")))
+static inline __m128i yccDownSSE2(__m128i a0, __m128i a1, __m128i b0, __m128i b1, __m128i bias) {
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i lo = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(a0, one), _mm_madd_epi16(b0, one)), bias);
+	__m128i hi = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(a1, one), _mm_madd_epi16(b1, one)), bias);
+	return _mm_packs_epi32(_mm_srli_epi32(lo, 2), _mm_srli_epi32(hi, 2));
+}
+
+// Y, Cb and Cr words of the 16 pixels at p: [0] pixels 0..7, [1] pixels 8..15
+__attribute__((target("ssse3")))
+static inline void yccPixelsSSSE3(const unsigned char*p, __m128i y[2], __m128i cb[2], __m128i cr[2]) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i in[3] = { _mm_loadu_si128((const __m128i*)p), _mm_loadu_si128((const __m128i*)(p+16)), _mm_loadu_si128((const __m128i*)(p+32)) };
+	__m128i c[3];
+	for(int k=0; k<3; ++k)
+		c[k] = _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(in[0], _mm_loadu_si128((const __m128i*)ycc_deinterleave[k][0])),
+			_mm_shuffle_epi8(in[1], _mm_loadu_si128((const __m128i*)ycc_deinterleave[k][1]))),
+			_mm_shuffle_epi8(in[2], _mm_loadu_si128((const __m128i*)ycc_deinterleave[k][2])));
+	const __m128i yadd = _mm_set1_epi32(ycc_one_half), cadd = _mm_set1_epi32(ycc_cbcr_offset + ycc_one_half - 1);
+	for(int h=0; h<2; ++h) {
+		__m128i r = h ? _mm_unpackhi_epi8(c[0], zero) : _mm_unpacklo_epi8(c[0], zero);
+		__m128i g = h ? _mm_unpackhi_epi8(c[1], zero) : _mm_unpacklo_epi8(c[1], zero);
+		__m128i b = h ? _mm_unpackhi_epi8(c[2], zero) : _mm_unpacklo_epi8(c[2], zero);
+		y[h] = yccTermSSE2(r, g, b, g, _mm_set1_epi32(ycc_y_rg), _mm_set1_epi32(ycc_y_bg), yadd);
+		cb[h] = yccTermSSE2(r, g, b, b, _mm_set1_epi32(ycc_cb_rg), _mm_set1_epi32(ycc_cb_bb), cadd);
+		cr[h] = yccTermSSE2(r, r, g, b, _mm_set1_epi32(ycc_cr_rr), _mm_set1_epi32(ycc_cr_gb), cadd);
+	}
+}
+
+__attribute__((target("ssse3")))
+static void yccRowsSSSE3(const unsigned char*r0, const unsigned char*r1, size_t width, size_t cw,
+	unsigned char*y0, unsigned char*y1, unsigned char*cb, unsigned char*cr) {
+	const __m128i bias = _mm_setr_epi32(1, 2, 1, 2);
+	size_t x = 0;
+	for(; x+16<=width; x+=16) {
+		__m128i ya[2], ba[2], ra[2], yb[2], bb[2], rb[2];
+		yccPixelsSSSE3(r0 + x*3, ya, ba, ra);
+		yccPixelsSSSE3(r1 + x*3, yb, bb, rb);
+		_mm_storeu_si128((__m128i*)(y0 + x), _mm_packus_epi16(ya[0], ya[1]));
+		_mm_storeu_si128((__m128i*)(y1 + x), _mm_packus_epi16(yb[0], yb[1]));
+		__m128i b = yccDownSSE2(ba[0], ba[1], bb[0], bb[1], bias);
+		__m128i r = yccDownSSE2(ra[0], ra[1], rb[0], rb[1], bias);
+		_mm_storel_epi64((__m128i*)(cb + x/2), _mm_packus_epi16(b, b));
+		_mm_storel_epi64((__m128i*)(cr + x/2), _mm_packus_epi16(r, r));
+	}
+	yccRowsFrom(r0, r1, width, cw, y0, y1, cb, cr, x);
+}
+
+// the SSSE3 steps on two 16 pixel groups at once, one per 128 bit lane (every AVX2 op used stays in its lane)
+__attribute__((target("avx2")))
+static inline __m256i yccTermAVX2(__m256i p, __m256i q, __m256i s, __m256i t, __m256i cpq, __m256i cst, __m256i add) {
+	__m256i lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(p, q), cpq), _mm256_madd_epi16(_mm256_unpacklo_epi16(s, t), cst));
+	__m256i hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(p, q), cpq), _mm256_madd_epi16(_mm256_unpackhi_epi16(s, t), cst));
+	return _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(lo, add), 16), _mm256_srai_epi32(_mm256_add_epi32(hi, add), 16));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i yccDownAVX2(__m256i a0, __m256i a1, __m256i b0, __m256i b1, __m256i bias) {
+	const __m256i one = _mm256_set1_epi16(1);
+	__m256i lo = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(a0, one), _mm256_madd_epi16(b0, one)), bias);
+	__m256i hi = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(a1, one), _mm256_madd_epi16(b1, one)), bias);
+	return _mm256_packs_epi32(_mm256_srli_epi32(lo, 2), _mm256_srli_epi32(hi, 2));
+}
+
+// 32 pixels at p, lane 0: pixels 0..15, lane 1: pixels 16..31
+__attribute__((target("avx2")))
+static inline void yccPixelsAVX2(const unsigned char*p, __m256i y[2], __m256i cb[2], __m256i cr[2]) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i in[3], c[3];
+	for(int k=0; k<3; ++k)
+		in[k] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(p + 16*k))),
+			_mm_loadu_si128((const __m128i*)(p + 48 + 16*k)), 1);
+	for(int k=0; k<3; ++k)
+		c[k] = _mm256_or_si256(_mm256_or_si256(
+			_mm256_shuffle_epi8(in[0], _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ycc_deinterleave[k][0]))),
+			_mm256_shuffle_epi8(in[1], _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ycc_deinterleave[k][1])))),
+			_mm256_shuffle_epi8(in[2], _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ycc_deinterleave[k][2]))));
+	const __m256i yadd = _mm256_set1_epi32(ycc_one_half), cadd = _mm256_set1_epi32(ycc_cbcr_offset + ycc_one_half - 1);
+	for(int h=0; h<2; ++h) {
+		__m256i r = h ? _mm256_unpackhi_epi8(c[0], zero) : _mm256_unpacklo_epi8(c[0], zero);
+		__m256i g = h ? _mm256_unpackhi_epi8(c[1], zero) : _mm256_unpacklo_epi8(c[1], zero);
+		__m256i b = h ? _mm256_unpackhi_epi8(c[2], zero) : _mm256_unpacklo_epi8(c[2], zero);
+		y[h] = yccTermAVX2(r, g, b, g, _mm256_set1_epi32(ycc_y_rg), _mm256_set1_epi32(ycc_y_bg), yadd);
+		cb[h] = yccTermAVX2(r, g, b, b, _mm256_set1_epi32(ycc_cb_rg), _mm256_set1_epi32(ycc_cb_bb), cadd);
+		cr[h] = yccTermAVX2(r, r, g, b, _mm256_set1_epi32(ycc_cr_rr), _mm256_set1_epi32(ycc_cr_gb), cadd);
+	}
+}
+
+__attribute__((target("avx2")))
+static void yccRowsAVX2(const unsigned char*r0, const unsigned char*r1, size_t width, size_t cw,
+	unsigned char*y0, unsigned char*y1, unsigned char*cb, unsigned char*cr) {
+	const __m256i bias = _mm256_setr_epi32(1, 2, 1, 2, 1, 2, 1, 2);
+	size_t x = 0;
+	for(; x+32<=width; x+=32) {
+		__m256i ya[2], ba[2], ra[2], yb[2], bb[2], rb[2];
+		yccPixelsAVX2(r0 + x*3, ya, ba, ra);
+		yccPixelsAVX2(r1 + x*3, yb, bb, rb);
+		_mm256_storeu_si256((__m256i*)(y0 + x), _mm256_packus_epi16(ya[0], ya[1]));
+		_mm256_storeu_si256((__m256i*)(y1 + x), _mm256_packus_epi16(yb[0], yb[1]));
+		// 8 chroma bytes at the bottom of each lane, the permute puts them next to each other
+		__m256i b = yccDownAVX2(ba[0], ba[1], bb[0], bb[1], bias);
+		__m256i r = yccDownAVX2(ra[0], ra[1], rb[0], rb[1], bias);
+		_mm_storeu_si128((__m128i*)(cb + x/2), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(b, b), 0x08)));
+		_mm_storeu_si128((__m128i*)(cr + x/2), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(r, r), 0x08)));
+	}
+	yccRowsSSSE3(r0 + x*3, r1 + x*3, width - x, cw - x/2, y0 + x, y1 + x, cb + x/2, cr + x/2);
+}
+#endif
+
+static YCCRowsFn yccRowsImpl(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return yccRowsAVX2;
+	if(__builtin_cpu_supports("ssse3")) return yccRowsSSSE3;
+#endif
+	return yccRowsScalar;
+}
+
+static ReturnCode yccplanes_init(YCCPlanes*pl, unsigned long long width) {
+	pl->cw = (size_t)((width + 2*DCTSIZE - 1) / (2*DCTSIZE)) * DCTSIZE; // width_in_blocks * DCTSIZE of Cb and Cr
+	pl->convert = yccRowsImpl();
+	pl->buf = (unsigned char*)malloc(pl->cw * 4 * DCTSIZE + pl->cw * 2 * DCTSIZE);
+	if(!pl->buf) return RET_ERR_MEM;
+	for(int i=0; i<2*DCTSIZE; ++i) pl->y[i] = pl->buf + i * 2 * pl->cw;
+	for(int i=0; i<DCTSIZE; ++i) {
+		pl->cb[i] = pl->buf + pl->cw * 4 * DCTSIZE + i * pl->cw;
+		pl->cr[i] = pl->cb[i] + pl->cw * DCTSIZE;
+	}
+	return RET_OK;
+}
+
+static void yccplanes_clear(YCCPlanes*pl) {
+	free(pl->buf);
+	pl->buf = NULL;
+}
+
+// after jpgSetup: planes from jpgWriteRaw instead of RGB scanlines, if the sampling is the default 4:2:0
+static int jpgRawInput(struct jpeg_compress_struct*cinfo) {
+	if(	(cinfo->jpeg_color_space != JCS_YCbCr) || (cinfo->num_components != 3) ||
+		(cinfo->comp_info[0].h_samp_factor != 2) || (cinfo->comp_info[0].v_samp_factor != 2) ||
+		(cinfo->comp_info[1].h_samp_factor != 1) || (cinfo->comp_info[1].v_samp_factor != 1) ||
+		(cinfo->comp_info[2].h_samp_factor != 1) || (cinfo->comp_info[2].v_samp_factor != 1)
+	) return 0;
+	cinfo->raw_data_in = TRUE;
+	return 1;
+}
+
+// every row of the image (image_height of them), one iMCU row (2*DCTSIZE lines) per jpeg_write_raw_data
+// the rows of pl stay as they are, the padding only repoints a copy of the row pointers
+static void jpgWriteRaw(struct jpeg_compress_struct*cinfo, const YCCPlanes*pl, const char*rows, size_t stride) {
+	const unsigned long long width = cinfo->image_width, height = cinfo->image_height;
+	JSAMPROW y[2*DCTSIZE], cb[DCTSIZE], cr[DCTSIZE];
+	memcpy(y, pl->y, sizeof(y));
+	memcpy(cb, pl->cb, sizeof(cb));
+	memcpy(cr, pl->cr, sizeof(cr));
+	JSAMPARRAY planes[3] = { y, cb, cr };
+	for(unsigned long long top=0; top<height; top+=2*DCTSIZE) {
+		for(int i=0; i<DCTSIZE; ++i) {
+			const unsigned long long r = top + 2*i;
+			if(r >= height) { // below the image: the last rows again, this is the last iMCU row
+				y[2*i] = y[2*i+1] = y[2*i-1];
+				cb[i] = cb[i-1];
+				cr[i] = cr[i-1];
+				continue;
+			}
+			const unsigned char*r0 = (const unsigned char*)rows + r * stride;
+			const unsigned char*r1 = (r+1 < height) ? r0 + stride : r0;
+			pl->convert(r0, r1, width, pl->cw, y[2*i], y[2*i+1], cb[i], cr[i]);
+		}
+		jpeg_write_raw_data(cinfo, planes, 2*DCTSIZE);
+	}
+}
+
+// libjpeg destination writing into an OutBuffer, grows it by doubling
+typedef struct T_JPGMemDest {
+	struct jpeg_destination_mgr pub;
+	OutBuffer*out;
+	size_t expected;
+} JPGMemDest;
+
+static void jpgMemInit(j_compress_ptr cinfo) {
+	JPGMemDest*d = (JPGMemDest*)cinfo->dest;
+	if(outbuffer_reserve(d->out, d->out->len + d->expected) != RET_OK) ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+	d->pub.next_output_byte = d->out->data + d->out->len;
+	d->pub.free_in_buffer = d->out->cap - d->out->len;
+}
+
+static boolean jpgMemEmpty(j_compress_ptr cinfo) {
+	JPGMemDest*d = (JPGMemDest*)cinfo->dest;
+	d->out->len = d->out->cap; // libjpeg only calls this with a full buffer
+	if(outbuffer_reserve(d->out, d->out->cap * 2) != RET_OK) ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 1);
+	d->pub.next_output_byte = d->out->data + d->out->len;
+	d->pub.free_in_buffer = d->out->cap - d->out->len;
+	return TRUE;
+}
+
+static void jpgMemTerm(j_compress_ptr cinfo) {
+	JPGMemDest*d = (JPGMemDest*)cinfo->dest;
+	d->out->len = d->out->cap - d->pub.free_in_buffer;
+}
+
+// one compressor per thread, kept between images: creating one sets up its memory pools every time
+typedef struct T_JPGCompressor {
+	struct jpeg_compress_struct cinfo; // first, jpgRelease casts back
+	struct jpeg_error_mgr jerr;
+	jmp_buf jump; // where the encoder using the object handles libjpeg errors, see jpgCatch
+	int busy;
+} JPGCompressor;
+
+// libjpeg's default error_exit calls exit(), that would take the whole batch, daemon or libcaff host with it
+static void jpgErrorExit(j_common_ptr cinfo) {
+	char msg[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, msg);
+	logError("libjpeg: %s\n", msg);
+	longjmp(((JPGCompressor*)cinfo)->jump, 1);
+}
+
+// nonzero when a libjpeg call of the encoder failed, the encoder then cleans up and returns jpgFail
+#define jpgCatch(cinfo) setjmp(((JPGCompressor*)(cinfo))->jump)
+
+static pthread_key_t jpg_tls_key;
+static pthread_once_t jpg_tls_once = PTHREAD_ONCE_INIT;
+
+static void jpgCompressorFree(void*p) {
+	JPGCompressor*c = (JPGCompressor*)p;
+	jpeg_destroy_compress(&c->cinfo);
+	free(c);
+}
+
+static void jpgTlsInit(void) {
+	pthread_key_create(&jpg_tls_key, jpgCompressorFree);
+}
+
+// the thread's compressor, or a private one while that is in use; jpgCatch it before the first libjpeg call
+struct jpeg_compress_struct* jpgAcquire(void) {
+	pthread_once(&jpg_tls_once, jpgTlsInit);
+	JPGCompressor*c = (JPGCompressor*)pthread_getspecific(jpg_tls_key);
+	if(c && !c->busy) {
+		c->busy = 1;
+		return &c->cinfo;
+	}
+	JPGCompressor*n = (JPGCompressor*)malloc(sizeof(JPGCompressor));
+	if(!n) return NULL;
+	n->cinfo.err = jpeg_std_error(&n->jerr);
+	n->jerr.error_exit = jpgErrorExit;
+	if(setjmp(n->jump)) { // only its own memory can fail
+		jpgCompressorFree(n);
+		return NULL;
+	}
+	jpeg_create_compress(&n->cinfo);
+	n->busy = 1;
+	if(!c) pthread_setspecific(jpg_tls_key, n);
+	return &n->cinfo;
+}
+
+void jpgRelease(struct jpeg_compress_struct*cinfo) {
+	JPGCompressor*c = (JPGCompressor*)cinfo;
+	const int mine = (c == (JPGCompressor*)pthread_getspecific(jpg_tls_key));
+	// optimized Huffman tables are written back into the object and jpeg_set_defaults keeps them
+	if(cinfo->optimize_coding || cinfo->progressive_mode) {
+		if(mine) pthread_setspecific(jpg_tls_key, NULL);
+		jpgCompressorFree(c);
+		return;
+	}
+	jpeg_abort_compress(cinfo); // back to idle, the permanent pool (destination manager) stays
+	if(mine) c->busy = 0;
+	else jpgCompressorFree(c);
+}
+
+// after an error the object is in the middle of something: it's destroyed, the thread gets a new one next time
+ReturnCode jpgFail(struct jpeg_compress_struct*cinfo) {
+	JPGCompressor*c = (JPGCompressor*)cinfo;
+	ReturnCode ret = (c->jerr.msg_code == JERR_OUT_OF_MEMORY) ? RET_ERR_MEM : RET_ERR_CHK;
+	if(c == (JPGCompressor*)pthread_getspecific(jpg_tls_key)) pthread_setspecific(jpg_tls_key, NULL);
+	jpgCompressorFree(c);
+	return ret;
+}
+
+// appends to out, expected: initial size so that most images never need to grow the buffer
+void jpgMemDest(struct jpeg_compress_struct*cinfo, OutBuffer*out, size_t expected) {
+	if(!cinfo->dest)
+		cinfo->dest = (struct jpeg_destination_mgr*)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT, sizeof(JPGMemDest));
+	JPGMemDest*d = (JPGMemDest*)cinfo->dest;
+	d->pub.init_destination = jpgMemInit;
+	d->pub.empty_output_buffer = jpgMemEmpty;
+	d->pub.term_destination = jpgMemTerm;
+	d->out = out;
+	d->expected = expected;
+}
+
+// about 1/8 of the raw RGB size, more than what quality 90 usually gives
+size_t jpgExpectedSize(unsigned long long width, unsigned long long height) {
+	return (size_t)(width * height * 3 / 8) + 4096;
+}
+
+ReturnCode outbuffer_reserve(OutBuffer*out, size_t cap) {
+	if(cap <= out->cap) return RET_OK;
+	unsigned char*nd = (unsigned char*)realloc(out->data, cap);
+	if(!nd) return RET_ERR_MEM;
+	statsCount(STAT_HEAP_ALLOCS, 1);
+	out->data = nd;
+	out->cap = cap;
+	return RET_OK;
+}
+
+// grows by doubling, for writers that deliver many small pieces
+ReturnCode outbuffer_append(OutBuffer*out, const void*data, size_t len) {
+	if(out->len + len > out->cap) {
+		size_t ncap = out->cap ? out->cap*2 : 4096;
+		while(ncap < out->len + len) ncap *= 2;
+		if(outbuffer_reserve(out, ncap) != RET_OK) return RET_ERR_MEM;
+	}
+	memcpy(out->data + out->len, data, len);
+	out->len += len;
+	return RET_OK;
+}
+
+void outbuffer_clear(OutBuffer*out) {
+	if(!out) return;
+	if(out->data) {
+		free(out->data);
+		out->data = NULL;
+	}
+	out->len = 0;
+	out->cap = 0;
+}
+
+void outbuffer_init(OutBuffer*out) {
+	if(!out) return;
+	out->data = NULL;
+	out->len = 0;
+	out->cap = 0;
+}
+
+void arena_init(Arena*a) {
+	if(!a) return;
+	a->head = NULL;
+	pthread_mutex_init(&a->lock, NULL);
+}
+
+// every chunk goes, the arena can be used again
+void arena_clear(Arena*a) {
+	if(!a) return;
+	ArenaChunk*c = a->head;
+	while(c) {
+		ArenaChunk*next = c->next;
+		free(c);
+		c = next;
+	}
+	a->head = NULL;
+}
+
+// releases everything allocated so far but keeps the newest (largest) chunk for the next file
+// not thread safe, nothing may allocate during the reset
+void arena_reset(Arena*a) {
+	if(!a || !a->head) return;
+	ArenaChunk*c = a->head->next;
+	while(c) {
+		ArenaChunk*next = c->next;
+		free(c);
+		c = next;
+	}
+	a->head->next = NULL;
+	a->head->used = 0;
+}
+
+// the next size bytes fit into the current chunk, a new chunk is started if they don't
+ReturnCode arena_reserve(Arena*a, size_t size) {
+	ReturnCode ret = RET_OK;
+	pthread_mutex_lock(&a->lock);
+	ArenaChunk*c = a->head;
+	size_t used = c ? __atomic_load_n(&c->used, __ATOMIC_RELAXED) : 0;
+	if(!c || (used > c->cap) || (size > c->cap - used)) {
+		size_t cap = c ? c->cap*2 : arena_chunk_min;
+		if(cap < size) cap = size;
+		ArenaChunk*n = (cap <= SIZE_MAX - arena_chunk_data) ? (ArenaChunk*)malloc(arena_chunk_data + cap) : NULL;
+		if(n) {
+			statsCount(STAT_HEAP_ALLOCS, 1);
+			n->next = c;
+			n->cap = cap;
+			n->used = 0;
+			__atomic_store_n(&a->head, n, __ATOMIC_RELEASE);
+		}
+		else ret = RET_ERR_MEM;
+	}
+	pthread_mutex_unlock(&a->lock);
+	return ret;
+}
+
+// arena_align aligned, uninitialized
+void* arena_alloc(Arena*a, size_t size) {
+	if(size > SIZE_MAX - arena_chunk_data - arena_align) return NULL;
+	size = (size + arena_align - 1) & ~(size_t)(arena_align - 1);
+	for(;;) {
+		ArenaChunk*c = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+		if(c && (size <= c->cap)) { // keeps used from wrapping around
+			size_t off = __atomic_fetch_add(&c->used, size, __ATOMIC_RELAXED);
+			if((off <= c->cap) && (size <= c->cap - off)) {
+				statsCount(STAT_ARENA_ALLOCS, 1);
+				return (char*)c + arena_chunk_data + off;
+			}
+		}
+		if(arena_reserve(a, size) != RET_OK) return NULL; // no-op if another thread already started a new chunk
+	}
+}
+
+void* arena_calloc(Arena*a, size_t n, size_t size) {
+	if(size && (n > SIZE_MAX / size)) return NULL;
+	void*p = arena_alloc(a, n*size);
+	if(p) memset(p, 0, n*size);
+	return p;
+}
+
+// the whole file with as few write calls as the kernel allows, "-" is stdout
+ReturnCode writeOutput(const char* const fn, const unsigned char*data, size_t len) {
+	int tostdout = (strcmp(fn, "-") == 0);
+	struct stat st;
+	if(!tostdout && (lstat(fn, &st) == 0) && S_ISREG(st.st_mode) && (st.st_nlink > 1))
+		unlink(fn); // probably linked from the cache, truncating it would change the entry
+	int fd = tostdout ? STDOUT_FILENO : open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) return RET_ERR_IO;
+	ReturnCode ret = RET_OK;
+	unsigned long long t = statsBegin();
+	if(tostdout) pthread_mutex_lock(&out_lock);
+	for(size_t off = 0; off < len; ) {
+		ssize_t w = write(fd, data + off, len - off);
+		if(w < 0) {
+			ret = RET_ERR_IO;
+			break;
+		}
+		off += (size_t)w;
+	}
+	if(tostdout) pthread_mutex_unlock(&out_lock);
+	else if(close(fd) != 0) ret = RET_ERR_IO;
+	statsEnd(STAGE_WRITE, t);
+	return ret;
+}
+
+static const PreviewEncoder previewEncoders[] = {
+	{ FORMAT_JPG, "jpg", ".jpg", ".avi", encodeJPG, muxAVI }, // MJPEG
+	{ FORMAT_WEBP, "webp", ".webp", ".webp", encodeWebP, muxWebP }
+};
+
+const PreviewEncoder* previewEncoder(OutputFormat format) {
+	for(size_t i=0; i<sizeof(previewEncoders)/sizeof(previewEncoders[0]); ++i)
+		if(previewEncoders[i].format == format) return &previewEncoders[i];
+	return &previewEncoders[0];
+}
+
+ReturnCode encodePreview(const CIFF* const ciff, const EncodeOptions*enc, const char*label, OutBuffer*out) {
+	if(!ciff) return RET_ERR_CHK;
+	logInfo("write to %s (%llux%llu)\n", label, ciff->width, ciff->height);
+	unsigned long long t = statsBegin();
+	ReturnCode ret = previewEncoder(enc ? enc->format : FORMAT_JPG)->encode(ciff, enc, out);
+	statsEnd(STAGE_ENCODE, t);
+	return ret;
+}
+
+ReturnCode toPreview(const CIFF* const ciff, const char* const fn, const EncodeOptions*enc, const char*cachepath) {
+	OutBuffer out;
+	outbuffer_init(&out);
+	ReturnCode ret = encodePreview(ciff, enc, fn, &out);
+	if(ret == RET_OK) statsCount(STAT_BYTES_OUT, out.len);
+	if(ret == RET_OK) ret = writeOutput(fn, out.data, out.len);
+	if(ret == RET_OK) cacheStore(cachepath, out.data, out.len);
+	outbuffer_clear(&out);
+	return ret;
+}
+
+// the preview of ciff, appended to out
+ReturnCode encodeJPG(const CIFF* const ciff, const EncodeOptions*enc, OutBuffer*out) {
+	if(!ciff) return RET_ERR_CHK;
+	if( (ciff->width <= 0) || (ciff->height <= 0)) return RET_ERR_CHK;
+	unsigned int factor = scaleFactor(ciff, enc);
+	if(factor > 1) return encodeJPGScaled(ciff, factor, enc, out);
+	if( (ciff->width > 65500) || (ciff->height > 65500)) {
+		logError("jpeg library constraint violated: \n\tMaximum supported image dimension is 65500 pixels\n\t%llu x %llu\n", ciff->width, ciff->height);
+		return RET_ERR_CHK;
+	}
+	// strips can only be joined if they share the Huffman tables and there is a single scan
+	if(g_pool && (g_pool->nthreads > 1) && (ciff->height >= 2*jpg_strip_min_rows) &&
+		(!enc || (enc->profile != JPG_PROFILE_SMALL)))
+		return encodeJPGStrips(ciff, g_pool, enc, out);
+	//https://github.com/LuaDist/libjpeg/blob/master/example.c
+	YCCPlanes planes;
+	if(yccplanes_init(&planes, ciff->width) != RET_OK) return RET_ERR_MEM;
+	struct jpeg_compress_struct*cinfo = jpgAcquire();
+	if(!cinfo) {
+		yccplanes_clear(&planes);
+		return RET_ERR_MEM;
+	}
+	const size_t start = out->len;
+	if(jpgCatch(cinfo)) {
+		out->len = start; // no half written image
+		yccplanes_clear(&planes);
+		return jpgFail(cinfo);
+	}
+	jpgMemDest(cinfo, out, jpgExpectedSize(ciff->width, ciff->height));
+	jpgSetup(cinfo, ciff->width, ciff->height, enc);
+	const int raw = jpgRawInput(cinfo);
+	jpeg_start_compress(cinfo, TRUE);
+	if(raw) jpgWriteRaw(cinfo, &planes, ciff->imgbuf, ciff->width * 3);
+	else jpgWriteRows(cinfo, ciff->imgbuf, ciff->width * 3, ciff->height);
+	jpeg_finish_compress(cinfo);
+	jpgRelease(cinfo);
+	yccplanes_clear(&planes);
+
+	return  RET_OK;
+}
+
+// box filter factor for the preview, 1 if the frame is encoded as it is
+unsigned int scaleFactor(const CIFF* const ciff, const EncodeOptions*enc) {
+	unsigned long long f = 1;
+	if(!enc) return 1;
+	if(enc->scale > 1) f = enc->scale;
+	if(enc->maxDim > 0) {
+		unsigned long long d = (ciff->width > ciff->height) ? ciff->width : ciff->height;
+		unsigned long long need = (d + enc->maxDim - 1) / enc->maxDim;
+		if(need > f) f = need;
+	}
+	if(f > UINT_MAX) f = UINT_MAX;
+	return (unsigned int)f;
+}
+
+// dimensions of the encoded preview, the same clamping as the scaled encoders
+void previewSize(const CIFF* const ciff, const EncodeOptions*enc, unsigned long long*width, unsigned long long*height) {
+	unsigned long long factor = scaleFactor(ciff, enc);
+	unsigned long long d = (ciff->width > ciff->height) ? ciff->width : ciff->height;
+	if(factor > d) factor = d;
+	if(factor < 1) factor = 1;
+	*width = (ciff->width + factor - 1) / factor;
+	*height = (ciff->height + factor - 1) / factor;
+}
+
+// produces the reduced image one row at a time, from factor x factor input boxes (smaller at the edges)
+typedef struct T_Downscaler {
+	const CIFF*ciff;
+	unsigned int factor;
+	unsigned long long out_w;
+	unsigned long long out_h;
+	unsigned int*acc;   // column sums of the current band, width*3
+	unsigned char*rows; // batch_rows reduced rows, out_w*3 each
+	unsigned long long batch_rows;
+} Downscaler;
+
+typedef void (*AccumulateRowFn)(unsigned int*acc, const unsigned char*src, size_t n);
+
+static void accumulateRowScalar(unsigned int*acc, const unsigned char*src, size_t n) {
+	for(size_t i=0; i<n; ++i) acc[i] += src[i];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void accumulateRowSSE2(unsigned int*acc, const unsigned char*src, size_t n) {
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for(; i+16<=n; i+=16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		__m128i*a = (__m128i*)(acc+i);
+		_mm_storeu_si128(a+0, _mm_add_epi32(_mm_loadu_si128(a+0), _mm_unpacklo_epi16(lo, zero)));
+		_mm_storeu_si128(a+1, _mm_add_epi32(_mm_loadu_si128(a+1), _mm_unpackhi_epi16(lo, zero)));
+		_mm_storeu_si128(a+2, _mm_add_epi32(_mm_loadu_si128(a+2), _mm_unpacklo_epi16(hi, zero)));
+		_mm_storeu_si128(a+3, _mm_add_epi32(_mm_loadu_si128(a+3), _mm_unpackhi_epi16(hi, zero)));
+	}
+	accumulateRowScalar(acc+i, src+i, n-i);
+}
+
+__attribute__((target("avx2")))
+static void accumulateRowAVX2(unsigned int*acc, const unsigned char*src, size_t n) {
+	size_t i = 0;
+	for(; i+16<=n; i+=16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+		__m256i*a = (__m256i*)(acc+i);
+		_mm256_storeu_si256(a+0, _mm256_add_epi32(_mm256_loadu_si256(a+0), _mm256_cvtepu8_epi32(v)));
+		_mm256_storeu_si256(a+1, _mm256_add_epi32(_mm256_loadu_si256(a+1), _mm256_cvtepu8_epi32(_mm_srli_si128(v, 8))));
+	}
+	accumulateRowScalar(acc+i, src+i, n-i);
+}
+#endif
+
+static AccumulateRowFn accumulateRowImpl(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return accumulateRowAVX2;
+	if(__builtin_cpu_supports("sse2")) return accumulateRowSSE2;
+#endif
+	return accumulateRowScalar;
+}
+
+static ReturnCode downscaler_init(Downscaler*ds, const CIFF*ciff, unsigned int factor) {
+	ds->ciff = ciff;
+	ds->factor = factor;
+	ds->out_w = (ciff->width + factor - 1) / factor;
+	ds->out_h = (ciff->height + factor - 1) / factor;
+	ds->batch_rows = jpg_scaled_batch_bytes / (ds->out_w * 3);
+	if(ds->batch_rows > jpg_row_batch) ds->batch_rows = jpg_row_batch;
+	if(ds->batch_rows < 1) ds->batch_rows = 1;
+	ds->acc = (unsigned int*)malloc(ciff->width * 3 * sizeof(unsigned int));
+	ds->rows = (unsigned char*)malloc(ds->batch_rows * ds->out_w * 3);
+	if(!ds->acc || !ds->rows) {
+		free(ds->acc);
+		free(ds->rows);
+		ds->acc = NULL;
+		ds->rows = NULL;
+		return RET_ERR_MEM;
+	}
+	return RET_OK;
+}
+
+static void downscaler_clear(Downscaler*ds) {
+	free(ds->acc);
+	free(ds->rows);
+	ds->acc = NULL;
+	ds->rows = NULL;
+}
+
+// output row y into dst: vertical sums with the vector kernel, then box sums across and the average
+static void downscaler_row(Downscaler*ds, unsigned long long y, AccumulateRowFn accumulate, unsigned char*dst) {
+	const CIFF*ciff = ds->ciff;
+	const size_t stride = ciff->width * 3;
+	unsigned long long r0 = y * ds->factor;
+	unsigned long long r1 = r0 + ds->factor;
+	if(r1 > ciff->height) r1 = ciff->height;
+	memset(ds->acc, 0, stride * sizeof(unsigned int));
+	for(unsigned long long r=r0; r<r1; ++r)
+		accumulate(ds->acc, (const unsigned char*)ciff->imgbuf + r * stride, stride);
+	for(unsigned long long x=0; x<ds->out_w; ++x) {
+		unsigned long long c0 = x * ds->factor;
+		unsigned long long c1 = c0 + ds->factor;
+		if(c1 > ciff->width) c1 = ciff->width;
+		unsigned long long n = (r1 - r0) * (c1 - c0);
+		unsigned long long sum[3] = { 0, 0, 0 };
+		for(unsigned long long c=c0; c<c1; ++c) {
+			sum[0] += ds->acc[c*3+0];
+			sum[1] += ds->acc[c*3+1];
+			sum[2] += ds->acc[c*3+2];
+		}
+		for(int k=0; k<3; ++k) dst[x*3+k] = (unsigned char)((sum[k] + n/2) / n);
+	}
+}
+
+// the reduced rows go straight into the compressor, no reduced copy of the whole image is made
+ReturnCode encodeJPGScaled(const CIFF* const ciff, unsigned int factor, const EncodeOptions*enc, OutBuffer*out) {
+	unsigned long long d = (ciff->width > ciff->height) ? ciff->width : ciff->height;
+	if(factor > d) factor = (unsigned int)d; // 1x1 at most
+	if(factor > 65535u) return RET_ERR_RES_CONSTRAINT; // unsigned int column sums
+	Downscaler ds;
+	ReturnCode ret = downscaler_init(&ds, ciff, factor);
+	if(ret != RET_OK) return ret;
+	logDebug("scale 1/%u: %llux%llu\n", factor, ds.out_w, ds.out_h);
+	if( (ds.out_w > 65500) || (ds.out_h > 65500)) {
+		logError("jpeg library constraint violated: \n\tMaximum supported image dimension is 65500 pixels\n\t%llu x %llu\n", ds.out_w, ds.out_h);
+		downscaler_clear(&ds);
+		return RET_ERR_CHK;
+	}
+	AccumulateRowFn accumulate = accumulateRowImpl();
+	struct jpeg_compress_struct*cinfo = jpgAcquire();
+	if(!cinfo) {
+		downscaler_clear(&ds);
+		return RET_ERR_MEM;
+	}
+	const size_t start = out->len;
+	if(jpgCatch(cinfo)) {
+		out->len = start;
+		downscaler_clear(&ds);
+		return jpgFail(cinfo);
+	}
+	jpgMemDest(cinfo, out, jpgExpectedSize(ds.out_w, ds.out_h));
+	jpgSetup(cinfo, ds.out_w, ds.out_h, enc);
+	jpeg_start_compress(cinfo, TRUE);
+	while (cinfo->next_scanline < cinfo->image_height) {
+		unsigned long long n = cinfo->image_height - cinfo->next_scanline;
+		if(n > ds.batch_rows) n = ds.batch_rows;
+		for(unsigned long long i=0; i<n; ++i)
+			downscaler_row(&ds, cinfo->next_scanline + i, accumulate, ds.rows + i * ds.out_w * 3);
+		jpgWriteRows(cinfo, (const char*)ds.rows, ds.out_w * 3, n);
+	}
+	jpeg_finish_compress(cinfo);
+	jpgRelease(cinfo);
+	downscaler_clear(&ds);
+	return RET_OK;
+}
+
+#ifdef HAVE_WEBP
+static int webpWrite(const uint8_t*data, size_t size, const WebPPicture*pic) {
+	return outbuffer_append((OutBuffer*)pic->custom_ptr, data, size) == RET_OK;
+}
+#endif
+
+// WebP imports straight from imgbuf (or from the reduced image when scaling)
+ReturnCode encodeWebP(const CIFF* const ciff, const EncodeOptions*enc, OutBuffer*out) {
+#ifdef HAVE_WEBP
+	if(!ciff) return RET_ERR_CHK;
+	if( (ciff->width <= 0) || (ciff->height <= 0)) return RET_ERR_CHK;
+	unsigned int factor = scaleFactor(ciff, enc);
+	unsigned long long d = (ciff->width > ciff->height) ? ciff->width : ciff->height;
+	if(factor > d) factor = (unsigned int)d;
+	if(factor > 65535u) return RET_ERR_RES_CONSTRAINT;
+	unsigned long long w = (ciff->width + factor - 1) / factor;
+	unsigned long long h = (ciff->height + factor - 1) / factor;
+	if( (w > WEBP_MAX_DIMENSION) || (h > WEBP_MAX_DIMENSION)) {
+		logError("webp library constraint violated: \n\tMaximum supported image dimension is %d pixels\n\t%llu x %llu\n", WEBP_MAX_DIMENSION, w, h);
+		return RET_ERR_CHK;
+	}
+	WebPConfig config;
+	if(!WebPConfigInit(&config)) return RET_ERR_CHK; // header/library version mismatch
+	config.lossless = enc ? enc->lossless : 0;
+	config.quality = (float)((enc && (enc->quality > 0)) ? enc->quality : jpg_quality);
+	config.method = (enc && (enc->effort >= 0) && (enc->effort <= 6)) ? enc->effort : webp_effort;
+	if(!WebPValidateConfig(&config)) return RET_ERR_CHK;
+
+	const char*rgb = ciff->imgbuf;
+	char*reduced = NULL;
+	if(factor > 1) { // only the preview sized image is materialized
+		Downscaler ds;
+		ReturnCode ret = downscaler_init(&ds, ciff, factor);
+		if(ret != RET_OK) return ret;
+		reduced = (char*)malloc(w * h * 3);
+		if(!reduced) {
+			downscaler_clear(&ds);
+			return RET_ERR_MEM;
+		}
+		AccumulateRowFn accumulate = accumulateRowImpl();
+		for(unsigned long long y=0; y<h; ++y) downscaler_row(&ds, y, accumulate, (unsigned char*)reduced + y * w * 3);
+		downscaler_clear(&ds);
+		rgb = reduced;
+	}
+	WebPPicture pic;
+	if(!WebPPictureInit(&pic)) {
+		free(reduced);
+		return RET_ERR_CHK;
+	}
+	pic.use_argb = config.lossless; // lossless works on ARGB, lossy on YUV
+	pic.width = (int)w;
+	pic.height = (int)h;
+	ReturnCode ret = RET_OK;
+	if(!WebPPictureImportRGB(&pic, (const uint8_t*)rgb, (int)(w * 3))) ret = RET_ERR_MEM;
+	free(reduced); // the picture has its own copy in the encoder's layout
+	if(ret == RET_OK) {
+		pic.writer = webpWrite;
+		pic.custom_ptr = out;
+		if(!WebPEncode(&config, &pic))
+			ret = (pic.error_code == VP8_ENC_ERROR_OUT_OF_MEMORY || pic.error_code == VP8_ENC_ERROR_BITSTREAM_OUT_OF_MEMORY) ? RET_ERR_MEM : RET_ERR_CHK;
+	}
+	WebPPictureFree(&pic);
+	return ret;
+#else
+	(void)ciff;
+	(void)enc;
+	(void)out;
+	logError("webp support is not compiled in (make WEBP=1)\n");
+	return RET_ERR_CHK;
+#endif
+}
+
+// preview cache: <dir>/<128 bit key><ext>, the key covers the input bytes and every setting that changes the output
+static void cacheKeyString(const InputBuffer*in, FileType ft, const EncodeOptions*enc, char key[33]) {
+	char settings[256];
+	snprintf(settings, sizeof(settings), "v%d t%d f%d l%d e%d a%d s%u m%llu p%d q%d",
+		cache_version, (int)ft, (int)enc->format, enc->lossless, enc->effort, enc->animate,
+		enc->scale, enc->maxDim, (int)enc->profile, enc->quality);
+	const unsigned long long seed = xxh64(settings, strlen(settings), 0);
+	snprintf(key, 33, "%016llx%016llx", xxh64(in->data, in->len, seed), xxh64(in->data, in->len, ~seed));
+}
+
+// NULL if there is no cache, otherwise malloc'ed
+char* cachePath(const InputBuffer*in, FileType ft, const EncodeOptions*enc, const char*ext) {
+	if(!g_cache.dir || !enc) return NULL;
+	char key[33];
+	cacheKeyString(in, ft, enc, key);
+	size_t n = strlen(g_cache.dir) + 1 + 32 + strlen(ext) + 1;
+	char*path = (char*)malloc(n);
+	if(path) snprintf(path, n, "%s/%s%s", g_cache.dir, key, ext);
+	return path;
+}
+
+// a unique name next to fn for temp+rename
+static void cacheTempName(char*dst, size_t n, const char*fn) {
+	static unsigned long seq = 0;
+	snprintf(dst, n, "%s.%ld.%lu.tmp", fn, (long)getpid(), __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED));
+}
+
+// hit: the entry is hard linked to fn (copied if it can't be linked, streamed for "-"), parse and encode are skipped
+ReturnCode cacheFetch(const char*path, const char* const fn) {
+	struct stat st;
+	if((stat(path, &st) != 0) || !S_ISREG(st.st_mode)) return RET_ERR_IO;
+	utimensat(AT_FDCWD, path, NULL, 0); // mtime is the LRU clock
+	if(strcmp(fn, "-")) {
+		const size_t n = strlen(fn) + 48;
+		char*tmp = (char*)malloc(n);
+		if(!tmp) return RET_ERR_MEM;
+		cacheTempName(tmp, n, fn);
+		int linked = (link(path, tmp) == 0) && (rename(tmp, fn) == 0);
+		if(!linked) unlink(tmp);
+		free(tmp);
+		if(linked) return RET_OK;
+	}
+	InputBuffer in;
+	ReturnCode ret = inputbuffer_open(path, &in, 0);
+	if(ret != RET_OK) return ret;
+	ret = writeOutput(fn, (const unsigned char*)in.data, in.len);
+	inputbuffer_clear(&in);
+	return ret;
+}
+
+typedef struct T_CacheEntry {
+	char*name;
+	unsigned long long size;
+	struct timespec mtime;
+} CacheEntry;
+
+static int cacheEntryOlder(const void*a, const void*b) {
+	const CacheEntry*x = (const CacheEntry*)a;
+	const CacheEntry*y = (const CacheEntry*)b;
+	if(x->mtime.tv_sec != y->mtime.tv_sec) return (x->mtime.tv_sec < y->mtime.tv_sec) ? -1 : 1;
+	if(x->mtime.tv_nsec != y->mtime.tv_nsec) return (x->mtime.tv_nsec < y->mtime.tv_nsec) ? -1 : 1;
+	return 0;
+}
+
+// least recently used entries go until the directory is down to the low-water mark, g_cache.lock is held;
+// between two scans cacheStore keeps the total up to date, so a batch doesn't rescan the directory per entry
+static void cacheEvict(void) {
+	DIR*d = opendir(g_cache.dir);
+	if(!d) return;
+	CacheEntry*entries = NULL;
+	size_t cnt = 0, cap = 0;
+	unsigned long long total = 0;
+	struct dirent*de;
+	while((de = readdir(d)) != NULL) {
+		if(de->d_name[0] == '.') continue; // ., .. and temp files of other writers
+		struct stat st;
+		if((fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) || !S_ISREG(st.st_mode)) continue;
+		if(cnt == cap) {
+			size_t ncap = cap ? cap*2 : 64;
+			CacheEntry*ne = (CacheEntry*)realloc(entries, ncap * sizeof(CacheEntry));
+			if(!ne) break;
+			entries = ne;
+			cap = ncap;
+		}
+		entries[cnt].name = strdup(de->d_name);
+		if(!entries[cnt].name) break;
+		entries[cnt].size = (unsigned long long)st.st_size;
+		entries[cnt].mtime = st.st_mtim;
+		total += entries[cnt].size;
+		cnt += 1;
+	}
+	if(total > g_cache.max) {
+		const unsigned long long target = g_cache.max / 100 * cache_low_water;
+		qsort(entries, cnt, sizeof(CacheEntry), cacheEntryOlder);
+		for(size_t i=0; (i<cnt) && (total > target); ++i)
+			if(unlinkat(dirfd(d), entries[i].name, 0) == 0) total -= entries[i].size;
+	}
+	for(size_t i=0; i<cnt; ++i) free(entries[i].name);
+	free(entries);
+	closedir(d);
+	g_cache.bytes = total;
+	g_cache.scanned = 1;
+}
+
+// best effort: a failed store doesn't fail the preview
+void cacheStore(const char*path, const unsigned char*data, size_t len) {
+	if(!path) return;
+	const size_t n = strlen(g_cache.dir) + 64;
+	char*tmp = (char*)malloc(n);
+	if(!tmp) return;
+	snprintf(tmp, n, "%s/.", g_cache.dir);
+	cacheTempName(tmp + strlen(tmp), n - strlen(tmp), "entry");
+	int stored = (writeOutput(tmp, data, len) == RET_OK);
+	// an entry replaced by the rename (two workers missed on the same key) is already counted: only the
+	// difference is added, sized under the lock so two stores of one key can't both count it in full
+	const int counted = stored && (g_cache.max != 0);
+	unsigned long long replaced = 0;
+	if(counted) {
+		pthread_mutex_lock(&g_cache.lock);
+		struct stat st;
+		if(stat(path, &st) == 0) replaced = (unsigned long long)st.st_size;
+	}
+	stored = stored && (rename(tmp, path) == 0); // readers see the whole entry or none
+	if(stored && counted) {
+		g_cache.bytes = (g_cache.bytes + len > replaced) ? g_cache.bytes + len - replaced : 0;
+		if(!g_cache.scanned || (g_cache.bytes > g_cache.max)) cacheEvict();
+	}
+	if(counted) pthread_mutex_unlock(&g_cache.lock);
+	if(!stored) {
+		unlink(tmp);
+		logError("cache: can't store %s\n", path);
+	}
+	free(tmp);
+}
+
+// one horizontal band of the image, compressed on its own as a complete JPEG
+typedef struct T_JPGStrip {
+	const CIFF*ciff;
+	const EncodeOptions*enc;
+	unsigned long long row0;
+	unsigned long long rows;
+	OutBuffer out;
+	ReturnCode ret;
+} JPGStrip;
+
+// restart after every MCU row: every strip boundary is a restart boundary and the stitched
+// stream is the same as the one a single compressor with restart_in_rows = 1 would produce
+static void jpgStripSetup(struct jpeg_compress_struct*cinfo, unsigned long long width, unsigned long long height, const EncodeOptions*enc) {
+	jpgSetup(cinfo, width, height, enc);
+	cinfo->restart_in_rows = 1;
+}
+
+static void jpgStripEncode(void*arg) {
+	JPGStrip*st = (JPGStrip*)arg;
+	YCCPlanes planes;
+	if(yccplanes_init(&planes, st->ciff->width) != RET_OK) {
+		st->ret = RET_ERR_MEM;
+		return;
+	}
+	struct jpeg_compress_struct*cinfo = jpgAcquire();
+	if(!cinfo) {
+		yccplanes_clear(&planes);
+		st->ret = RET_ERR_MEM;
+		return;
+	}
+	if(jpgCatch(cinfo)) { // the strip's own buffer is dropped with the others
+		yccplanes_clear(&planes);
+		st->ret = jpgFail(cinfo);
+		return;
+	}
+	jpgMemDest(cinfo, &st->out, jpgExpectedSize(st->ciff->width, st->rows));
+	jpgStripSetup(cinfo, st->ciff->width, st->rows, st->enc);
+	const int raw = jpgRawInput(cinfo);
+	jpeg_start_compress(cinfo, TRUE);
+	size_t row_stride = st->ciff->width * 3;
+	if(raw) jpgWriteRaw(cinfo, &planes, st->ciff->imgbuf + st->row0 * row_stride, row_stride);
+	else jpgWriteRows(cinfo, st->ciff->imgbuf + st->row0 * row_stride, row_stride, st->rows);
+	jpeg_finish_compress(cinfo);
+	jpgRelease(cinfo);
+	yccplanes_clear(&planes);
+	st->ret = RET_OK;
+}
+
+// offset of the entropy coded data (right after the SOS segment), 0 if the stream is not what libjpeg writes
+// *sof_height: position of the frame height in the SOF segment
+static size_t jpgScanStart(const unsigned char*p, size_t len, size_t*sof_height) {
+	size_t i = 2; // SOI
+	if((len < 4) || (p[0] != 0xFF) || (p[1] != 0xD8)) return 0;
+	*sof_height = 0;
+	while(i + 4 <= len) {
+		if(p[i] != 0xFF) return 0;
+		unsigned char m = p[i+1];
+		size_t seglen = ((size_t)p[i+2] << 8) | p[i+3];
+		if(i + 2 + seglen > len) return 0;
+		if((m == 0xC0) || (m == 0xC1) || (m == 0xC2)) *sof_height = i + 5; // marker, length, precision
+		if(m == 0xDA) return (*sof_height) ? i + 2 + seglen : 0;
+		i += 2 + seglen;
+	}
+	return 0;
+}
+
+// copies entropy coded data, renumbering the RSTn markers to continue the sequence in *rst
+static size_t jpgCopyScan(unsigned char*dst, const unsigned char*src, size_t len, unsigned int*rst) {
+	size_t o = 0;
+	for(size_t i=0; i<len; ++i) {
+		dst[o++] = src[i];
+		if((src[i] == 0xFF) && (i+1 < len)) {
+			unsigned char m = src[++i];
+			if((m >= 0xD0) && (m <= 0xD7)) m = 0xD0 + ((*rst)++ & 7);
+			dst[o++] = m; // 0x00 stuffing stays as it is
+		}
+	}
+	return o;
+}
+
+ReturnCode encodeJPGStrips(const CIFF* const ciff, ThreadPool*pool, const EncodeOptions*enc, OutBuffer*out) {
+	// strips have to start on an MCU row: 16 lines with the default 2x2 luma sampling
+	struct jpeg_compress_struct*probe = jpgAcquire();
+	if(!probe) return RET_ERR_MEM;
+	if(jpgCatch(probe)) return jpgFail(probe);
+	jpgStripSetup(probe, ciff->width, ciff->height, enc);
+	int max_v = 1;
+	for(int c=0; c<probe->num_components; ++c)
+		if(probe->comp_info[c].v_samp_factor > max_v) max_v = probe->comp_info[c].v_samp_factor;
+	jpgRelease(probe);
+	const unsigned long long mcu_h = (unsigned long long)max_v * DCTSIZE;
+
+	unsigned long long nstrips = (unsigned long long)pool->nthreads * 2; // some slack for stealing
+	if(nstrips > ciff->height / jpg_strip_min_rows) nstrips = ciff->height / jpg_strip_min_rows;
+	unsigned long long strip_h = (ciff->height + nstrips - 1) / nstrips;
+	strip_h = (strip_h + mcu_h - 1) / mcu_h * mcu_h;
+	nstrips = (ciff->height + strip_h - 1) / strip_h;
+
+	JPGStrip*strips = (JPGStrip*)calloc(nstrips, sizeof(JPGStrip));
+	if(!strips) return RET_ERR_MEM;
+	TaskGroup group;
+	taskgroup_init(&group);
+	ReturnCode ret = RET_OK;
+	for(unsigned long long i=0; i<nstrips; ++i) {
+		strips[i].ciff = ciff;
+		strips[i].enc = enc;
+		strips[i].row0 = i * strip_h;
+		strips[i].rows = (i+1 < nstrips) ? strip_h : ciff->height - i * strip_h;
+		strips[i].ret = RET_ERR_CHK;
+		outbuffer_init(&strips[i].out);
+		if(pool_submit(pool, &group, jpgStripEncode, &strips[i]) != RET_OK) jpgStripEncode(&strips[i]);
+	}
+	pool_wait(pool, &group);
+
+	// stitch: headers of the first strip (with the full height), scans separated by RSTn, one EOI
+	size_t total = 2, sof_height = 0, hdr = 0;
+	for(unsigned long long i=0; (i<nstrips) && (ret == RET_OK); ++i) {
+		const OutBuffer*so = &strips[i].out;
+		size_t sofh;
+		size_t sos = (strips[i].ret == RET_OK) ? jpgScanStart(so->data, so->len, &sofh) : 0;
+		if((sos == 0) || (so->len < sos + 2)) ret = RET_ERR_CHK;
+		else {
+			if(i == 0) {
+				hdr = sos;
+				sof_height = sofh;
+			}
+			total += (i == 0 ? sos : 2) + (so->len - sos - 2); // scan without EOI, RST in front of the next ones
+		}
+	}
+	if(ret == RET_OK) ret = outbuffer_reserve(out, out->len + total);
+	if(ret == RET_OK) {
+		unsigned char*o = out->data + out->len;
+		size_t n = hdr;
+		unsigned int rst = 0;
+		memcpy(o, strips[0].out.data, hdr);
+		o[sof_height] = (unsigned char)(ciff->height >> 8);
+		o[sof_height+1] = (unsigned char)(ciff->height & 0xFF);
+		for(unsigned long long i=0; i<nstrips; ++i) {
+			const OutBuffer*so = &strips[i].out;
+			size_t sofh;
+			size_t sos = jpgScanStart(so->data, so->len, &sofh);
+			if(i > 0) {
+				o[n++] = 0xFF;
+				o[n++] = 0xD0 + (rst++ & 7);
+			}
+			n += jpgCopyScan(o + n, so->data + sos, so->len - sos - 2, &rst);
+		}
+		o[n++] = 0xFF;
+		o[n++] = 0xD9; // EOI
+		out->len += n;
+	}
+	for(unsigned long long i=0; i<nstrips; ++i) outbuffer_clear(&strips[i].out);
+	free(strips);
+	return ret;
+}
+
+static void animFrameEncode(void*arg) {
+	AnimFrame*f = (AnimFrame*)arg;
+	CIFF*ciff = NULL;
+	f->ret = caff_frame(f->caff, f->k, &ciff); // every task parses its own frame
+	if(f->ret != RET_OK) return;
+	previewSize(ciff, f->enc, &f->width, &f->height);
+	unsigned long long t = statsBegin();
+	f->ret = f->encoder->encode(ciff, f->enc, &f->out);
+	statsEnd(STAGE_ENCODE, t);
+}
+
+// frames are encoded concurrently on g_pool (if any), then muxed in order;
+// a run of identical frames becomes one longer frame, a repeated one reuses the earlier payload
+ReturnCode encodeAnimation(CAFF*caff, const EncodeOptions*enc, const char*label, OutBuffer*out) {
+	if(!caff || (caff->header.num_anim == 0)) return RET_ERR_CHK;
+	logInfo("write animation to %s (%llu frames)\n", label, caff->header.num_anim);
+	const unsigned long long n = caff->header.num_anim;
+	const PreviewEncoder*pe = previewEncoder(enc ? enc->format : FORMAT_JPG);
+	AnimFrame*frames = (AnimFrame*)calloc(n, sizeof(AnimFrame));
+	unsigned long long*entry = (unsigned long long*)malloc(n * sizeof(unsigned long long)); // frame -> frames[]
+	if(!frames || !entry) {
+		free(frames);
+		free(entry);
+		return RET_ERR_MEM;
+	}
+	TaskGroup group;
+	taskgroup_init(&group);
+	unsigned long long m = 0;
+	for(unsigned long long k=0; k<n; ++k) {
+		const CAFFAnimation*a = caff->animations;
+		const unsigned long long same_as = caff->unique_frames ? a[k].same_as : k;
+		if((k > 0) && caff->unique_frames && (same_as == a[k-1].same_as)) {
+			frames[m-1].duration += a[k].duration; // a hold
+			entry[k] = m-1;
+			continue;
+		}
+		entry[k] = m;
+		AnimFrame*f = &frames[m++];
+		f->caff = caff;
+		f->k = k;
+		f->enc = enc;
+		f->encoder = pe;
+		f->same = (same_as != k) ? &frames[entry[same_as]] : NULL;
+		f->duration = a[k].duration;
+		f->ret = RET_ERR_CHK;
+		outbuffer_init(&f->out);
+		if(f->same) continue;
+		if(!g_pool || (pool_submit(g_pool, &group, animFrameEncode, f) != RET_OK)) animFrameEncode(f);
+	}
+	if(g_pool) pool_wait(g_pool, &group);
+	ReturnCode ret = RET_OK;
+	for(unsigned long long i=0; (i<m) && (ret == RET_OK); ++i) {
+		if(frames[i].same) {
+			frames[i].width = frames[i].same->width;
+			frames[i].height = frames[i].same->height;
+		}
+		else ret = frames[i].ret;
+	}
+	if(ret == RET_OK) {
+		unsigned long long t = statsBegin();
+		ret = pe->mux(frames, m, out);
+		statsEnd(STAGE_ENCODE, t);
+	}
+	for(unsigned long long i=0; i<m; ++i) outbuffer_clear(&frames[i].out);
+	free(entry);
+	free(frames);
+	return ret;
+}
+
+// the encoded frame, shared with an earlier identical one
+static const OutBuffer* animPayload(const AnimFrame*f) {
+	return f->same ? &f->same->out : &f->out;
+}
+
+static unsigned long long gcdULL(unsigned long long a, unsigned long long b) {
+	while(b) {
+		unsigned long long t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static void aviPut32(unsigned char*p, unsigned long long v) {
+	p[0] = (unsigned char)(v & 0xFF);
+	p[1] = (unsigned char)((v >> 8) & 0xFF);
+	p[2] = (unsigned char)((v >> 16) & 0xFF);
+	p[3] = (unsigned char)((v >> 24) & 0xFF);
+}
+
+static void aviPut16(unsigned char*p, unsigned long long v) {
+	p[0] = (unsigned char)(v & 0xFF);
+	p[1] = (unsigned char)((v >> 8) & 0xFF);
+}
+
+// AVI 1.0 with one MJPEG stream: the timebase is the gcd of the durations (ms),
+// a frame lasting more ticks is followed by empty "00dc" chunks (repeat the previous frame)
+ReturnCode muxAVI(const AnimFrame*frames, unsigned long long cnt, OutBuffer*out) {
+	unsigned long long tick = 0, width = 0, height = 0, maxlen = 0;
+	for(unsigned long long k=0; k<cnt; ++k) {
+		tick = gcdULL(tick, frames[k].duration);
+		if(frames[k].width > width) width = frames[k].width;
+		if(frames[k].height > height) height = frames[k].height;
+		if(animPayload(&frames[k])->len > maxlen) maxlen = animPayload(&frames[k])->len;
+	}
+	if(tick == 0) tick = anim_default_tick;
+	if(tick > 0xFFFFFFFFull / 1000) return RET_ERR_RES_CONSTRAINT;
+	unsigned long long ticks = 0, movi = 4;
+	for(unsigned long long k=0; k<cnt; ++k) {
+		unsigned long long t = frames[k].duration / tick;
+		if(t == 0) t = 1;
+		ticks += t;
+		movi += 8 + ((animPayload(&frames[k])->len + 1) & ~1ull) + (t - 1) * 8;
+		if(movi > 0xFFFFFFFFull) return RET_ERR_RES_CONSTRAINT;
+	}
+	const unsigned long long hdrl = 4 + (8+56) + (8+4+(8+56)+(8+40));
+	const unsigned long long riff = 4 + (8+hdrl) + (8+movi) + (8+ticks*16);
+	if(riff > 0xFFFFFFF0ull) return RET_ERR_RES_CONSTRAINT; // RIFF sizes are 32 bit
+	if(outbuffer_reserve(out, out->len + 8 + riff) != RET_OK) return RET_ERR_MEM;
+
+	unsigned char*o = out->data + out->len;
+	unsigned char*p = o;
+	memset(p, 0, 8 + riff - (movi - 4) - (8 + ticks*16)); // headers, the payload is copied over
+	memcpy(p, "RIFF", 4); aviPut32(p+4, riff); memcpy(p+8, "AVI ", 4); p += 12;
+	memcpy(p, "LIST", 4); aviPut32(p+4, hdrl); memcpy(p+8, "hdrl", 4); p += 12;
+	memcpy(p, "avih", 4); aviPut32(p+4, 56); p += 8;
+	aviPut32(p, tick * 1000);      // dwMicroSecPerFrame
+	aviPut32(p+12, 0x10);          // dwFlags: AVIF_HASINDEX
+	aviPut32(p+16, ticks);         // dwTotalFrames
+	aviPut32(p+24, 1);             // dwStreams
+	aviPut32(p+28, maxlen);        // dwSuggestedBufferSize
+	aviPut32(p+32, width);
+	aviPut32(p+36, height);
+	p += 56;
+	memcpy(p, "LIST", 4); aviPut32(p+4, 4+(8+56)+(8+40)); memcpy(p+8, "strl", 4); p += 12;
+	memcpy(p, "strh", 4); aviPut32(p+4, 56); p += 8;
+	memcpy(p, "vids", 4);
+	memcpy(p+4, "MJPG", 4);
+	aviPut32(p+20, tick);          // dwScale
+	aviPut32(p+24, 1000);          // dwRate: ticks of 1000/tick per second
+	aviPut32(p+32, ticks);         // dwLength
+	aviPut32(p+36, maxlen);        // dwSuggestedBufferSize
+	aviPut32(p+40, 0xFFFFFFFFull); // dwQuality: default
+	aviPut16(p+52, width);         // rcFrame right, bottom
+	aviPut16(p+54, height);
+	p += 56;
+	memcpy(p, "strf", 4); aviPut32(p+4, 40); p += 8;
+	aviPut32(p, 40);               // BITMAPINFOHEADER
+	aviPut32(p+4, width);
+	aviPut32(p+8, height);
+	aviPut16(p+12, 1);
+	aviPut16(p+14, 24);
+	memcpy(p+16, "MJPG", 4);
+	aviPut32(p+20, width * height * 3);
+	p += 40;
+	memcpy(p, "LIST", 4); aviPut32(p+4, movi); memcpy(p+8, "movi", 4);
+	unsigned char*movi_start = p + 8;
+	p += 12;
+	unsigned char*idx = p + (movi - 4);
+	memcpy(idx, "idx1", 4); aviPut32(idx+4, ticks * 16); idx += 8;
+	for(unsigned long long k=0; k<cnt; ++k) {
+		unsigned long long t = frames[k].duration / tick;
+		if(t == 0) t = 1;
+		for(unsigned long long i=0; i<t; ++i) {
+			const size_t len = (i == 0) ? animPayload(&frames[k])->len : 0;
+			memcpy(idx, "00dc", 4);
+			aviPut32(idx+4, (i == 0) ? 0x10 : 0); // AVIIF_KEYFRAME, every JPEG is one
+			aviPut32(idx+8, (unsigned long long)(p - movi_start));
+			aviPut32(idx+12, len);
+			idx += 16;
+			memcpy(p, "00dc", 4);
+			aviPut32(p+4, len);
+			p += 8;
+			if(len) memcpy(p, animPayload(&frames[k])->data, len);
+			p += len;
+			if(len & 1) *p++ = 0;
+		}
+	}
+	out->len += 8 + riff;
+	return RET_OK;
+}
+
+// every frame is a complete WebP already, WebPMux only wraps them into ANMF chunks
+ReturnCode muxWebP(const AnimFrame*frames, unsigned long long cnt, OutBuffer*out) {
+#ifdef HAVE_WEBP
+	unsigned long long width = 0, height = 0;
+	for(unsigned long long k=0; k<cnt; ++k) {
+		if(frames[k].width > width) width = frames[k].width;
+		if(frames[k].height > height) height = frames[k].height;
+	}
+	WebPMux*mux = WebPMuxNew();
+	if(!mux) return RET_ERR_MEM;
+	WebPMuxError err = WebPMuxSetCanvasSize(mux, (int)width, (int)height);
+	for(unsigned long long k=0; (k<cnt) && (err == WEBP_MUX_OK); ++k) {
+		WebPMuxFrameInfo fi;
+		memset(&fi, 0, sizeof(fi));
+		fi.bitstream.bytes = animPayload(&frames[k])->data;
+		fi.bitstream.size = animPayload(&frames[k])->len;
+		fi.duration = (int)((frames[k].duration > 0xFFFFFF) ? 0xFFFFFF : frames[k].duration); // 24 bit field
+		fi.id = WEBP_CHUNK_ANMF;
+		fi.dispose_method = WEBP_MUX_DISPOSE_BACKGROUND;
+		fi.blend_method = WEBP_MUX_NO_BLEND;
+		err = WebPMuxPushFrame(mux, &fi, 0); // no copy, frames outlive the mux
+	}
+	if(err == WEBP_MUX_OK) {
+		WebPMuxAnimParams params;
+		params.bgcolor = 0xFFFFFFFF;
+		params.loop_count = 0; // forever
+		err = WebPMuxSetAnimationParams(mux, &params);
+	}
+	WebPData assembled;
+	WebPDataInit(&assembled);
+	if(err == WEBP_MUX_OK) err = WebPMuxAssemble(mux, &assembled);
+	ReturnCode ret = RET_OK;
+	if(err == WEBP_MUX_OK) ret = outbuffer_append(out, assembled.bytes, assembled.size);
+	else ret = (err == WEBP_MUX_MEMORY_ERROR) ? RET_ERR_MEM : RET_ERR_CHK;
+	WebPDataClear(&assembled);
+	WebPMuxDelete(mux);
+	return ret;
+#else
+	(void)frames;
+	(void)cnt;
+	(void)out;
+	logError("webp support is not compiled in (make WEBP=1)\n");
+	return RET_ERR_CHK;
+#endif
+}
+
+// walks the block chain once, checks its structure and records (type, offset, length) for every block
+// the arrays grow by doubling inside the arena, the outgrown ones are left behind until the reset
+ReturnCode caffIndex(const char* const buf, size_t bufLen, CAFFIndex*index, Arena*arena) {
+	caffindex_init(index);
+	unsigned long long cap = 0, framecap = 0;
+	unsigned long long cnt_header = 0, cnt_credits = 0;
+	size_t pos = 0;
+	while((bufLen - pos) >= caff_blockheader_minSize) {
+		unsigned char block_type = loadUInt8(buf + pos);
+		unsigned long long block_length = loadUInt64(buf + pos + 1);
+		size_t data = pos + caff_blockheader_minSize;
+		if(block_length > (bufLen - data)) { // also covers pos+block_length overflow
+			logError("invalid CAFF length %llu @%lu (%lu bytes left)\n", block_length, pos, bufLen - data);
+			caffindex_clear(index);
+			return RET_ERR_CHK;
+		}
+		if(block_type == CAFF_BLOCK_HEADER) {
+			index->header_block = index->blockcnt;
+			++cnt_header;
+		}
+		else if(block_type == CAFF_BLOCK_CREDITS) {
+			index->credits_block = index->blockcnt;
+			++cnt_credits;
+		}
+		else if(block_type == CAFF_BLOCK_ANIMATION) {
+			if(index->framecnt == framecap) {
+				framecap = framecap ? framecap*2 : caff_index_initial_blocks;
+				unsigned long long*nf = (unsigned long long*)arena_alloc(arena, framecap*sizeof(unsigned long long));
+				if(!nf) {
+					caffindex_clear(index);
+					return RET_ERR_MEM;
+				}
+				if(index->framecnt) memcpy(nf, index->frame_blocks, index->framecnt*sizeof(unsigned long long));
+				index->frame_blocks = nf;
+			}
+			index->frame_blocks[index->framecnt++] = index->blockcnt;
+		}
+		else {
+			logError("invalid block_type:%d @%lu\n", block_type, pos);
+			caffindex_clear(index);
+			return RET_ERR_CHK;
+		}
+		if(index->blockcnt == cap) {
+			cap = cap ? cap*2 : caff_index_initial_blocks;
+			CAFFBlock*nb = (CAFFBlock*)arena_alloc(arena, cap*sizeof(CAFFBlock));
+			if(!nb) {
+				caffindex_clear(index);
+				return RET_ERR_MEM;
+			}
+			if(index->blockcnt) memcpy(nb, index->blocks, index->blockcnt*sizeof(CAFFBlock));
+			index->blocks = nb;
+		}
+		index->blocks[index->blockcnt].type = block_type;
+		index->blocks[index->blockcnt].offset = data;
+		index->blocks[index->blockcnt].length = block_length;
+		++index->blockcnt;
+		pos = data + block_length;
+	}
+	if(pos != bufLen) {
+		logError("invalid CAFF length %lu != %lu\n", pos, bufLen);
+		caffindex_clear(index);
+		return RET_ERR_CHK;
+	}
+	logDebug("found blocks:\n\t1: %llu\n\t2: %llu\n\t3: %llu\n", cnt_header, cnt_credits, index->framecnt);
+	if((cnt_header != 1) ||(cnt_credits > 1)) {
+		logError("exactly 1 header and at most 1 credit caff block expected\n");
+		caffindex_clear(index);
+		return RET_ERR_CHK;
+	}
+	if(cnt_credits == 0) index->credits_block = index->blockcnt;
+	return RET_OK;
+}
+
+// O(1) lookup of the k-th animation block (NULL if out of range)
+const CAFFBlock* caffindex_frame(const CAFFIndex*index, unsigned long long k) {
+	if(!index || (k >= index->framecnt)) return NULL;
+	return &index->blocks[index->frame_blocks[k]];
+}
+
+ReturnCode caffParseHeaderBlock(const char* const p, unsigned long long len, CAFFHeader*header) {
+	if(len != caff_header_len) return RET_ERR_FORMAT;
+	if(strncmp(p, MagicCAFF, MagicCAFFlen)) return RET_ERR_FORMAT;
+	header->header_size = loadUInt64( p + caff_header_offset_header_size );
+	if(header->header_size != caff_header_len) return RET_ERR_CHK;
+	header->num_anim = loadUInt64( p + caff_header_offset_num_anim );
+	header->block_handled = 1;
+	return RET_OK;
+}
+
+// credits->creator is allocated from the arena
+ReturnCode caffParseCreditsBlock(const char* const p, unsigned long long len, CAFFCredits*credits, Arena*arena) {
+	if(len < caff_credits_minlen) return RET_ERR_FORMAT;
+	credits->year        = loadUInt16( p + caff_credirs_offset_year );
+	credits->month       = loadUInt8(  p + caff_credirs_offset_month );
+	credits->day         = loadUInt8(  p + caff_credirs_offset_day );
+	credits->hour        = loadUInt8(  p + caff_credirs_offset_hour );
+	credits->minute      = loadUInt8(  p + caff_credirs_offset_minute );
+	credits->creator_len = loadUInt64( p + caff_credirs_offset_creator_len );
+	if( (credits->month > 12) ||
+		(credits->day > 31) ||
+		(credits->hour > 24) ||
+		(credits->minute > 60)
+	) return RET_ERR_CHK;
+	if( len != ( caff_credirs_offset_creator + credits->creator_len ) ) return RET_ERR_FORMAT;
+	credits->creator = (char*)arena_alloc( arena, credits->creator_len + 1 );
+	if(!credits->creator) return RET_ERR_MEM;
+	strncpy(credits->creator, p + caff_credirs_offset_creator, credits->creator_len);
+	credits->creator[credits->creator_len] = '\0';
+	credits->block_handled = 1;
+	return RET_OK;
+}
+
+// block length, duration and the CIFF header; caption, tags and pixels are left alone
+ReturnCode caffCheckAnimationBlock(const char* const p, unsigned long long len, unsigned long long*duration, CIFF*header) {
+	if( len < caff_animation_minlen) return RET_ERR_FORMAT;
+	*duration = loadUInt64(p+caff_animation_offset_duration);
+	return ciffParseHeader(p+caff_animation_offset_ciff, len-caff_animation_offset_ciff, header);
+}
+
+// full parse of frame k on first use, into caff->arena
+ReturnCode caff_frame(CAFF*caff, unsigned long long k, CIFF**ciff) {
+	*ciff = NULL;
+	if(!caff || !caff->animations || (k >= caff->header.num_anim)) return RET_ERR_CHK;
+	CAFFAnimation*a = &caff->animations[k];
+	if(!a->block_handled) return RET_ERR_CHK;
+	if(!a->ciff) {
+		ReturnCode r = ciffParse(a->ciff_data, a->ciff_len, &a->ciff, caff->arena);
+		if(r != RET_OK) return r;
+		if(!a->ciff) return RET_ERR_CHK;
+	}
+	*ciff = a->ciff;
+	return RET_OK;
+}
+
+// XXH64 (https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md)
+// four independent lanes per 32 byte stripe keep the multipliers busy
+#define xxh_prime1 0x9E3779B185EBCA87ull
+#define xxh_prime2 0xC2B2AE3D27D4EB4Full
+#define xxh_prime3 0x165667B19E3779F9ull
+#define xxh_prime4 0x85EBCA77C2B2AE63ull
+#define xxh_prime5 0x27D4EB2F165667C5ull
+
+static inline unsigned long long xxhRotl(unsigned long long x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline unsigned long long xxhRead64(const unsigned char*p) {
+	unsigned long long v;
+	memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline unsigned long long xxhRead32(const unsigned char*p) {
+	unsigned int v;
+	memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline unsigned long long xxhRound(unsigned long long acc, unsigned long long input) {
+	acc += input * xxh_prime2;
+	acc = xxhRotl(acc, 31);
+	return acc * xxh_prime1;
+}
+
+static inline unsigned long long xxhMerge(unsigned long long acc, unsigned long long val) {
+	acc ^= xxhRound(0, val);
+	return acc * xxh_prime1 + xxh_prime4;
+}
+
+// scalar on purpose: every lane depends on its own previous round, in one AVX2 register the four lanes become a
+// single chain of emulated 64-bit multiplies (no vpmullq before AVX-512DQ), 5.4 GB/s against 8.3 GB/s scalar;
+// xxh64_1m and caff_dedup_256_x100 against encode_jpg_balanced_256 in make bench show what the hash costs next to an encode
+unsigned long long xxh64(const void*data, size_t len, unsigned long long seed) {
+	const unsigned char*p = (const unsigned char*)data;
+	const unsigned char*const end = p + len;
+	unsigned long long h;
+	if(len >= 32) {
+		unsigned long long v1 = seed + xxh_prime1 + xxh_prime2;
+		unsigned long long v2 = seed + xxh_prime2;
+		unsigned long long v3 = seed;
+		unsigned long long v4 = seed - xxh_prime1;
+		const unsigned char*const limit = end - 32;
+		do {
+			v1 = xxhRound(v1, xxhRead64(p));
+			v2 = xxhRound(v2, xxhRead64(p+8));
+			v3 = xxhRound(v3, xxhRead64(p+16));
+			v4 = xxhRound(v4, xxhRead64(p+24));
+			p += 32;
+		} while(p <= limit);
+		h = xxhRotl(v1, 1) + xxhRotl(v2, 7) + xxhRotl(v3, 12) + xxhRotl(v4, 18);
+		h = xxhMerge(h, v1);
+		h = xxhMerge(h, v2);
+		h = xxhMerge(h, v3);
+		h = xxhMerge(h, v4);
+	}
+	else h = seed + xxh_prime5;
+	h += (unsigned long long)len;
+	for(; p + 8 <= end; p += 8) h = xxhRotl(h ^ xxhRound(0, xxhRead64(p)), 27) * xxh_prime1 + xxh_prime4;
+	if(p + 4 <= end) {
+		h = xxhRotl(h ^ (xxhRead32(p) * xxh_prime1), 23) * xxh_prime2 + xxh_prime3;
+		p += 4;
+	}
+	for(; p < end; ++p) h = xxhRotl(h ^ (*p * xxh_prime5), 11) * xxh_prime1;
+	h ^= h >> 33;
+	h *= xxh_prime2;
+	h ^= h >> 29;
+	h *= xxh_prime3;
+	h ^= h >> 32;
+	return h;
+}
+
+typedef struct T_FrameHash {
+	CAFFAnimation*a;
+	CIFF header;
+} FrameHash;
+
+static void frameHashRun(void*arg) {
+	FrameHash*t = (FrameHash*)arg;
+	// the dimensions go into the seed: same bytes in a different shape are a different image
+	t->a->hash = xxh64(t->a->ciff_data + t->header.header_size, t->header.content_size,
+		t->header.width * xxh_prime3 ^ t->header.height);
+}
+
+// hashes the pixels of every frame (on g_pool) and links identical frames to their first occurrence
+ReturnCode caffDedup(CAFF*caff) {
+	if(!caff || !caff->animations) return RET_ERR_CHK;
+	if(caff->unique_frames) return RET_OK;
+	const unsigned long long n = caff->header.num_anim;
+	if(n == 0) return RET_OK;
+	unsigned long long slots = 1;
+	while(slots < 2*n) slots <<= 1;
+	FrameHash*tasks = (FrameHash*)calloc(n, sizeof(FrameHash));
+	unsigned long long*table = (unsigned long long*)calloc(slots, sizeof(unsigned long long)); // frame+1, 0: empty
+	if(!tasks || !table) {
+		free(tasks);
+		free(table);
+		return RET_ERR_MEM;
+	}
+	ReturnCode ret = RET_OK;
+	TaskGroup group;
+	taskgroup_init(&group);
+	for(unsigned long long k=0; (k<n) && (ret == RET_OK); ++k) {
+		tasks[k].a = &caff->animations[k];
+		ret = ciffParseHeader(tasks[k].a->ciff_data, tasks[k].a->ciff_len, &tasks[k].header);
+		if(ret != RET_OK) break;
+		if(!g_pool || (pool_submit(g_pool, &group, frameHashRun, &tasks[k]) != RET_OK)) frameHashRun(&tasks[k]);
+	}
+	if(g_pool) pool_wait(g_pool, &group);
+	unsigned long long unique = 0;
+	for(unsigned long long k=0; (k<n) && (ret == RET_OK); ++k) {
+		CAFFAnimation*a = tasks[k].a;
+		const CIFF*hk = &tasks[k].header;
+		unsigned long long i = a->hash & (slots-1);
+		a->same_as = k;
+		for(; table[i]; i = (i+1) & (slots-1)) {
+			const unsigned long long j = table[i]-1;
+			const CIFF*hj = &tasks[j].header;
+			if((tasks[j].a->hash == a->hash) && (hj->width == hk->width) && (hj->height == hk->height) &&
+				(memcmp(tasks[j].a->ciff_data + hj->header_size, a->ciff_data + hk->header_size, hk->content_size) == 0)) {
+				a->same_as = j;
+				break;
+			}
+		}
+		if(a->same_as == k) {
+			table[i] = k+1;
+			unique += 1;
+		}
+	}
+	if(ret == RET_OK) caff->unique_frames = unique;
+	free(table);
+	free(tasks);
+	return ret;
+}
+
+ReturnCode caffParseAnimationBlock(const char* const p, unsigned long long len, unsigned long long*duration, CIFF**ciff_result, Arena*arena) {
+	*ciff_result = NULL;
+	if( len < caff_animation_minlen) return RET_ERR_FORMAT;
+	*duration = loadUInt64(p+caff_animation_offset_duration);
+	CIFF*ciff = NULL;
+	ReturnCode r=ciffParse(p+caff_animation_offset_ciff, len-caff_animation_offset_ciff, &ciff, arena);
+	if((r != RET_OK) || (!ciff)) return (r != RET_OK)?r:RET_ERR_CHK;
+	*ciff_result = ciff;
+	return RET_OK;
+}
+
+void caffstream_init(CAFFStream*s, const CAFFStreamCallbacks*cb, void*user) {
+	if(!s) return;
+	s->cb.on_header = cb ? cb->on_header : NULL;
+	s->cb.on_credits = cb ? cb->on_credits : NULL;
+	s->cb.on_frame = cb ? cb->on_frame : NULL;
+	s->user = user;
+	s->header.header_size = 0;
+	s->header.num_anim = 0;
+	s->header.block_handled = 0;
+	s->credits.year = 0;
+	s->credits.month = 0;
+	s->credits.day = 0;
+	s->credits.hour = 0;
+	s->credits.minute = 0;
+	s->credits.creator_len = 0;
+	s->credits.creator = NULL;
+	s->credits.block_handled = 0;
+	arena_init(&s->arena);
+	arena_init(&s->frame_arena);
+	s->blockhdr_fill = 0;
+	s->block_type = 0;
+	s->block_length = 0;
+	s->blockbuf = NULL;
+	s->blockbuf_cap = 0;
+	s->blockbuf_fill = 0;
+	s->frames = 0;
+	s->consumed = 0;
+	s->status = RET_OK;
+}
+
+void caffstream_clear(CAFFStream*s) {
+	if(!s) return;
+	if(s->blockbuf) {
+		free(s->blockbuf);
+		s->blockbuf = NULL;
+	}
+	budget_release(s->blockbuf_cap);
+	s->blockbuf_cap = 0;
+	s->blockbuf_fill = 0;
+	s->credits.creator = NULL;
+	arena_clear(&s->arena);
+	arena_clear(&s->frame_arena);
+	s->credits.creator_len = 0;
+	s->credits.block_handled = 0;
+	s->header.block_handled = 0;
+	s->frames = 0;
+}
+
+// block header complete: reject what can be rejected before buffering the data
+static ReturnCode caffstream_begin_block(CAFFStream*s) {
+	s->block_type = loadUInt8(s->blockhdr);
+	s->block_length = loadUInt64(s->blockhdr + 1);
+	if(!s->header.block_handled && (s->block_type != CAFF_BLOCK_HEADER)) {
+		logError("stream: the first block must be the CAFF header\n");
+		return RET_ERR_FORMAT;
+	}
+	if(s->block_type == CAFF_BLOCK_HEADER) {
+		if(s->header.block_handled) return RET_ERR_CHK; // exactly 1 header
+		if(s->block_length != caff_header_len) return RET_ERR_FORMAT;
+	}
+	else if(s->block_type == CAFF_BLOCK_CREDITS) {
+		if(s->credits.block_handled) return RET_ERR_CHK; // at most 1 credits
+	}
+	else if(s->block_type == CAFF_BLOCK_ANIMATION) {
+		if(s->frames >= s->header.num_anim) return RET_ERR_CHK; // we overran
+	}
+	else {
+		logError("invalid block_type:%d @%llu\n", s->block_type, s->consumed);
+		return RET_ERR_CHK;
+	}
+	if(g_budget.limit && (s->block_length > g_budget.limit)) return RET_ERR_RES_CONSTRAINT;
+	return RET_OK;
+}
+
+static ReturnCode caffstream_end_block(CAFFStream*s, const char*p) {
+	ReturnCode r = RET_OK;
+	if(s->block_type == CAFF_BLOCK_HEADER) {
+		r = caffParseHeaderBlock(p, s->block_length, &s->header);
+		if((r == RET_OK) && s->cb.on_header) r = s->cb.on_header(s->user, &s->header);
+	}
+	else if(s->block_type == CAFF_BLOCK_CREDITS) {
+		r = caffParseCreditsBlock(p, s->block_length, &s->credits, &s->arena);
+		if((r == RET_OK) && s->cb.on_credits) r = s->cb.on_credits(s->user, &s->credits);
+	}
+	else { // CAFF_BLOCK_ANIMATION
+		unsigned long long duration = 0;
+		CIFF*ciff = NULL;
+		r = caffParseAnimationBlock(p, s->block_length, &duration, &ciff, &s->frame_arena);
+		if((r == RET_OK) && s->cb.on_frame) r = s->cb.on_frame(s->user, s->frames, duration, ciff);
+		arena_reset(&s->frame_arena); // the next frame reuses the chunk
+		if(r == RET_OK) ++s->frames;
+	}
+	s->blockhdr_fill = 0;
+	s->blockbuf_fill = 0;
+	return r;
+}
+
+// chunks can be split anywhere, blocks completely inside a chunk are parsed in place
+ReturnCode caffstream_feed(CAFFStream*s, const char*chunk, size_t len) {
+	if(s->status != RET_OK) return s->status;
+	size_t pos = 0;
+	while(pos < len) {
+		if(s->blockhdr_fill < sizeof(s->blockhdr)) {
+			size_t n = sizeof(s->blockhdr) - s->blockhdr_fill;
+			if(n > len - pos) n = len - pos;
+			memcpy(s->blockhdr + s->blockhdr_fill, chunk + pos, n);
+			s->blockhdr_fill += n;
+			pos += n;
+			s->consumed += n;
+			if(s->blockhdr_fill < sizeof(s->blockhdr)) break; // need more
+			if((s->status = caffstream_begin_block(s)) != RET_OK) return s->status;
+		}
+		unsigned long long need = s->block_length - s->blockbuf_fill;
+		if((s->blockbuf_fill == 0) && (need <= len - pos)) { // zero-copy
+			if((s->status = caffstream_end_block(s, chunk + pos)) != RET_OK) return s->status;
+			pos += need;
+			s->consumed += need;
+			continue;
+		}
+		if(s->blockbuf_cap < s->block_length) { // no waiting, the frame arena may hold a part of the budget
+			if((s->status = budget_reserve(s->block_length - s->blockbuf_cap, 0)) != RET_OK) return s->status;
+			char*nb = (char*)realloc(s->blockbuf, s->block_length);
+			if(!nb) {
+				budget_release(s->block_length - s->blockbuf_cap);
+				return (s->status = RET_ERR_MEM);
+			}
+			s->blockbuf = nb;
+			s->blockbuf_cap = s->block_length;
+		}
+		size_t n = (need < len - pos) ? need : len - pos;
+		memcpy(s->blockbuf + s->blockbuf_fill, chunk + pos, n);
+		s->blockbuf_fill += n;
+		pos += n;
+		s->consumed += n;
+		if(s->blockbuf_fill == s->block_length)
+			if((s->status = caffstream_end_block(s, s->blockbuf)) != RET_OK) return s->status;
+	}
+	return RET_OK;
+}
+
+// end of input: everything announced by the header has to be there
+ReturnCode caffstream_finish(CAFFStream*s) {
+	if(s->status != RET_OK) return s->status;
+	if(s->blockhdr_fill != 0) { // truncated block
+		logError("invalid CAFF length: stream ended inside a block @%llu\n", s->consumed);
+		return (s->status = RET_ERR_CHK);
+	}
+	if(!s->header.block_handled || (s->frames != s->header.num_anim))
+		return (s->status = RET_ERR_CHK);
+	return RET_OK;
+}
+
+// upper bound of what caffParse and caff_frame take from the arena after the index:
+// the struct, the frame table, the creator and every frame with as many tags as its header has bytes
+static size_t caffArenaSize(const char* const buf, const CAFFIndex*index) {
+	unsigned long long total = sizeof(CAFF) + arena_align;
+	total += index->framecnt * (sizeof(CAFFAnimation) + sizeof(CIFF) + 2*arena_align);
+	if(index->credits_block < index->blockcnt) total += index->blocks[index->credits_block].length + arena_align;
+	for(unsigned long long k=0; k<index->framecnt; ++k) {
+		const CAFFBlock*b = caffindex_frame(index, k);
+		if(b->length < caff_animation_minlen) continue; // rejected later
+		unsigned long long hs = loadUInt64(buf + b->offset + caff_animation_offset_ciff + ciff_offset_header_size);
+		if(hs > b->length) hs = b->length; // not checked yet
+		total += hs * sizeof(CIFFSlice);
+	}
+	return (total > SIZE_MAX) ? SIZE_MAX : (size_t)total;
+}
+
+ReturnCode caffParse(const char* const buf, size_t bufLen, CAFF** caff_result, Arena*arena) {
+	*caff_result = NULL;
+	CAFF caff;
+	caff_init(&caff);
+	caff.arena = arena;
+	ReturnCode r = caffIndex(buf, bufLen, &caff.index, arena);
+	if(r != RET_OK) return r;
+	(void)arena_reserve(arena, caffArenaSize(buf, &caff.index)); // a hint, the arena still grows if it's off
+
+	{ //header
+		const CAFFBlock*b = &caff.index.blocks[caff.index.header_block];
+		r = caffParseHeaderBlock(buf + b->offset, b->length, &caff.header);
+		if(r != RET_OK) {
+			caff_clear(&caff);
+			return r;
+		}
+		if(caff.header.num_anim != caff.index.framecnt) {
+			caff_clear(&caff);
+			return RET_ERR_CHK;
+		}
+		caff.animations = (CAFFAnimation*)arena_calloc(arena, caff.header.num_anim, sizeof(CAFFAnimation));
+		if(!caff.animations) {
+			caff_clear(&caff);
+			return RET_ERR_MEM;
+		}
+	}
+
+	if(caff.index.credits_block < caff.index.blockcnt) { //credits
+		const CAFFBlock*b = &caff.index.blocks[caff.index.credits_block];
+		r = caffParseCreditsBlock(buf + b->offset, b->length, &caff.credits, arena);
+		if(r != RET_OK) {
+			caff_clear(&caff);
+			return r;
+		}
+	}
+
+	//CIFF after everything is right, only the structure here, see caff_frame
+	for(unsigned long long k=0; k<caff.index.framecnt; ++k) {
+		const CAFFBlock*b = caffindex_frame(&caff.index, k);
+		CIFF header;
+		r = caffCheckAnimationBlock(buf + b->offset, b->length, &caff.animations[k].duration, &header);
+		if(r != RET_OK) {
+			caff_clear(&caff);
+			return r;
+		}
+		caff.animations[k].ciff_data = buf + b->offset + caff_animation_offset_ciff;
+		caff.animations[k].ciff_len = b->length - caff_animation_offset_ciff;
+		caff.animations[k].block_handled=1;
+	}
+//	if(!caff.credits.block_handled) {
+//		caff.clear();
+//		return RET_ERR_CHK;
+//	}
+
+	if(((*caff_result) = (CAFF*)arena_alloc(arena, sizeof(CAFF))) == NULL) {
+		caff_clear(&caff);
+		return RET_ERR_MEM;
+	} else {
+		memcpy(*caff_result, &caff, sizeof(CAFF));
+		return RET_OK;
+	}
+}
+
+// whole lines at once, the workers share stdout
+void logPrintf(const char*fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	pthread_mutex_lock(&log_lock);
+	vfprintf(g_log ? g_log : stdout, fmt, ap);
+	pthread_mutex_unlock(&log_lock);
+	va_end(ap);
+}
+
+// out NULL: stdout; call it before the workers start
+void logConfigure(FILE*out, int level) {
+	g_log = out;
+	g_log_level = level;
+}
+
+int hardwareConcurrency(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? (int)n : 1;
+}
+
+// worker index of the calling thread in g_pool (-1: not a worker)
+static __thread int pool_worker_id = -1;
+static __thread ThreadPool*pool_worker_of = NULL;
+
+static int workqueue_push(WorkQueue*q, const PoolTask*t) {
+	pthread_mutex_lock(&q->lock);
+	if(q->tail - q->head == q->cap) {
+		size_t ncap = q->cap ? q->cap*2 : pool_queue_initial;
+		PoolTask*nt = (PoolTask*)malloc(ncap*sizeof(PoolTask));
+		if(!nt) {
+			pthread_mutex_unlock(&q->lock);
+			return 0;
+		}
+		for(size_t i=q->head; i<q->tail; ++i) nt[i - q->head] = q->tasks[i & (q->cap-1)];
+		free(q->tasks);
+		q->tasks = nt;
+		q->tail -= q->head;
+		q->head = 0;
+		q->cap = ncap;
+	}
+	q->tasks[q->tail & (q->cap-1)] = *t;
+	++q->tail;
+	pthread_mutex_unlock(&q->lock);
+	return 1;
+}
+
+// fromBack: owner (LIFO, cache friendly), otherwise a steal (FIFO, oldest = largest remaining work)
+static int workqueue_pop(WorkQueue*q, PoolTask*t, int fromBack) {
+	pthread_mutex_lock(&q->lock);
+	if(q->tail == q->head) {
+		pthread_mutex_unlock(&q->lock);
+		return 0;
+	}
+	if(fromBack) *t = q->tasks[--q->tail & (q->cap-1)];
+	else *t = q->tasks[q->head++ & (q->cap-1)];
+	pthread_mutex_unlock(&q->lock);
+	return 1;
+}
+
+static int pool_run_one(ThreadPool*pool) {
+	PoolTask t;
+	int self = (pool_worker_of == pool) ? pool_worker_id : -1;
+	int found = (self >= 0) && workqueue_pop(&pool->queues[self], &t, 1);
+	int start = (self >= 0) ? self+1 : (int)(__atomic_load_n(&pool->next, __ATOMIC_RELAXED) % pool->nthreads);
+	for(int i=0; !found && (i<pool->nthreads); ++i) {
+		int victim = (start + i) % pool->nthreads;
+		if(victim != self) found = workqueue_pop(&pool->queues[victim], &t, 0);
+	}
+	if(!found) return 0;
+	__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+	FileStats*outer = t_stats; // a task run from pool_wait may belong to another file
+	t_stats = t.stats;
+	t.fn(t.arg);
+	t_stats = outer;
+	if(t.group && (__atomic_sub_fetch(&t.group->pending, 1, __ATOMIC_ACQ_REL) == 0)) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->done_cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return 1;
+}
+
+static void* pool_worker(void*arg) {
+	WorkQueue*own = (WorkQueue*)arg;
+	ThreadPool*pool = own->pool;
+	pool_worker_of = pool;
+	pool_worker_id = own->id;
+	for(;;) {
+		if(pool_run_one(pool)) continue;
+		pthread_mutex_lock(&pool->lock);
+		while(!pool->stop && (__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0))
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		int stop = pool->stop && (__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0);
+		pthread_mutex_unlock(&pool->lock);
+		if(stop) break;
+	}
+	return NULL;
+}
+
+ThreadPool* pool_create(int nthreads) {
+	if(nthreads < 1) nthreads = 1;
+	ThreadPool*pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+	if(!pool) return NULL;
+	pool->nthreads = nthreads;
+	pool->threads = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+	pool->queues = (WorkQueue*)calloc(nthreads, sizeof(WorkQueue));
+	if(!pool->threads || !pool->queues) {
+		free(pool->threads);
+		free(pool->queues);
+		free(pool);
+		return NULL;
+	}
+	for(int i=0; i<nthreads; ++i) {
+		pool->queues[i].pool = pool;
+		pool->queues[i].id = i;
+		pthread_mutex_init(&pool->queues[i].lock, NULL);
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	// queues of threads that failed to start are still drained by stealing
+	for(; pool->started<nthreads; ++pool->started)
+		if(pthread_create(&pool->threads[pool->started], NULL, pool_worker, &pool->queues[pool->started]) != 0) break;
+	if(pool->started == 0) {
+		pool_destroy(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+// runs what is left, then joins the workers
+void pool_destroy(ThreadPool*pool) {
+	if(!pool) return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for(int i=0; i<pool->started; ++i) pthread_join(pool->threads[i], NULL);
+	for(int i=0; i<pool->nthreads; ++i) {
+		pthread_mutex_destroy(&pool->queues[i].lock);
+		free(pool->queues[i].tasks);
+	}
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->queues);
+	free(pool->threads);
+	free(pool);
+}
+
+void taskgroup_init(TaskGroup*group) {
+	group->pending = 0;
+}
+
+// tasks submitted by a worker go to its own deque, others are spread round robin
+ReturnCode pool_submit(ThreadPool*pool, TaskGroup*group, PoolTaskFn fn, void*arg) {
+	PoolTask t;
+	t.fn = fn;
+	t.arg = arg;
+	t.group = group;
+	t.stats = t_stats;
+	int q = (pool_worker_of == pool) ? pool_worker_id : (int)(__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->nthreads);
+	if(group) __atomic_add_fetch(&group->pending, 1, __ATOMIC_ACQ_REL);
+	if(!workqueue_push(&pool->queues[q], &t)) {
+		if(group) __atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL);
+		return RET_ERR_MEM;
+	}
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->work_cond);
+	pthread_cond_broadcast(&pool->done_cond); // waiters in pool_wait can help out
+	pthread_mutex_unlock(&pool->lock);
+	return RET_OK;
+}
+
+// the caller helps with the queued tasks instead of blocking, so it's safe to call from a task
+void pool_wait(ThreadPool*pool, TaskGroup*group) {
+	while(__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+		if(pool_run_one(pool)) continue;
+		pthread_mutex_lock(&pool->lock);
+		while((__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) &&
+			(__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0))
+			pthread_cond_wait(&pool->done_cond, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+ReturnCode mpmc_init(MPMCQueue*q, size_t cap) {
+	q->cells = (MPMCCell*)malloc(cap*sizeof(MPMCCell));
+	if(!q->cells) return RET_ERR_MEM;
+	for(size_t i=0; i<cap; ++i) q->cells[i].seq = i;
+	q->mask = cap - 1;
+	q->head = 0;
+	q->tail = 0;
+	sem_init(&q->free, 0, (unsigned int)cap);
+	sem_init(&q->used, 0, 0);
+	return RET_OK;
+}
+
+void mpmc_clear(MPMCQueue*q) {
+	if(!q->cells) return;
+	sem_destroy(&q->used);
+	sem_destroy(&q->free);
+	free(q->cells);
+	q->cells = NULL;
+}
+
+// a cell is free for position pos if seq == pos, holds the item of pos if seq == pos+1
+static int mpmc_trypush(MPMCQueue*q, void*data) {
+	size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	for(;;) {
+		MPMCCell*c = &q->cells[pos & q->mask];
+		intptr_t dif = (intptr_t)__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+		if(dif == 0) {
+			if(__atomic_compare_exchange_n(&q->head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				c->data = data;
+				__atomic_store_n(&c->seq, pos+1, __ATOMIC_RELEASE);
+				return 1;
+			}
+		}
+		else if(dif < 0) return 0; // full
+		else pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
+}
+
+static int mpmc_trypop(MPMCQueue*q, void**data) {
+	size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	for(;;) {
+		MPMCCell*c = &q->cells[pos & q->mask];
+		intptr_t dif = (intptr_t)__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (intptr_t)(pos+1);
+		if(dif == 0) {
+			if(__atomic_compare_exchange_n(&q->tail, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*data = c->data;
+				__atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+				return 1;
+			}
+		}
+		else if(dif < 0) return 0; // empty
+		else pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
+}
+
+// blocks while the queue is full; the retry only spins while another thread finishes its pop
+void mpmc_push(MPMCQueue*q, void*data) {
+	while(sem_wait(&q->free) != 0) {} // EINTR
+	while(!mpmc_trypush(q, data)) sched_yield();
+	sem_post(&q->used);
+}
+
+// blocks while the queue is empty
+void* mpmc_pop(MPMCQueue*q) {
+	void*data;
+	while(sem_wait(&q->used) != 0) {}
+	while(!mpmc_trypop(q, &data)) sched_yield();
+	sem_post(&q->free);
+	return data;
+}
+
+// --serve: previews over a Unix socket, one request at a time per connection, answered on the pool.
+// request:  "CPRQ", u8 version, u8 file type, u8 source, u8 format, u8 quality, u8 profile, u8 lossless,
+//           u8 effort, u8 animate, 3 reserved, u64 scale, u64 max dim, u64 input length, u64 output length,
+//           then the input (a path or the file itself) and the output path, which must be empty: the preview is
+//           always sent back, the server writes no files for its clients
+// response: "CPRS", u8 ReturnCode, 3 reserved, u64 preview length, then the preview
+// all numbers are little-endian
+// the socket is 0600 and connections of other users are dropped: paths are opened with the server's rights
+typedef struct T_ServeScratch {
+	OutBuffer in;  // inline inputs and paths
+	OutBuffer out; // the preview
+	Arena arena;   // parse results, reset after every request
+	int busy;      // a worker helping in pool_wait can pick up another request
+} ServeScratch;
+
+typedef struct T_Server {
+	int listen_fd;
+	int wake[2];           // connections come back from the workers through this pipe
+	ServeScratch*scratch;  // one per worker, +1 for threads outside the pool
+	int nscratch;
+	pthread_mutex_t spare_lock; // guards the last scratch
+	TaskGroup group;
+} Server;
+
+typedef struct T_ServeConn {
+	Server*server;
+	int fd;
+} ServeConn;
+
+static volatile sig_atomic_t g_serve_stop = 0;
+static int g_serve_wake = -1; // the signal may hit a worker, the pipe wakes up poll in any case
+
+static void serveSignal(int sig) {
+	(void)sig;
+	g_serve_stop = 1;
+	int stop = -1;
+	if(write(g_serve_wake, &stop, sizeof(int)) < 0) return;
+}
+
+// 1: done, 0: EOF before the first byte, -1: error or EOF in the middle
+static int readFull(int fd, void*buf, size_t len) {
+	size_t off = 0;
+	while(off < len) {
+		ssize_t r = read(fd, (char*)buf + off, len - off);
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		if(r == 0) return (off == 0) ? 0 : -1;
+		off += (size_t)r;
+	}
+	return 1;
+}
+
+static int sendFull(int fd, const void*buf, size_t len) {
+	size_t off = 0;
+	while(off < len) {
+		ssize_t w = send(fd, (const char*)buf + off, len - off, MSG_NOSIGNAL);
+		if(w < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		off += (size_t)w;
+	}
+	return 1;
+}
+
+void storeUInt64(char*const buf, unsigned long long v) {
+	for(unsigned long i=0; i<8; ++i) buf[i] = (char)((v >> (i*8)) & 0xff);
+}
+
+static int serveRespond(int fd, ReturnCode status, const unsigned char*data, size_t len) {
+	char hdr[serve_response_len];
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, "CPRS", 4);
+	hdr[4] = (char)status;
+	storeUInt64(hdr+8, len);
+	if(sendFull(fd, hdr, sizeof(hdr)) < 0) return -1;
+	return len ? sendFull(fd, data, len) : 1;
+}
+
+// 1: answered, the connection can take the next request; 0/-1: close it
+// nested: another request of this thread is further up the stack, holding a part of the memory budget
+static int serveRequest(int fd, ServeScratch*sc, int nested) {
+	char hdr[serve_request_len];
+	int r = readFull(fd, hdr, sizeof(hdr));
+	if(r <= 0) return r;
+	if((memcmp(hdr, "CPRQ", 4) != 0) || (loadUInt8(hdr+4) != serve_version)) {
+		serveRespond(fd, RET_ERR_FORMAT, NULL, 0);
+		return -1; // framing is lost
+	}
+	const FileType ft = (FileType)loadUInt8(hdr+5);
+	const unsigned char source = loadUInt8(hdr+6);
+	EncodeOptions enc;
+	encodeoptions_init(&enc);
+	enc.format = (OutputFormat)loadUInt8(hdr+7);
+	if(loadUInt8(hdr+8)) enc.quality = loadUInt8(hdr+8);
+	enc.profile = (JPGProfile)loadUInt8(hdr+9);
+	enc.lossless = loadUInt8(hdr+10);
+	enc.effort = loadUInt8(hdr+11);
+	enc.animate = loadUInt8(hdr+12);
+	enc.scale = (unsigned int)((loadUInt64(hdr+16) > UINT_MAX) ? UINT_MAX : loadUInt64(hdr+16));
+	enc.maxDim = loadUInt64(hdr+24);
+	const unsigned long long inlen = loadUInt64(hdr+32);
+	const unsigned long long outlen = loadUInt64(hdr+40);
+	if(outlen) { // the field is kept for the framing
+		serveRespond(fd, RET_ERR_CHK, NULL, 0);
+		return -1;
+	}
+	if(inlen > ((source == serve_source_path) ? PATH_MAX : serve_inline_max)) {
+		serveRespond(fd, RET_ERR_RES_CONSTRAINT, NULL, 0);
+		return -1; // the body is not read
+	}
+	// an inline input is counted before it's allocated, a path is too small to count
+	unsigned long long held = (source == serve_source_inline) ? inlen : 0;
+	ReturnCode ret = budget_reserve(held, !nested);
+	if(ret != RET_OK) {
+		serveRespond(fd, ret, NULL, 0);
+		return -1;
+	}
+	sc->in.len = 0;
+	sc->out.len = 0;
+	if(outbuffer_reserve(&sc->in, inlen + 1) != RET_OK) {
+		budget_release(held);
+		serveRespond(fd, RET_ERR_MEM, NULL, 0);
+		return -1;
+	}
+	char*input = (char*)sc->in.data;
+	if(readFull(fd, input, inlen) < 1) { // 0-length reads succeed
+		budget_release(held);
+		return -1;
+	}
+	input[inlen] = '\0';
+
+	FileStats fs;
+	memset(&fs, 0, sizeof(fs));
+	FileStats*outer = t_stats;
+	if(g_stats.enabled) t_stats = &fs;
+	if(source == serve_source_inline) statsCount(STAT_BYTES_IN, inlen);
+	if(((ft != FTYPE_CIFF) && (ft != FTYPE_CAFF)) || (enc.format > FORMAT_WEBP) || (enc.profile > JPG_PROFILE_SMALL) ||
+		(enc.quality < 1) || (enc.quality > 100) || (enc.effort > 6) || ((source != serve_source_path) && (source != serve_source_inline)))
+		ret = RET_ERR_CHK;
+	else if(source == serve_source_path) {
+		InputBuffer file;
+		ret = inputbuffer_open(input, &file, 0);
+		unsigned long long footprint = (ret == RET_OK) ? previewFootprint(file.data, file.len, ft, &enc) : 0;
+		if(ret == RET_OK) ret = budget_reserve(footprint, !nested && !file.reserved);
+		if(ret == RET_OK) {
+			ret = renderPreview(file.data, file.len, ft, &enc, input, &sc->arena, &sc->out);
+			budget_release(footprint);
+		}
+		inputbuffer_clear(&file);
+	}
+	else { // the input is held already; waiting for the rest with it would let two requests block each other
+		unsigned long long footprint = previewFootprint(input, inlen, ft, &enc);
+		ret = budget_reserve(footprint, 0);
+		if((ret == RET_ERR_RES_CONSTRAINT) && !nested && (held + footprint <= g_budget.limit)) { // so it's given back for the wait
+			budget_release(held);
+			ret = budget_reserve(held + footprint, 1);
+			if(ret != RET_OK) held = 0;
+		}
+		if(ret == RET_OK) {
+			ret = renderPreview(input, inlen, ft, &enc, "<inline>", &sc->arena, &sc->out);
+			budget_release(footprint);
+		}
+	}
+	budget_release(held);
+	t_stats = outer;
+	if(g_stats.enabled) statsReport((source == serve_source_path) ? input : "<inline>", ret, &fs);
+	r = serveRespond(fd, ret, sc->out.data, (ret == RET_OK) ? sc->out.len : 0);
+	// scratch is kept for the next request unless a big one blew it up
+	if(sc->in.cap > serve_scratch_keep) outbuffer_clear(&sc->in);
+	if(sc->out.cap > serve_scratch_keep) outbuffer_clear(&sc->out);
+	if(sc->arena.head && (sc->arena.head->cap > serve_scratch_keep)) arena_clear(&sc->arena);
+	else arena_reset(&sc->arena);
+	return r;
+}
+
+static void serveConnection(void*arg) {
+	ServeConn*c = (ServeConn*)arg;
+	Server*srv = c->server;
+	int id = (pool_worker_of == g_pool) ? pool_worker_id : -1;
+	ServeScratch*sc = &srv->scratch[(id >= 0 && id < srv->nscratch - 1) ? id : srv->nscratch - 1];
+	ServeScratch nested;
+	if(id < 0) pthread_mutex_lock(&srv->spare_lock); // the shared slot
+	else if(sc->busy) { // this worker's own request is waiting further up the stack
+		outbuffer_init(&nested.in);
+		outbuffer_init(&nested.out);
+		arena_init(&nested.arena);
+		sc = &nested;
+	}
+	sc->busy = 1;
+	int r = serveRequest(c->fd, sc, sc == &nested);
+	sc->busy = 0;
+	if(sc == &nested) {
+		outbuffer_clear(&nested.in);
+		outbuffer_clear(&nested.out);
+		arena_clear(&nested.arena);
+	}
+	if(id < 0) pthread_mutex_unlock(&srv->spare_lock);
+	if((r > 0) && !g_serve_stop && (write(srv->wake[1], &c->fd, sizeof(int)) == (ssize_t)sizeof(int))) c->fd = -1;
+	if(c->fd >= 0) close(c->fd);
+	free(c);
+}
+
+// -1 if the peer is another user: requests name files, which are opened with the rights of the server
+static int serveAccept(int listen_fd) {
+	int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if(fd < 0) return -1;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if((getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) || (cred.uid != geteuid())) {
+		logError("serve: connection of another user refused\n");
+		close(fd);
+		return -1;
+	}
+	struct timeval tv;
+	tv.tv_sec = serve_timeout;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)); // a request is read only once poll saw it coming
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+int serveMain(const RuntimeConfig*cfg) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(cfg->servePath) >= sizeof(addr.sun_path)) {
+		logError("serve: socket path too long: %s\n", cfg->servePath);
+		return -1;
+	}
+	strcpy(addr.sun_path, cfg->servePath);
+	Server srv;
+	srv.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(srv.listen_fd < 0) return -1;
+	struct stat st;
+	if((lstat(cfg->servePath, &st) == 0) && S_ISSOCK(st.st_mode)) unlink(cfg->servePath); // left over from an earlier run
+	mode_t mask = umask(0177); // no threads yet, the socket is created 0600
+	int bound = bind(srv.listen_fd, (struct sockaddr*)&addr, sizeof(addr));
+	umask(mask);
+	if( (bound != 0) || (listen(srv.listen_fd, 128) != 0) || (pipe2(srv.wake, O_CLOEXEC) != 0) ) {
+		logError("serve: can't listen on %s\n", cfg->servePath);
+		close(srv.listen_fd);
+		return -1;
+	}
+	g_pool = pool_create((cfg->jobs > 1) ? cfg->jobs : hardwareConcurrency());
+	srv.nscratch = (g_pool ? g_pool->nthreads : 0) + 1;
+	srv.scratch = (ServeScratch*)calloc(srv.nscratch, sizeof(ServeScratch));
+	for(int i=0; srv.scratch && (i<srv.nscratch); ++i) arena_init(&srv.scratch[i].arena);
+	pthread_mutex_init(&srv.spare_lock, NULL);
+	g_serve_wake = srv.wake[1];
+	taskgroup_init(&srv.group);
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serveSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	logInfo("serve: listening on %s with %d workers\n", cfg->servePath, srv.nscratch - 1);
+
+	int*idle = NULL; // connections waiting for their next request
+	size_t nidle = 0, capidle = 0;
+	struct pollfd*pfds = NULL;
+	int ret = srv.scratch ? 0 : -1;
+	while(!g_serve_stop && (ret == 0)) {
+		struct pollfd*np = (struct pollfd*)realloc(pfds, (2 + nidle) * sizeof(struct pollfd));
+		if(!np) {
+			ret = -1;
+			break;
+		}
+		pfds = np;
+		pfds[0].fd = srv.listen_fd;
+		pfds[1].fd = srv.wake[0];
+		for(size_t i=0; i<nidle; ++i) pfds[2+i].fd = idle[i];
+		for(size_t i=0; i<2+nidle; ++i) {
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+		}
+		if(poll(pfds, 2 + nidle, -1) < 0) {
+			if(errno != EINTR) ret = -1;
+			continue;
+		}
+		size_t keep = 0;
+		for(size_t i=0; i<nidle; ++i) { // a readable connection has a request (or EOF)
+			if(!pfds[2+i].revents) {
+				idle[keep++] = idle[i];
+				continue;
+			}
+			ServeConn*c = (ServeConn*)malloc(sizeof(ServeConn));
+			if(!c) {
+				close(idle[i]);
+				continue;
+			}
+			c->server = &srv;
+			c->fd = idle[i];
+			if(!g_pool || (pool_submit(g_pool, &srv.group, serveConnection, c) != RET_OK)) serveConnection(c);
+		}
+		nidle = keep;
+		for(int k=0; k<2; ++k) {
+			if(!pfds[k].revents) continue;
+			int fd = -1;
+			if(k == 0) fd = serveAccept(srv.listen_fd);
+			else if(read(srv.wake[0], &fd, sizeof(int)) != (ssize_t)sizeof(int)) fd = -1;
+			if(fd < 0) continue;
+			if(nidle == capidle) {
+				size_t ncap = capidle ? capidle*2 : 16;
+				int*ni = (int*)realloc(idle, ncap * sizeof(int));
+				if(!ni) {
+					close(fd);
+					continue;
+				}
+				idle = ni;
+				capidle = ncap;
+			}
+			idle[nidle++] = fd;
+		}
+	}
+
+	logInfo("serve: shutting down\n");
+	close(srv.listen_fd);
+	if(g_pool) pool_wait(g_pool, &srv.group); // requests in flight are answered, then their connections closed
+	int fd;
+	fcntl(srv.wake[0], F_SETFL, O_NONBLOCK);
+	while(read(srv.wake[0], &fd, sizeof(int)) == (ssize_t)sizeof(int)) if(fd >= 0) close(fd);
+	for(size_t i=0; i<nidle; ++i) close(idle[i]);
+	g_serve_wake = -1;
+	close(srv.wake[0]);
+	close(srv.wake[1]);
+	if(g_pool) {
+		pool_destroy(g_pool);
+		g_pool = NULL;
+	}
+	for(int i=0; srv.scratch && (i<srv.nscratch); ++i) {
+		outbuffer_clear(&srv.scratch[i].in);
+		outbuffer_clear(&srv.scratch[i].out);
+		arena_clear(&srv.scratch[i].arena);
+	}
+	free(srv.scratch);
+	pthread_mutex_destroy(&srv.spare_lock);
+	free(idle);
+	free(pfds);
+	unlink(cfg->servePath);
+	return ret;
+}
+
+// --client: sends every input to a --serve instance and saves the previews like a local run would
+static ReturnCode clientRequest(int fd, const char*fn, FileType ft, const EncodeOptions*enc, int sendInline) {
+	InputBuffer file;
+	inputbuffer_init(&file);
+	char*path = NULL;
+	const char*input = NULL;
+	unsigned long long inlen = 0;
+	if(sendInline) {
+		ReturnCode ret = inputbuffer_open(fn, &file, 0);
+		if(ret != RET_OK) return ret;
+		input = file.data;
+		inlen = file.len;
+	}
+	else { // the server has another working directory
+		path = realpath(fn, NULL);
+		if(!path) return RET_ERR_IO;
+		input = path;
+		inlen = strlen(path);
+	}
+	char hdr[serve_request_len];
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, "CPRQ", 4);
+	hdr[4] = serve_version;
+	hdr[5] = (char)ft;
+	hdr[6] = sendInline ? serve_source_inline : serve_source_path;
+	hdr[7] = (char)enc->format;
+	hdr[8] = (char)enc->quality;
+	hdr[9] = (char)enc->profile;
+	hdr[10] = (char)enc->lossless;
+	hdr[11] = (char)enc->effort;
+	hdr[12] = (char)enc->animate;
+	storeUInt64(hdr+16, enc->scale);
+	storeUInt64(hdr+24, enc->maxDim);
+	storeUInt64(hdr+32, inlen);
+	storeUInt64(hdr+40, 0); // the preview comes back
+	ReturnCode ret = RET_OK;
+	if((sendFull(fd, hdr, sizeof(hdr)) < 0) || (sendFull(fd, input, inlen) < 0)) ret = RET_ERR_IO;
+	free(path);
+	inputbuffer_clear(&file);
+	char rsp[serve_response_len];
+	if((ret == RET_OK) && ((readFull(fd, rsp, sizeof(rsp)) <= 0) || (memcmp(rsp, "CPRS", 4) != 0))) ret = RET_ERR_IO;
+	if(ret != RET_OK) return ret;
+	ret = (ReturnCode)loadUInt8(rsp+4);
+	const unsigned long long len = loadUInt64(rsp+8);
+	OutBuffer out;
+	outbuffer_init(&out);
+	if(outbuffer_reserve(&out, len) != RET_OK) ret = RET_ERR_MEM;
+	else if(len && (readFull(fd, out.data, len) <= 0)) ret = RET_ERR_IO;
+	if((ret == RET_OK) && len) {
+		char*dstname = (char*)malloc(strlen(fn)+8); // ".webp"/".avi"/".jpg" and the '\0'
+		if(!dstname) ret = RET_ERR_MEM;
+		else {
+			previewName(fn, ft, enc, dstname);
+			ret = writeOutput(enc->output ? enc->output : dstname, out.data, len);
+			free(dstname);
+		}
+	}
+	outbuffer_clear(&out);
+	return ret;
+}
+
+int clientMain(const RuntimeConfig*cfg) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(cfg->clientPath) >= sizeof(addr.sun_path)) return -1;
+	strcpy(addr.sun_path, cfg->clientPath);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) return -1;
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		logError("client: can't connect to %s\n", cfg->clientPath);
+		close(fd);
+		return -1;
+	}
+	int ret = 0;
+	for(int i=0; i<cfg->ciffcnt + cfg->caffcnt; ++i) {
+		const int isCIFF = (i < cfg->ciffcnt);
+		const char*fn = isCIFF ? cfg->ciffFiles[i] : cfg->caffFiles[i - cfg->ciffcnt];
+		ReturnCode r = clientRequest(fd, fn, isCIFF ? FTYPE_CIFF : FTYPE_CAFF, &cfg->encode, cfg->clientInline);
+		logAt((r == RET_OK) ? log_info : log_error, "process %s as %s: %s\n", fn, isCIFF ? "CIFF" : "CAFF", rt2s(r));
+		if(r != RET_OK) {
+			ret = -1;
+			if(r == RET_ERR_IO || !cfg->keepGoing) break; // the connection may be out of sync
+		}
+	}
+	close(fd);
+	return ret;
+}
+
+const char* rt2s(const ReturnCode rt) {
+	if(rt == RET_OK) return "RET_OK";
+	else if(rt == RET_ERR_MEM) return "RET_ERR_MEM";
+	else if(rt == RET_ERR_IO) return "RET_ERR_IO";
+	else if(rt == RET_ERR_CHK) return "RET_ERR_CHK";
+	else if(rt == RET_ERR_FORMAT) return "RET_ERR_FORMAT";
+	else if(rt == RET_ERR_RES_CONSTRAINT) return "RET_ERR_RES_CONSTRAINT";
+	else return "UNKNOWN_RETURNCODE";
 }
\ No newline at end of file
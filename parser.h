@@ -0,0 +1,527 @@
+// the parser core, shared by the CLI (main.c), libcaff and the tools built on parser.c
+#ifndef PARSER_H
+#define PARSER_H
+
+// libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+#include <jerror.h>
+#ifdef HAVE_WEBP
+#include <webp/encode.h>
+#include <webp/mux.h>
+#endif
+#include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <semaphore.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// common structs
+typedef enum T_ReturnCode {
+	RET_OK = 0,
+	RET_ERR_MEM,
+	RET_ERR_IO,
+	RET_ERR_CHK,
+	RET_ERR_FORMAT,
+	RET_ERR_RES_CONSTRAINT
+} ReturnCode;
+
+typedef enum T_FileType {
+	FTYPE_CIFF = 1,
+	FTYPE_CAFF
+} FileType;
+
+// pointer + length view, NOT '\0' terminated in view mode
+typedef struct T_CIFFSlice {
+	const char* ptr;
+	unsigned long long len;
+} CIFFSlice;
+
+// bump allocator for the parse results of one file, released together by arena_reset / arena_clear
+// allocations are lock free, the lock is only taken for a new chunk (frames are parsed concurrently)
+typedef struct T_ArenaChunk {
+	struct T_ArenaChunk*next; // older chunks
+	size_t cap;
+	size_t used; // __atomic, runs past cap once the chunk is full
+} ArenaChunk;
+
+typedef struct T_Arena {
+	ArenaChunk*head; // the chunk allocations come from (__atomic)
+	pthread_mutex_t lock;
+} Arena;
+
+// by default caption, tags and imgbuf borrow from the parsed buffer (valid while it's alive)
+// ciff_materialize makes an owned copy of them
+typedef struct T_CIFF {
+	unsigned long long header_size;
+	unsigned long long content_size;
+	unsigned long long width;
+	unsigned long long height;
+	CIFFSlice caption;
+	CIFFSlice* tags;
+	unsigned long long tagcnt;
+	const char*imgbuf;
+	char*storage; // copy of caption+tags+pixels in the arena (NULL in view mode)
+} CIFF;
+
+typedef struct T_CAFFHeader {
+	unsigned long long header_size;
+	unsigned long long num_anim;
+	int block_handled; // if we want to jump back and forth (Not used)
+} CAFFHeader;
+
+typedef struct T_CAFFCredits {
+	unsigned short year;
+	unsigned char month;
+	unsigned char day;
+	unsigned char hour;
+	unsigned char minute;
+	unsigned long long creator_len;
+	char*creator;
+	int block_handled;
+} CAFFCredits;
+
+typedef struct T_CAFFAnimation {
+	unsigned long long duration;
+	CIFF *ciff; // NULL until requested by caff_frame
+	const char*ciff_data; // the embedded CIFF, structurally validated by caffParse
+	unsigned long long ciff_len;
+	unsigned long long hash;    // of the pixels, see caffDedup
+	unsigned long long same_as; // first frame with the same pixels (itself if unique), see caffDedup
+	int block_handled;
+} CAFFAnimation;
+
+typedef enum T_CAFFBlockType {
+	CAFF_BLOCK_HEADER = 0x1,
+	CAFF_BLOCK_CREDITS = 0x2,
+	CAFF_BLOCK_ANIMATION = 0x3
+} CAFFBlockType;
+
+typedef struct T_CAFFBlock {
+	unsigned char type;
+	unsigned long long offset; // of the block data, from the start of the file
+	unsigned long long length;
+} CAFFBlock;
+
+// result of a single walk over the block chain
+typedef struct T_CAFFIndex {
+	CAFFBlock*blocks;               // in file order
+	unsigned long long blockcnt;
+	unsigned long long header_block;  // position in blocks
+	unsigned long long credits_block; // position in blocks, == blockcnt if there is no credits block
+	unsigned long long*frame_blocks;  // frame k -> position in blocks
+	unsigned long long framecnt;
+} CAFFIndex;
+
+typedef struct T_CAFF {
+	CAFFHeader header;
+	CAFFCredits credits;
+	CAFFAnimation*animations;
+	CAFFIndex index;
+	unsigned long long unique_frames; // 0 until caffDedup
+	Arena*arena; // everything above and the frames parsed by caff_frame live here
+} CAFF;
+
+typedef struct T_CAFFStreamCallbacks {
+	// any of them can be NULL, returning anything else than RET_OK stops the stream
+	ReturnCode (*on_header)(void*user, const CAFFHeader*header);
+	ReturnCode (*on_credits)(void*user, const CAFFCredits*credits);
+	ReturnCode (*on_frame)(void*user, unsigned long long k, unsigned long long duration, const CIFF*ciff); // ciff is valid during the call only
+} CAFFStreamCallbacks;
+
+// push parser, holds at most one block (one frame) in memory
+typedef struct T_CAFFStream {
+	CAFFStreamCallbacks cb;
+	void*user;
+	CAFFHeader header;
+	CAFFCredits credits;
+	Arena arena;       // header and credits
+	Arena frame_arena; // reset after every frame
+	char blockhdr[1+8];    // block type + length, may arrive split
+	size_t blockhdr_fill;
+	unsigned char block_type;
+	unsigned long long block_length;
+	char*blockbuf;        // reused for every block that spans chunks
+	unsigned long long blockbuf_cap; // taken from the memory budget
+	unsigned long long blockbuf_fill;
+	unsigned long long frames;
+	unsigned long long consumed; // bytes fed so far
+	ReturnCode status;    // sticky error
+} CAFFStream;
+
+typedef struct T_InputBuffer {
+	const char* data; // what the parsers see
+	size_t len;
+	void* map;        // mmap-ed region (NULL if not mapped)
+	size_t maplen;
+	char* heap;       // fallback read buffer (pipes, non-regular files)
+	size_t reserved;  // of the memory budget, the capacity of heap
+} InputBuffer;
+
+// work-stealing pool: one deque per worker, owners pop from the back, thieves take from the front
+typedef void (*PoolTaskFn)(void*arg);
+
+typedef struct T_TaskGroup {
+	long pending; // accessed with __atomic builtins
+} TaskGroup;
+
+typedef struct T_PoolTask {
+	PoolTaskFn fn;
+	void*arg;
+	TaskGroup*group;
+	struct T_FileStats*stats; // t_stats of the submitter, the task's work is counted for the same file
+} PoolTask;
+
+typedef struct T_WorkQueue {
+	struct T_ThreadPool*pool; // owner pool and worker index, handed to the worker thread
+	int id;
+	pthread_mutex_t lock;
+	PoolTask*tasks; // ring, cap is a power of 2
+	size_t head;    // steal end
+	size_t tail;    // owner end
+	size_t cap;
+} WorkQueue;
+
+typedef struct T_ThreadPool {
+	int nthreads; // number of queues
+	int started;  // number of running workers
+	pthread_t*threads;
+	WorkQueue*queues;
+	pthread_mutex_t lock; // sleeping only, queues have their own locks
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	long queued;          // tasks sitting in the queues (__atomic)
+	unsigned long next;   // round robin for submissions from outside the pool
+	int stop;
+} ThreadPool;
+
+// bounded MPMC ring (Vyukov): every cell carries a sequence number, producers and consumers claim
+// positions with a CAS, the semaphores only count free and used cells so full/empty can block
+typedef struct T_MPMCCell {
+	size_t seq;
+	void*data;
+} MPMCCell;
+
+typedef struct T_MPMCQueue {
+	MPMCCell*cells;
+	size_t mask;  // capacity - 1, the capacity is a power of 2
+	char pad0[64];
+	size_t head;  // next enqueue position (__atomic)
+	char pad1[64];
+	size_t tail;  // next dequeue position (__atomic)
+	char pad2[64];
+	sem_t free;
+	sem_t used;
+} MPMCQueue;
+
+// libjpeg settings presets, see jpgSetup
+typedef enum T_JPGProfile {
+	JPG_PROFILE_BALANCED = 0, // libjpeg defaults (slow integer DCT, standard Huffman tables)
+	JPG_PROFILE_FAST,         // fast integer DCT, standard Huffman tables
+	JPG_PROFILE_SMALL         // optimized Huffman tables, progressive
+} JPGProfile;
+
+// growable output buffer, filled by the JPEG destination manager
+typedef struct T_OutBuffer {
+	unsigned char*data;
+	size_t len;
+	size_t cap;
+} OutBuffer;
+
+typedef enum T_OutputFormat {
+	FORMAT_JPG = 0,
+	FORMAT_WEBP
+} OutputFormat;
+
+typedef enum T_StatsFormat {
+	STATS_OFF = 0,
+	STATS_TEXT,
+	STATS_JSON
+} StatsFormat;
+
+// --stats: where the time of a file goes, see statsBegin / statsEnd
+typedef enum T_StatsStage {
+	STAGE_READ = 0, // open, map or read the input (the page faults of a mapping show up in the later stages)
+	STAGE_PARSE,    // block structure and fixed size headers
+	STAGE_VALIDATE, // caption and tags of the CIFFs
+	STAGE_ENCODE,   // preview encoding and muxing
+	STAGE_WRITE,    // output and cache files
+	STAGE_COUNT
+} StatsStage;
+
+typedef enum T_StatsCounter {
+	STAT_BYTES_IN = 0,
+	STAT_BYTES_OUT,
+	STAT_FRAMES,
+	STAT_UNIQUE_FRAMES, // only if caffDedup ran
+	STAT_TAGS,
+	STAT_ARENA_ALLOCS,
+	STAT_HEAP_ALLOCS,   // arena chunks and output buffer growth (libjpeg's own allocations are not counted)
+	STAT_COUNT
+} StatsCounter;
+
+// updated with __atomic by every thread working on the file
+typedef struct T_FileStats {
+	unsigned long long ns[STAGE_COUNT]; // summed over the threads
+	unsigned long long counters[STAT_COUNT];
+} FileStats;
+
+typedef struct T_RunStats {
+	int enabled;
+	int json;
+	FileStats total; // of the reported files
+} RunStats;
+
+// --cache-dir, shared by the workers
+typedef struct T_PreviewCache {
+	const char*dir;          // NULL: no cache
+	unsigned long long max;  // --cache-max bytes, 0: unlimited
+	unsigned long long bytes; // estimate of the directory size, guarded by lock
+	int scanned;
+	pthread_mutex_t lock;
+} PreviewCache;
+
+// how previews are rendered
+typedef struct T_EncodeOptions {
+	const char*output;           // -o: "-" is stdout, NULL: next to the input
+	OutputFormat format;
+	unsigned int scale;          // box filter factor (0, 1: full resolution)
+	unsigned long long maxDim;   // scale down until width and height fit (0: no limit)
+	JPGProfile profile;
+	int quality;                 // 1..100
+	int lossless;                // webp only
+	int effort;                  // webp only, 0 (fast) .. 6 (small)
+	int animate;                 // CAFF: every frame with its duration instead of the first one
+} EncodeOptions;
+
+// one frame of an animated preview, encoded on its own
+typedef struct T_AnimFrame {
+	CAFF*caff;
+	unsigned long long k;
+	const EncodeOptions*enc;
+	const struct T_PreviewEncoder*encoder;
+	const struct T_AnimFrame*same; // an earlier frame with the same pixels, its payload is used
+	unsigned long long duration; // ms
+	unsigned long long width;    // of the preview
+	unsigned long long height;
+	OutBuffer out;
+	ReturnCode ret;
+} AnimFrame;
+
+// one preview backend, see previewEncoders
+typedef struct T_PreviewEncoder {
+	OutputFormat format;
+	const char*name; // --format
+	const char*ext;
+	const char*animExt;
+	ReturnCode (*encode)(const CIFF* const ciff, const EncodeOptions*enc, OutBuffer*out);
+	ReturnCode (*mux)(const AnimFrame*frames, unsigned long long cnt, OutBuffer*out); // encoded frames in order
+} PreviewEncoder;
+
+typedef struct T_RuntimeConfig {
+	int printHelp;
+	EncodeOptions encode;
+	int jobs;      // 1: sequential, 0 (no -j): sequential except a single large input, see batchThreads
+	int keepGoing; // don't stop the batch on the first failure
+	StatsFormat stats; // --stats: per file and total timings and counters
+	int logLevel;  // -v, --quiet
+	int metadata;  // --metadata: a JSON record per input on stdout instead of a preview
+	const char*cacheDir;
+	unsigned long long cacheMax;
+	unsigned long long memBudget; // --mem-budget bytes, 0: the physical memory
+	const char*servePath;  // --serve: run as a daemon on this socket
+	const char*clientPath; // --client: send the inputs to a daemon
+	int clientInline;      // --inline: send the file contents instead of the path
+	int ciffcnt;
+	char ** ciffFiles;
+	int caffcnt;
+	char ** caffFiles;
+} RuntimeConfig;
+
+// compile time configs
+#define readChunkSize (1ul*1024*1024) // fallback read granularity
+#define pool_queue_initial 64
+#define pipeline_depth 2 // batch: files read ahead per encoding thread
+#define jpg_quality 90
+#define webp_effort 4
+#define anim_default_tick 100 // ms, if every frame has 0 duration
+#define cache_version 1 // bump when the encoders change their output
+#define cache_low_water 75 // %: eviction goes down to this part of --cache-max, the next one is a quarter of it away
+#define serve_version 1
+#define serve_request_len 48
+#define serve_response_len 16
+#define serve_source_path 0
+#define serve_source_inline 1
+#define serve_scratch_keep (16ul*1024*1024) // per worker buffers above this are released after the request
+#define serve_inline_max (256ull*1024*1024) // bigger files are sent by path
+#define serve_timeout 30 // s, a client stalling in the middle of a request or response is dropped
+#define jpg_row_batch 256 // rows handed to jpeg_write_scanlines at once
+#define jpg_scaled_batch_bytes (1ul*1024*1024) // cap of the reduced row batch
+#define jpg_strip_min_rows 128 // below this a strip costs more to set up and stitch than it saves
+#define jpg_strip_min_bytes (4ull*1024*1024) // a single input this large gets the strip pool without -j
+#define ciff_minlen (4ul+8+8+8+8+1)
+#define ciff_offset_header_size 4
+#define ciff_offset_content_size (4+8)
+#define ciff_offset_width (4+8+8)
+#define ciff_offset_height (4+8+8+8)
+#define ciff_offset_caption (4+8+8+8+8)
+#define caff_blockheader_minSize (1+8)
+#define caff_index_initial_blocks 16
+#define arena_align 16
+#define arena_chunk_data ((sizeof(ArenaChunk) + arena_align - 1) & ~(size_t)(arena_align - 1)) // offset of the first allocation
+#define arena_chunk_min (64ul*1024)
+#define caff_header_len (MagicCAFFlen+8+8)
+#define caff_header_offset_header_size (MagicCAFFlen)
+#define caff_header_offset_num_anim (MagicCAFFlen+8)
+#define caff_credirs_offset_year (0)
+#define caff_credirs_offset_month (2)
+#define caff_credirs_offset_day (2+1)
+#define caff_credirs_offset_hour (2+1+1)
+#define caff_credirs_offset_minute (2+1+1+1)
+#define caff_credirs_offset_creator_len (2+1+1+1+1)
+#define caff_credirs_offset_creator (2+1+1+1+1+8)
+#define caff_credits_minlen (2+1+1+1+1+8)
+#define caff_animation_minlen (8+ciff_minlen)
+#define caff_animation_offset_duration (0)
+#define caff_animation_offset_ciff (8)
+
+// admission control: a job reserves its projected footprint before allocating
+typedef struct T_MemBudget {
+	unsigned long long limit; // bytes, 0: no limit (the parser built into another program)
+	unsigned long long used;  // guarded by lock
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} MemBudget;
+
+// log levels: -v adds the parser's debug lines, --quiet leaves the errors only
+#define log_error 0
+#define log_info 1
+#define log_debug 2
+
+extern const char*const MagicCIFF;
+extern const size_t MagicCIFFlen;
+extern const char*const MagicCAFF;
+extern const size_t MagicCAFFlen;
+
+ReturnCode handleFile(const char* const fn, FileType ft, const EncodeOptions*enc);
+ReturnCode handleMetadata(const char* const fn, FileType ft, OutBuffer*record);
+ReturnCode ciffParse(const char* const buf, size_t bufLen, CIFF** ciff_result, Arena*arena);
+ReturnCode ciffParseHeader(const char* const buf, size_t bufLen, CIFF*ciff);
+ReturnCode ciffParseTags(const char* const buf, CIFF ciff, CIFF** ciff_result, Arena*arena);
+ReturnCode caffParse(const char* const buf, size_t bufLen, CAFF** caff_result, Arena*arena);
+ReturnCode caffIndex(const char* const buf, size_t bufLen, CAFFIndex*index, Arena*arena);
+const CAFFBlock* caffindex_frame(const CAFFIndex*index, unsigned long long k);
+ReturnCode caffParseHeaderBlock(const char* const p, unsigned long long len, CAFFHeader*header);
+ReturnCode caffParseCreditsBlock(const char* const p, unsigned long long len, CAFFCredits*credits, Arena*arena);
+ReturnCode caffParseAnimationBlock(const char* const p, unsigned long long len, unsigned long long*duration, CIFF**ciff_result, Arena*arena);
+ReturnCode caffCheckAnimationBlock(const char* const p, unsigned long long len, unsigned long long*duration, CIFF*header);
+ReturnCode caff_frame(CAFF*caff, unsigned long long k, CIFF**ciff);
+void caffstream_init(CAFFStream*s, const CAFFStreamCallbacks*cb, void*user);
+ReturnCode caffstream_feed(CAFFStream*s, const char*chunk, size_t len);
+ReturnCode caffstream_finish(CAFFStream*s);
+void caffstream_clear(CAFFStream*s);
+ReturnCode handleCAFFStream(int fd, const char* const dstname, const EncodeOptions*enc);
+int isStreamInput(const char* const fn);
+unsigned char loadUInt8(const char*const buf);
+unsigned short loadUInt16(const char*const buf);
+unsigned long loadUInt32(const char*const buf);
+unsigned long long loadUInt64(const char*const buf);
+const char* rt2s(const ReturnCode rt);
+ReturnCode toPreview(const CIFF* const ciff, const char* const fn, const EncodeOptions*enc, const char*cachepath);
+const PreviewEncoder* previewEncoder(OutputFormat format);
+ReturnCode encodeWebP(const CIFF* const ciff, const EncodeOptions*enc, OutBuffer*out);
+ReturnCode outbuffer_append(OutBuffer*out, const void*data, size_t len);
+ReturnCode renderPreview(const char* const buf, size_t sz, FileType ft, const EncodeOptions*enc, const char*label, Arena*arena, OutBuffer*out);
+ReturnCode encodePreview(const CIFF* const ciff, const EncodeOptions*enc, const char*label, OutBuffer*out);
+char* cachePath(const InputBuffer*in, FileType ft, const EncodeOptions*enc, const char*ext);
+ReturnCode cacheFetch(const char*path, const char* const fn);
+void cacheStore(const char*path, const unsigned char*data, size_t len);
+ReturnCode encodeAnimation(CAFF*caff, const EncodeOptions*enc, const char*label, OutBuffer*out);
+ReturnCode muxAVI(const AnimFrame*frames, unsigned long long cnt, OutBuffer*out);
+ReturnCode muxWebP(const AnimFrame*frames, unsigned long long cnt, OutBuffer*out);
+unsigned long long xxh64(const void*data, size_t len, unsigned long long seed);
+ReturnCode caffDedup(CAFF*caff);
+void previewSize(const CIFF* const ciff, const EncodeOptions*enc, unsigned long long*width, unsigned long long*height);
+ReturnCode encodeJPG(const CIFF* const ciff, const EncodeOptions*enc, OutBuffer*out);
+ReturnCode encodeJPGStrips(const CIFF* const ciff, ThreadPool*pool, const EncodeOptions*enc, OutBuffer*out);
+ReturnCode encodeJPGScaled(const CIFF* const ciff, unsigned int factor, const EncodeOptions*enc, OutBuffer*out);
+void jpgMemDest(struct jpeg_compress_struct*cinfo, OutBuffer*out, size_t expected);
+struct jpeg_compress_struct* jpgAcquire(void);
+void jpgRelease(struct jpeg_compress_struct*cinfo);
+ReturnCode jpgFail(struct jpeg_compress_struct*cinfo);
+size_t jpgExpectedSize(unsigned long long width, unsigned long long height);
+ReturnCode writeOutput(const char* const fn, const unsigned char*data, size_t len);
+ReturnCode outbuffer_reserve(OutBuffer*out, size_t cap);
+void outbuffer_clear(OutBuffer*out);
+void outbuffer_init(OutBuffer*out);
+void arena_init(Arena*a);
+void arena_clear(Arena*a);
+void arena_reset(Arena*a);
+ReturnCode arena_reserve(Arena*a, size_t size);
+void* arena_alloc(Arena*a, size_t size);
+void* arena_calloc(Arena*a, size_t n, size_t size);
+void jpgSetup(struct jpeg_compress_struct*cinfo, unsigned long long width, unsigned long long height, const EncodeOptions*enc);
+void jpgWriteRows(struct jpeg_compress_struct*cinfo, const char*rows, size_t stride, unsigned long long count);
+const char* jpgProfileName(JPGProfile profile);
+int jpgProfileParse(const char*name, JPGProfile*profile);
+unsigned int scaleFactor(const CIFF* const ciff, const EncodeOptions*enc);
+void ciff_clear(CIFF*ciff);
+void ciff_init(CIFF*ciff);
+ReturnCode ciff_materialize(CIFF*ciff, Arena*arena);
+void caff_clear(CAFF*caff);
+void caff_init(CAFF*caff);
+void caffindex_clear(CAFFIndex*index);
+void caffindex_init(CAFFIndex*index);
+void runtimeconfig_clear(RuntimeConfig*rt);
+void runtimeconfig_init(RuntimeConfig*rt);
+void encodeoptions_init(EncodeOptions*enc);
+void previewName(const char* const fn, FileType ft, const EncodeOptions*enc, char*dst);
+void storeUInt64(char*const buf, unsigned long long v);
+int serveMain(const RuntimeConfig*cfg);
+int clientMain(const RuntimeConfig*cfg);
+int hardwareConcurrency(void);
+void logPrintf(const char*fmt, ...);
+void statsReport(const char*label, ReturnCode ret, const FileStats*fs);
+void statsSummary(int files, int failed, unsigned long long wall_ns);
+ThreadPool* pool_create(int nthreads);
+void pool_destroy(ThreadPool*pool);
+ReturnCode pool_submit(ThreadPool*pool, TaskGroup*group, PoolTaskFn fn, void*arg);
+void pool_wait(ThreadPool*pool, TaskGroup*group);
+void taskgroup_init(TaskGroup*group);
+ReturnCode mpmc_init(MPMCQueue*q, size_t cap);
+void mpmc_clear(MPMCQueue*q);
+void mpmc_push(MPMCQueue*q, void*data);
+void* mpmc_pop(MPMCQueue*q);
+int runBatch(const RuntimeConfig*cfg);
+ReturnCode inputbuffer_open(const char* const fn, InputBuffer*in, int headersOnly);
+ReturnCode inputbuffer_load(const char* const fn, InputBuffer*in, int headersOnly);
+void inputbuffer_clear(InputBuffer*in);
+void inputbuffer_init(InputBuffer*in);
+void inputbuffer_prefetch(const InputBuffer*in);
+ReturnCode budget_reserve(unsigned long long bytes, int wait);
+void budget_release(unsigned long long bytes);
+unsigned long long physicalMemory(void);
+unsigned long long previewFootprint(const char* const buf, size_t len, FileType ft, const EncodeOptions*enc);
+void logConfigure(FILE*out, int level);
+int parserRun(const RuntimeConfig*cfg);
+
+#endif
@@ -0,0 +1,231 @@
+// checks of the parser core that need its internals, see "make test"
+// the parser is compiled into this file like into bench.c; exit 1 if anything failed
+#include "parser.c"
+
+// deterministic inputs: xorshift with a fixed seed
+static unsigned long long testRand(unsigned long long*state) {
+	unsigned long long x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return (*state = x);
+}
+
+// a frame without tags over pixels from the seed: gradients with some noise; free() the pixels
+static void testMakeFrame(CIFF*ciff, unsigned long long w, unsigned long long h, unsigned long long seed) {
+	memset(ciff, 0, sizeof(CIFF));
+	ciff->width = w;
+	ciff->height = h;
+	ciff->content_size = w*h*3;
+	unsigned char*px = (unsigned char*)malloc(ciff->content_size ? ciff->content_size : 1);
+	if(!px) abort();
+	ciff->imgbuf = (const char*)px;
+	unsigned long long st = seed;
+	for(unsigned long long y=0; y<h; ++y)
+		for(unsigned long long x=0; x<w; ++x) {
+			unsigned char n = (unsigned char)(testRand(&st) & 15);
+			*px++ = (unsigned char)(x * 255 / w) ^ n;
+			*px++ = (unsigned char)(y * 255 / h) ^ n;
+			*px++ = (unsigned char)((x + y) & 0xff);
+		}
+}
+
+typedef struct T_YCCKernel {
+	const char*name;
+	YCCRowsFn fn;
+} YCCKernel;
+
+// the kernels this CPU runs, scalar first
+static int testYCCKernels(YCCKernel*k) {
+	int n = 0;
+	k[n].name = "scalar";
+	k[n++].fn = yccRowsScalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("ssse3")) {
+		k[n].name = "ssse3";
+		k[n++].fn = yccRowsSSSE3;
+	}
+	if(__builtin_cpu_supports("avx2")) {
+		k[n].name = "avx2";
+		k[n++].fn = yccRowsAVX2;
+	}
+#endif
+	return n;
+}
+
+// one frame, single threaded: through the planes (and their kernel), or RGB scanlines converted by libjpeg (pl NULL)
+static void testEncodeYCC(const CIFF*ciff, const YCCPlanes*pl, const EncodeOptions*enc, OutBuffer*out) {
+	struct jpeg_compress_struct*cinfo = jpgAcquire();
+	if(!cinfo) abort();
+	if(jpgCatch(cinfo)) abort();
+	jpgMemDest(cinfo, out, jpgExpectedSize(ciff->width, ciff->height));
+	jpgSetup(cinfo, ciff->width, ciff->height, enc);
+	if(pl && !jpgRawInput(cinfo)) abort();
+	jpeg_start_compress(cinfo, TRUE);
+	if(pl) jpgWriteRaw(cinfo, pl, ciff->imgbuf, ciff->width * 3);
+	else jpgWriteRows(cinfo, ciff->imgbuf, ciff->width * 3, ciff->height);
+	jpeg_finish_compress(cinfo);
+	jpgRelease(cinfo);
+}
+
+// the planes of every kernel against the scalar ones on each width up to a few vectors (noise and the extremes)
+static int testYCCRows(void) {
+	YCCKernel kernels[3];
+	const int nk = testYCCKernels(kernels);
+	int bad = 0;
+	enum { maxw = 130 };
+	unsigned char rows[2][maxw*3];
+	unsigned long long st = 11;
+	for(size_t i=0; i<sizeof(rows); ++i) {
+		unsigned long long v = testRand(&st);
+		((unsigned char*)rows)[i] = ((v & 3) == 0) ? 0 : (((v & 3) == 1) ? 255 : (unsigned char)(v >> 8));
+	}
+	YCCPlanes ref, got;
+	if((yccplanes_init(&ref, maxw) != RET_OK) || (yccplanes_init(&got, maxw) != RET_OK)) abort();
+	for(int k=1; k<nk; ++k)
+		for(size_t w=1; w<=maxw; ++w)
+			for(int last=0; last<2; ++last) { // last: the bottom row of an odd height, both rows are the same
+				const unsigned char*r1 = last ? rows[0] : rows[1];
+				const size_t cw = (w + 2*DCTSIZE - 1) / (2*DCTSIZE) * DCTSIZE;
+				yccRowsScalar(rows[0], r1, w, cw, ref.y[0], ref.y[1], ref.cb[0], ref.cr[0]);
+				kernels[k].fn(rows[0], r1, w, cw, got.y[0], got.y[1], got.cb[0], got.cr[0]);
+				if(	memcmp(ref.y[0], got.y[0], 2*cw) || memcmp(ref.y[1], got.y[1], 2*cw) ||
+					memcmp(ref.cb[0], got.cb[0], cw) || memcmp(ref.cr[0], got.cr[0], cw)
+				) {
+					fprintf(stderr, "ycc_rows: %s differs from scalar at width %zu\n", kernels[k].name, w);
+					bad = 1;
+				}
+			}
+	yccplanes_clear(&ref);
+	yccplanes_clear(&got);
+	printf("# ycc_rows: %s (%d kernels)\n", bad ? "FAILED" : "ok", nk);
+	return bad;
+}
+
+// the JPEGs of the raw-data path against the ones libjpeg makes from RGB scanlines, on odd sizes with every
+// profile; one YCCPlanes per kernel serves all of them, the padding of one image must not leak into the next
+static int testYCCJPEG(void) {
+	static const unsigned long long sizes[][2] = { { 1, 1 }, { 2, 3 }, { 17, 9 }, { 33, 31 }, { 100, 7 }, { 255, 300 }, { 40, 40 } };
+	static const JPGProfile profiles[] = { JPG_PROFILE_FAST, JPG_PROFILE_BALANCED, JPG_PROFILE_SMALL };
+	YCCKernel kernels[3];
+	const int nk = testYCCKernels(kernels);
+	YCCPlanes planes[3];
+	for(int k=0; k<nk; ++k) {
+		if(yccplanes_init(&planes[k], 255) != RET_OK) abort();
+		planes[k].convert = kernels[k].fn;
+	}
+	int bad = 0;
+	EncodeOptions enc;
+	encodeoptions_init(&enc);
+	OutBuffer a, b;
+	outbuffer_init(&a);
+	outbuffer_init(&b);
+	for(size_t i=0; i<sizeof(sizes)/sizeof(sizes[0]); ++i) {
+		CIFF ciff;
+		testMakeFrame(&ciff, sizes[i][0], sizes[i][1], 5 + i);
+		for(size_t p=0; p<sizeof(profiles)/sizeof(profiles[0]); ++p) {
+			enc.profile = profiles[p];
+			a.len = 0;
+			testEncodeYCC(&ciff, NULL, &enc, &a);
+			for(int k=0; k<nk; ++k) {
+				YCCPlanes before = planes[k];
+				b.len = 0;
+				testEncodeYCC(&ciff, &planes[k], &enc, &b);
+				if((a.len != b.len) || memcmp(a.data, b.data, a.len)) {
+					fprintf(stderr, "ycc_jpeg: %s JPEG of %llux%llu (%s) differs from libjpeg's conversion\n",
+						kernels[k].name, sizes[i][0], sizes[i][1], jpgProfileName(profiles[p]));
+					bad = 1;
+				}
+				if(memcmp(&before, &planes[k], sizeof(YCCPlanes))) {
+					fprintf(stderr, "ycc_jpeg: the %llux%llu image changed the planes\n", sizes[i][0], sizes[i][1]);
+					bad = 1;
+				}
+			}
+		}
+		free((char*)ciff.imgbuf);
+	}
+	for(int k=0; k<nk; ++k) yccplanes_clear(&planes[k]);
+	outbuffer_clear(&a);
+	outbuffer_clear(&b);
+	printf("# ycc_jpeg: %s\n", bad ? "FAILED" : "bit-exact");
+	return bad;
+}
+
+// a libjpeg error (the destination can't grow) comes back as RET_ERR_MEM with out untouched, and the thread's
+// next encode gets a working compressor; full size and scaled
+static int testJPGError(void) {
+	int bad = 0;
+	CIFF ciff;
+	testMakeFrame(&ciff, 300, 200, 3);
+	EncodeOptions enc;
+	encodeoptions_init(&enc);
+	OutBuffer ref;
+	outbuffer_init(&ref);
+	for(unsigned int scale=1; scale<=2; ++scale) {
+		enc.scale = scale;
+		ref.len = 0;
+		if(encodeJPG(&ciff, &enc, &ref) != RET_OK) abort();
+		OutBuffer full;
+		outbuffer_init(&full);
+		full.len = full.cap = (size_t)1 << 62; // data stays NULL, growing it fails
+		g_log_level = log_error - 1; // the libjpeg message is expected
+		ReturnCode ret = encodeJPG(&ciff, &enc, &full);
+		g_log_level = log_error;
+		if((ret != RET_ERR_MEM) || (full.len != ((size_t)1 << 62)) || full.data) {
+			fprintf(stderr, "jpg_error: scale %u gave %s\n", scale, rt2s(ret));
+			bad = 1;
+		}
+		OutBuffer again;
+		outbuffer_init(&again);
+		ret = encodeJPG(&ciff, &enc, &again);
+		if((ret != RET_OK) || (again.len != ref.len) || memcmp(again.data, ref.data, ref.len)) {
+			fprintf(stderr, "jpg_error: scale %u, the encode after the error gave %s\n", scale, rt2s(ret));
+			bad = 1;
+		}
+		outbuffer_clear(&again);
+	}
+	outbuffer_clear(&ref);
+	free((char*)ciff.imgbuf);
+	printf("# jpg_error: %s\n", bad ? "FAILED" : "ok");
+	return bad;
+}
+
+// storing an entry over one that is already counted adds only the difference to the cache total
+static int testCacheStore(void) {
+	int bad = 0;
+	char dir[] = "/tmp/parser_test.XXXXXX";
+	if(!mkdtemp(dir)) abort();
+	g_cache.dir = dir;
+	g_cache.max = 1ull << 30;
+	g_cache.bytes = 0;
+	g_cache.scanned = 0;
+	unsigned char data[100];
+	memset(data, 7, sizeof(data));
+	char path[sizeof(dir) + 16];
+	snprintf(path, sizeof(path), "%s/entry.jpg", dir);
+	cacheStore(path, data, 100);
+	cacheStore(path, data, 60); // the same key again
+	cacheStore(path, data, 80);
+	if(g_cache.bytes != 80) {
+		fprintf(stderr, "cache_store: the total is %llu after replacing one entry, 80 expected\n", g_cache.bytes);
+		bad = 1;
+	}
+	unlink(path);
+	rmdir(dir);
+	g_cache.dir = NULL;
+	g_cache.max = 0;
+	printf("# cache_store: %s\n", bad ? "FAILED" : "ok");
+	return bad;
+}
+
+int main(void) {
+	g_log = stderr;
+	g_log_level = log_error;
+	int bad = 0;
+	bad |= testYCCRows();
+	bad |= testYCCJPEG();
+	bad |= testJPGError();
+	bad |= testCacheStore();
+	return bad;
+}